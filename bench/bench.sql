@@ -0,0 +1,149 @@
+-- Benchmarks of jsonbx functions on generated documents, see "make bench".
+-- Every function is called :calls times on every document by
+-- jsonbx_bench_call, and the built-in function with the same behaviour
+-- is measured as well, if the server has it (PostgreSQL 9.5+).
+
+\set QUIET on
+SET client_min_messages = warning;
+
+CREATE EXTENSION IF NOT EXISTS jsonbx;
+
+-- Function of the extension by its signature, even if there is a built-in
+-- function with the same name
+CREATE FUNCTION pg_temp.bench_ext(signature text) RETURNS regprocedure AS $$
+    SELECT (quote_ident(n.nspname) || '.' || signature)::regprocedure
+    FROM pg_extension e JOIN pg_namespace n ON n.oid = e.extnamespace
+    WHERE e.extname = 'jsonbx'
+$$ LANGUAGE sql;
+
+-- Path to the deepest value, following nested containers
+CREATE FUNCTION pg_temp.bench_path(doc jsonb) RETURNS text[] AS $$
+DECLARE
+    path text[] := '{}';
+    key text;
+BEGIN
+    LOOP
+        IF jsonb_typeof(doc) = 'object' THEN
+            SELECT k INTO key FROM jsonb_each(doc) e(k, v)
+            ORDER BY jsonb_typeof(v) IN ('object', 'array') DESC, k LIMIT 1;
+            EXIT WHEN key IS NULL;
+            path := path || key;
+            doc := doc -> key;
+        ELSIF jsonb_typeof(doc) = 'array' THEN
+            EXIT WHEN jsonb_array_length(doc) = 0;
+            path := path || '0'::text;
+            doc := doc -> 0;
+        ELSE
+            EXIT;
+        END IF;
+    END LOOP;
+
+    RETURN path;
+END
+$$ LANGUAGE plpgsql;
+
+-- Documents are stored in a table, so the large ones are TOASTed,
+-- and every call has to detoast its argument
+CREATE TEMP TABLE bench_docs (shape text, doc jsonb, path text[], key text, tail jsonb);
+
+INSERT INTO bench_docs (shape, doc)
+VALUES ('small', jsonbx_generate(2, 6, 4, 8, 1)),
+       ('wide', jsonbx_generate(1, 10000, 8, 16, 2)),
+       ('deep', jsonbx_generate(100, 2, 4, 16, 3)),
+       -- a long chain of objects with large siblings (fanout 2 nests only
+       -- the first value), a write along the path must not move the whole
+       -- subtree on every level
+       ('nested', jsonbx_generate(200, 2, 8, 4096, 7)),
+       ('array', jsonbx_generate(3, 30, 0, 16, 4, 'array')),
+       ('mixed', jsonbx_generate(4, 12, 6, 12, 5, 'mixed')),
+       ('toast', jsonbx_generate(2, 40, 8, 512, 6));
+
+UPDATE bench_docs
+SET path = pg_temp.bench_path(doc),
+    key = CASE WHEN jsonb_typeof(doc) = 'object'
+               THEN (SELECT k FROM jsonb_object_keys(doc) k ORDER BY k LIMIT 1)
+               ELSE 'x' END,
+    tail = CASE WHEN jsonb_typeof(doc) = 'object'
+                THEN '{"bench": [1, 2, 3]}'::jsonb ELSE '[1, 2, 3]'::jsonb END;
+
+CREATE TEMP TABLE bench_results (
+    shape text,
+    function text,
+    impl text,
+    calls int,
+    total_ms float8,
+    calls_per_sec float8,
+    p50_us float8,
+    p95_us float8,
+    p99_us float8,
+    max_us float8,
+    bytes_per_call bigint
+);
+
+INSERT INTO bench_results
+SELECT d.shape, 'jsonb_pretty', f.impl, b.*
+FROM bench_docs d,
+     (VALUES ('jsonbx', pg_temp.bench_ext('jsonb_pretty(jsonb)')),
+             ('builtin', to_regprocedure('pg_catalog.jsonb_pretty(jsonb)'))) f(impl, func),
+     LATERAL jsonbx_bench_call(f.func, :calls, d.doc) b
+WHERE f.func IS NOT NULL;
+
+INSERT INTO bench_results
+SELECT d.shape, 'jsonb || jsonb', f.impl, b.*
+FROM bench_docs d,
+     (VALUES ('jsonbx', pg_temp.bench_ext('jsonb_concat(jsonb,jsonb)')),
+             ('builtin', to_regprocedure('pg_catalog.jsonb_concat(jsonb,jsonb)'))) f(impl, func),
+     LATERAL jsonbx_bench_call(f.func, :calls, d.doc, d.tail) b
+WHERE f.func IS NOT NULL;
+
+INSERT INTO bench_results
+SELECT d.shape, 'jsonb - text', f.impl, b.*
+FROM bench_docs d,
+     (VALUES ('jsonbx', pg_temp.bench_ext('jsonb_delete(jsonb,text)')),
+             ('builtin', to_regprocedure('pg_catalog.jsonb_delete(jsonb,text)'))) f(impl, func),
+     LATERAL jsonbx_bench_call(f.func, :calls, d.doc, d.key) b
+WHERE f.func IS NOT NULL;
+
+INSERT INTO bench_results
+SELECT d.shape, 'jsonb - int', f.impl, b.*
+FROM bench_docs d,
+     (VALUES ('jsonbx', pg_temp.bench_ext('jsonb_delete(jsonb,integer)')),
+             ('builtin', to_regprocedure('pg_catalog.jsonb_delete(jsonb,integer)'))) f(impl, func),
+     LATERAL jsonbx_bench_call(f.func, :calls, d.doc, 0) b
+-- the built-in function refuses to delete from an object by index
+WHERE f.func IS NOT NULL AND (f.impl = 'jsonbx' OR jsonb_typeof(d.doc) = 'array');
+
+INSERT INTO bench_results
+SELECT d.shape, 'jsonb - text[]', f.impl, b.*
+FROM bench_docs d,
+     (VALUES ('jsonbx', pg_temp.bench_ext('jsonb_delete(jsonb,text[])')),
+             ('builtin', to_regprocedure('pg_catalog.jsonb_delete_path(jsonb,text[])'))) f(impl, func),
+     LATERAL jsonbx_bench_call(f.func, :calls, d.doc, d.path) b
+WHERE f.func IS NOT NULL;
+
+INSERT INTO bench_results
+SELECT d.shape, 'jsonb_set', f.impl, b.*
+FROM bench_docs d,
+     (VALUES ('jsonbx', pg_temp.bench_ext('jsonb_set(jsonb,text[],jsonb,boolean)')),
+             ('builtin', to_regprocedure('pg_catalog.jsonb_set(jsonb,text[],jsonb,boolean)'))) f(impl, func),
+     LATERAL jsonbx_bench_call(f.func, :calls, d.doc, d.path, '"bench"'::jsonb, true) b
+WHERE f.func IS NOT NULL;
+
+\set QUIET off
+
+SELECT shape,
+       pg_column_size(doc) AS stored_bytes,
+       octet_length(doc::text) AS text_bytes,
+       array_length(path, 1) AS path_len
+FROM bench_docs
+ORDER BY shape;
+
+SELECT function, shape, impl,
+       round(calls_per_sec::numeric) AS calls_per_sec,
+       round(p50_us::numeric, 1) AS p50_us,
+       round(p95_us::numeric, 1) AS p95_us,
+       round(p99_us::numeric, 1) AS p99_us,
+       round(max_us::numeric, 1) AS max_us,
+       bytes_per_call
+FROM bench_results
+ORDER BY function, shape, impl DESC;
@@ -0,0 +1,124 @@
+-- Differential check of the functions, which write jsonb, see "make diffcheck".
+-- Random documents are changed by random calls, and for every function the
+-- digest of the stored bytes of all results (or of the error messages) is
+-- printed. The calls depend only on :seed, so two builds of the extension
+-- must print the same digests, unless the change was meant to alter the
+-- results or their binary layout.
+
+\set QUIET on
+SET client_min_messages = warning;
+
+BEGIN;
+
+CREATE EXTENSION IF NOT EXISTS jsonbx;
+
+-- Both types are varlena, so the cast exposes the stored bytes of jsonb.
+-- It's created only for this transaction, which is rolled back at the end.
+CREATE CAST (jsonb AS bytea) WITHOUT FUNCTION;
+
+-- Random path into the document. It usually follows existing keys and
+-- elements, but can also end at a missing key, a negative or out of range
+-- index, or go through a scalar.
+CREATE FUNCTION pg_temp.diff_path(doc jsonb) RETURNS text[] AS $$
+DECLARE
+    path text[] := '{}';
+    key text;
+    len int;
+BEGIN
+    LOOP
+        IF jsonb_typeof(doc) = 'object' AND random() < 0.9 THEN
+            SELECT k INTO key FROM jsonb_object_keys(doc) k
+            ORDER BY random() LIMIT 1;
+            IF key IS NULL OR random() < 0.15 THEN
+                key := (floor(random() * 10))::int::text;
+            END IF;
+            path := path || key;
+            doc := doc -> key;
+        ELSIF jsonb_typeof(doc) = 'array' AND random() < 0.9 THEN
+            len := jsonb_array_length(doc);
+            path := path || (floor(random() * (2 * len + 3)) - len - 1)::int::text;
+            doc := doc -> path[array_length(path, 1)]::int;
+        ELSE
+            IF array_length(path, 1) IS NULL OR random() < 0.1 THEN
+                path := path || 'x'::text;
+            END IF;
+            EXIT;
+        END IF;
+
+        EXIT WHEN doc IS NULL OR random() < 0.2;
+    END LOOP;
+
+    RETURN path;
+END
+$$ LANGUAGE plpgsql;
+
+-- Small random container, keys without letters ("0", "1" etc.) make equal
+-- keys in different documents likely
+CREATE FUNCTION pg_temp.diff_doc(seed bigint) RETURNS jsonb AS $$
+    SELECT jsonbx_generate(1 + floor(random() * 3)::int,
+                           floor(random() * 7)::int,
+                           floor(random() * 2)::int,
+                           floor(random() * 6)::int,
+                           seed,
+                           (ARRAY['object', 'object', 'array', 'mixed'])[1 + floor(random() * 4)::int])
+$$ LANGUAGE sql VOLATILE;
+
+-- Stored bytes of the result, or the error message. Unused arguments are
+-- passed anyway, so the query doesn't depend on their types.
+CREATE FUNCTION pg_temp.diff_call(query text, doc jsonb, arg1 anyelement, arg2 jsonb)
+RETURNS bytea AS $$
+DECLARE
+    result jsonb;
+BEGIN
+    EXECUTE query INTO result USING doc, arg1, arg2;
+    RETURN result::bytea;
+EXCEPTION WHEN others THEN
+    RETURN convert_to('ERROR: ' || SQLERRM, 'UTF8');
+END
+$$ LANGUAGE plpgsql;
+
+SELECT setseed(:seed) AS seed_is_set \gset
+
+CREATE TEMP TABLE diff_calls AS
+SELECT i, doc, pg_temp.diff_path(doc) AS path, pg_temp.diff_doc(i + 1000000) AS other,
+       (ARRAY['set', 'insert', 'delete'])[1 + floor(random() * 3)::int] AS op
+FROM (SELECT i, pg_temp.diff_doc(i) AS doc
+      FROM generate_series(1, :calls) i) d;
+
+CREATE TEMP TABLE diff_results AS
+SELECT 'jsonb_set' AS function, i,
+       pg_temp.diff_call('SELECT jsonb_set($1, $2, $3, true)', doc, path, other) AS result
+FROM diff_calls
+UNION ALL
+SELECT 'jsonb_set (no create)', i,
+       pg_temp.diff_call('SELECT jsonb_set($1, $2, $3, false)', doc, path, other)
+FROM diff_calls
+UNION ALL
+SELECT 'jsonb - text[]', i,
+       pg_temp.diff_call('SELECT $1 - $2', doc, path, NULL)
+FROM diff_calls
+UNION ALL
+SELECT 'jsonb_modify', i,
+       pg_temp.diff_call(format('SELECT jsonb_modify($1, ARRAY[$2], ARRAY[$3], %L)',
+                                ARRAY[op]), doc, path, other)
+FROM diff_calls
+UNION ALL
+SELECT 'jsonb || jsonb', i,
+       pg_temp.diff_call('SELECT $1 || $3', doc, path, other)
+FROM diff_calls
+UNION ALL
+SELECT 'jsonb #|| jsonb', i,
+       pg_temp.diff_call('SELECT $1 #|| $3', doc, path, other)
+FROM diff_calls;
+
+\set QUIET off
+
+SELECT function,
+       count(*) AS calls,
+       count(*) FILTER (WHERE position(convert_to('ERROR: ', 'UTF8') IN result) = 1) AS errors,
+       md5(string_agg(md5(result), '' ORDER BY i)) AS digest
+FROM diff_results
+GROUP BY function
+ORDER BY function;
+
+ROLLBACK;
@@ -7,6 +7,21 @@ RETURNS text
 AS 'MODULE_PATHNAME', 'jsonb_pretty'
 LANGUAGE C STRICT;
 
+CREATE FUNCTION jsonb_pretty(jsonb, max_depth int, max_bytes int)
+RETURNS text
+AS 'MODULE_PATHNAME', 'jsonb_pretty'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_serialize(jsonb, indent int, compact bool)
+RETURNS text
+AS 'MODULE_PATHNAME', 'jsonb_serialize'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_serialize(jsonb, indent int, compact bool, max_depth int, max_bytes int)
+RETURNS text
+AS 'MODULE_PATHNAME', 'jsonb_serialize'
+LANGUAGE C STRICT;
+
 CREATE FUNCTION jsonb_concat(jsonb, jsonb)
 RETURNS jsonb
 AS 'MODULE_PATHNAME', 'jsonb_concat'
@@ -18,6 +33,28 @@ CREATE OPERATOR || (
 	PROCEDURE = jsonb_concat
 );
 
+-- The same as a || b || c ..., but all values are concatenated at once
+CREATE FUNCTION jsonb_concat(VARIADIC jsonb[])
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_concat_variadic'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_deep_concat(jsonb, jsonb)
+RETURNS jsonb
+AS 'MODULE_PATHNAME', 'jsonb_deep_concat'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_deep_concat(jsonb, jsonb, array_policy text)
+RETURNS jsonb
+AS 'MODULE_PATHNAME', 'jsonb_deep_concat'
+LANGUAGE C STRICT;
+
+CREATE OPERATOR #|| (
+	LEFTARG = jsonb,
+	RIGHTARG = jsonb,
+	PROCEDURE = jsonb_deep_concat
+);
+
 CREATE FUNCTION jsonb_delete(jsonb,text)
 RETURNS jsonb
 AS 'MODULE_PATHNAME','jsonb_delete'
@@ -60,3 +97,299 @@ CREATE FUNCTION jsonb_set(
 RETURNS jsonb
 AS 'MODULE_PATHNAME','jsonb_set'
 LANGUAGE C STRICT;
+
+CREATE TYPE jsonbx_path;
+
+CREATE FUNCTION jsonbx_path_in(cstring)
+RETURNS jsonbx_path
+AS 'MODULE_PATHNAME','jsonbx_path_in'
+LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION jsonbx_path_out(jsonbx_path)
+RETURNS cstring
+AS 'MODULE_PATHNAME','jsonbx_path_out'
+LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION jsonbx_path_recv(internal)
+RETURNS jsonbx_path
+AS 'MODULE_PATHNAME','jsonbx_path_recv'
+LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION jsonbx_path_send(jsonbx_path)
+RETURNS bytea
+AS 'MODULE_PATHNAME','jsonbx_path_send'
+LANGUAGE C STRICT IMMUTABLE;
+
+-- A path, which is parsed and validated only once
+CREATE TYPE jsonbx_path (
+    INPUT = jsonbx_path_in,
+    OUTPUT = jsonbx_path_out,
+    RECEIVE = jsonbx_path_recv,
+    SEND = jsonbx_path_send,
+    INTERNALLENGTH = VARIABLE,
+    ALIGNMENT = int4,
+    STORAGE = extended
+);
+
+CREATE FUNCTION jsonbx_path(text[])
+RETURNS jsonbx_path
+AS 'MODULE_PATHNAME','jsonbx_path_from_text_array'
+LANGUAGE C STRICT IMMUTABLE;
+
+CREATE CAST (text[] AS jsonbx_path)
+WITH FUNCTION jsonbx_path(text[]) AS ASSIGNMENT;
+
+-- Not an overload of jsonb_set, otherwise a path literal would match both
+-- text[] and jsonbx_path, and a call with it would be ambiguous
+CREATE FUNCTION jsonbx_set(
+    jsonb_in jsonb,
+    path jsonbx_path,
+    replacement jsonb,
+    create_if_missing boolean DEFAULT true
+)
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_set_jsonbx_path'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_delete(jsonb,jsonbx_path)
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_delete_jsonbx_path'
+LANGUAGE C STRICT;
+
+CREATE OPERATOR - (
+	LEFTARG = jsonb,
+	RIGHTARG = jsonbx_path,
+	PROCEDURE = jsonb_delete
+);
+
+CREATE FUNCTION jsonb_modify(
+    jsonb_in jsonb,
+    paths text[],
+    replacements jsonb[],
+    operations text[]
+)
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_modify'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_array_delete_range(
+    jsonb_in jsonb,
+    path text[],
+    from_idx int,
+    to_idx int
+)
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_array_delete_range'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_array_insert(
+    jsonb_in jsonb,
+    path text[],
+    idx int,
+    new_values jsonb[]
+)
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_array_insert'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_delete_keys(jsonb, text[])
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_delete_keys'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_select_keys(jsonb, text[])
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_select_keys'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_strip_key(jsonb, keys text[])
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_strip_key'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_increment(
+    jsonb_in jsonb,
+    path text[],
+    delta numeric DEFAULT 1
+)
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_increment'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_diff(jsonb, jsonb)
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_diff'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonb_patch(jsonb, jsonb)
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_patch'
+LANGUAGE C STRICT;
+
+CREATE TYPE jsonbx_array;
+
+CREATE FUNCTION jsonbx_array_in(cstring)
+RETURNS jsonbx_array
+AS 'MODULE_PATHNAME','jsonbx_array_in'
+LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION jsonbx_array_out(jsonbx_array)
+RETURNS cstring
+AS 'MODULE_PATHNAME','jsonbx_array_out'
+LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION jsonbx_array_recv(internal)
+RETURNS jsonbx_array
+AS 'MODULE_PATHNAME','jsonbx_array_recv'
+LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION jsonbx_array_send(jsonbx_array)
+RETURNS bytea
+AS 'MODULE_PATHNAME','jsonbx_array_send'
+LANGUAGE C STRICT IMMUTABLE;
+
+-- A jsonb array, which is stored in chunks, so an append rebuilds only the
+-- last one. It's not compressed by default, otherwise every append would
+-- compress the whole array again.
+CREATE TYPE jsonbx_array (
+    INPUT = jsonbx_array_in,
+    OUTPUT = jsonbx_array_out,
+    RECEIVE = jsonbx_array_recv,
+    SEND = jsonbx_array_send,
+    INTERNALLENGTH = VARIABLE,
+    ALIGNMENT = int4,
+    STORAGE = external
+);
+
+CREATE FUNCTION jsonbx_array(jsonb)
+RETURNS jsonbx_array
+AS 'MODULE_PATHNAME','jsonbx_array_from_jsonb'
+LANGUAGE C STRICT IMMUTABLE;
+
+CREATE CAST (jsonb AS jsonbx_array)
+WITH FUNCTION jsonbx_array(jsonb) AS ASSIGNMENT;
+
+-- The implicit cast makes all jsonb functions and operators available for
+-- jsonbx_array, e.g. jsonb_pretty and ->
+CREATE FUNCTION jsonb(jsonbx_array)
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonbx_array_to_jsonb'
+LANGUAGE C STRICT IMMUTABLE;
+
+CREATE CAST (jsonbx_array AS jsonb)
+WITH FUNCTION jsonb(jsonbx_array) AS IMPLICIT;
+
+CREATE FUNCTION jsonbx_array_append(jsonbx_array, jsonb)
+RETURNS jsonbx_array
+AS 'MODULE_PATHNAME','jsonbx_array_append'
+LANGUAGE C STRICT;
+
+CREATE OPERATOR || (
+	LEFTARG = jsonbx_array,
+	RIGHTARG = jsonb,
+	PROCEDURE = jsonbx_array_append
+);
+
+CREATE FUNCTION jsonbx_array_delete(jsonbx_array, int)
+RETURNS jsonbx_array
+AS 'MODULE_PATHNAME','jsonbx_array_delete_idx'
+LANGUAGE C STRICT;
+
+CREATE OPERATOR - (
+	LEFTARG = jsonbx_array,
+	RIGHTARG = int,
+	PROCEDURE = jsonbx_array_delete
+);
+
+CREATE FUNCTION jsonb_concat_agg_transfn(internal, jsonb)
+RETURNS internal
+AS 'MODULE_PATHNAME','jsonb_concat_agg_transfn'
+LANGUAGE C;
+
+CREATE FUNCTION jsonb_concat_agg_finalfn(internal)
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonb_concat_agg_finalfn'
+LANGUAGE C;
+
+CREATE AGGREGATE jsonb_concat_agg(jsonb) (
+    SFUNC = jsonb_concat_agg_transfn,
+    STYPE = internal,
+    FINALFUNC = jsonb_concat_agg_finalfn
+);
+
+CREATE FUNCTION jsonbx_generate(
+    depth int,
+    fanout int,
+    key_len int,
+    string_len int,
+    seed bigint,
+    shape text DEFAULT 'object'
+)
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonbx_generate'
+LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION jsonbx_bench_call(
+    func regprocedure,
+    ncalls int,
+    VARIADIC args "any",
+    OUT calls int,
+    OUT total_ms float8,
+    OUT calls_per_sec float8,
+    OUT p50_us float8,
+    OUT p95_us float8,
+    OUT p99_us float8,
+    OUT max_us float8,
+    OUT bytes_per_call bigint
+)
+AS 'MODULE_PATHNAME','jsonbx_bench_call'
+LANGUAGE C STRICT;
+
+-- Any function can be called by it, so it's not available by default,
+-- EXECUTE of the called function is checked anyway
+REVOKE ALL ON FUNCTION jsonbx_bench_call(regprocedure, int, "any") FROM PUBLIC;
+
+CREATE FUNCTION jsonbx_stats(
+    OUT funcname text,
+    OUT calls bigint,
+    OUT noop_calls bigint,
+    OUT input_bytes bigint,
+    OUT output_bytes bigint,
+    OUT total_time float8,
+    OUT peak_memory bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME','jsonbx_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW jsonbx_stats AS SELECT * FROM jsonbx_stats();
+
+CREATE FUNCTION jsonbx_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME','jsonbx_stats_reset'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION jsonbx_stats_reset() FROM PUBLIC;
+
+-- Chains of jsonb_set, jsonb_delete and || are folded into one call of
+-- jsonbx_chain by the planner, see jsonbx_chain_transform
+CREATE FUNCTION jsonbx_chain(doc jsonb, ops text[], VARIADIC args "any")
+RETURNS jsonb
+AS 'MODULE_PATHNAME','jsonbx_chain'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION jsonbx_chain_transform(internal)
+RETURNS internal
+AS 'MODULE_PATHNAME','jsonbx_chain_transform'
+LANGUAGE C STRICT;
+
+-- There is no DDL for a transform, so it's set in the catalog directly, and
+-- this needs a superuser. pg_dump doesn't dump it, since the functions belong
+-- to the extension, and the script isn't run again by pg_dump or pg_upgrade,
+-- so after an upgrade the transform is lost until the extension is created
+-- again. Calls of jsonbx_chain still work then, only the folding doesn't.
+UPDATE pg_catalog.pg_proc
+SET protransform = 'jsonbx_chain_transform(internal)'::regprocedure
+WHERE probin = 'MODULE_PATHNAME'
+  AND prosrc IN ('jsonb_set', 'jsonb_set_jsonbx_path', 'jsonb_delete',
+                 'jsonb_delete_path', 'jsonb_delete_jsonbx_path', 'jsonb_concat');
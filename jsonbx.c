@@ -1,44 +1,166 @@
 #include "postgres.h"
 
+#include "access/hash.h"
 #include "catalog/pg_type.h"
+#include "miscadmin.h"
 #include "utils/jsonb.h"
 #include "utils/builtins.h"
+#include "utils/numeric.h"
 
 #include "jsonbx.h"
 
 PG_MODULE_MAGIC;
 
-PG_FUNCTION_INFO_V1(jsonb_pretty);
-Datum jsonb_pretty(PG_FUNCTION_ARGS);
+void _PG_init(void);
 
-PG_FUNCTION_INFO_V1(jsonb_concat);
-Datum jsonb_concat(PG_FUNCTION_ARGS);
+JSONBX_FUNCTION(jsonb_pretty, JSONBX_STATS_PRETTY)
+JSONBX_FUNCTION(jsonb_serialize, JSONBX_STATS_SERIALIZE)
+JSONBX_FUNCTION(jsonb_concat, JSONBX_STATS_CONCAT)
+JSONBX_FUNCTION(jsonb_concat_variadic, JSONBX_STATS_CONCAT_VARIADIC)
+JSONBX_FUNCTION(jsonb_deep_concat, JSONBX_STATS_DEEP_CONCAT)
+JSONBX_FUNCTION(jsonb_delete, JSONBX_STATS_DELETE)
+JSONBX_FUNCTION(jsonb_delete_idx, JSONBX_STATS_DELETE_IDX)
+JSONBX_FUNCTION(jsonb_delete_path, JSONBX_STATS_DELETE_PATH)
+JSONBX_FUNCTION(jsonb_set, JSONBX_STATS_SET)
+JSONBX_FUNCTION(jsonb_set_jsonbx_path, JSONBX_STATS_SET_JSONBX_PATH)
+JSONBX_FUNCTION(jsonb_delete_jsonbx_path, JSONBX_STATS_DELETE_JSONBX_PATH)
+JSONBX_FUNCTION(jsonb_array_delete_range, JSONBX_STATS_ARRAY_DELETE_RANGE)
+JSONBX_FUNCTION(jsonb_array_insert, JSONBX_STATS_ARRAY_INSERT)
+JSONBX_FUNCTION(jsonb_modify, JSONBX_STATS_MODIFY)
+JSONBX_FUNCTION(jsonb_delete_keys, JSONBX_STATS_DELETE_KEYS)
+JSONBX_FUNCTION(jsonb_select_keys, JSONBX_STATS_SELECT_KEYS)
+JSONBX_FUNCTION(jsonb_strip_key, JSONBX_STATS_STRIP_KEY)
+JSONBX_FUNCTION(jsonb_concat_agg_transfn, JSONBX_STATS_CONCAT_AGG_TRANSFN)
+JSONBX_FUNCTION(jsonb_concat_agg_finalfn, JSONBX_STATS_CONCAT_AGG_FINALFN)
+JSONBX_FUNCTION(jsonb_increment, JSONBX_STATS_INCREMENT)
 
-PG_FUNCTION_INFO_V1(jsonb_delete);
-Datum jsonb_delete(PG_FUNCTION_ARGS);
+/*
+ * Transition state of jsonb_concat_agg. Until the first two values are
+ * seen, it's unknown whether the result is an object or an array, so
+ * the first value is kept as is. Then only the values of the result are
+ * kept: an object has one pair per key, which is found by the hash table
+ * of pair indexes, and a new value of the key replaces the old one.
+ */
+typedef struct JsonbConcatState
+{
+	Jsonb		   *first;
+	int				ninputs;
+	bool			isObject;
+	JsonbPair	   *pairs;
+	int				npairs;
+	int				pairsSize;
+	int			   *hashslots;	/* pair indexes, -1 for an empty slot */
+	int				hashsize;	/* power of 2 */
+	JsonbValue	   *elems;
+	int				nelems;
+	int				elemsSize;
+} JsonbConcatState;
+
+/*
+ * Arguments of jsonb_set and jsonb_delete_path, which are prepared only once
+ * for all calls from the same place, if they are constant.
+ */
+typedef struct SetPathCache
+{
+	JsonbPath	   *path;
+	bool			hasValue;
+	JsonbValue		value;
+} SetPathCache;
 
-PG_FUNCTION_INFO_V1(jsonb_delete_idx);
-Datum jsonb_delete_idx(PG_FUNCTION_ARGS);
+static SetPathCache * getSetPathCache(FunctionCallInfo fcinfo, SetPathCache *local);
+static JsonbPath * getJsonbPathArg(FunctionCallInfo fcinfo, int argno);
+static JsonbPath * getJsonbxPathArg(FunctionCallInfo fcinfo, int argno);
+static JsonbContainer * getJsonbPathArray(Jsonb *in, JsonbPath *path);
+static Jsonb * spliceJsonbPath(Jsonb *in, JsonbPath *path, JsonbContainer *array,
+							   int from, int to, Jsonb **items, int nitems);
+static JsonbValue * getJsonbValueArg(FunctionCallInfo fcinfo, int argno, JsonbValue *buf);
+static Jsonb * mergeJsonbObjects(Jsonb **objects, int nobjects);
+static Jsonb * filterJsonbKeys(Jsonb *in, ArrayType *keys, bool keep);
+static Datum * getSortedTextKeys(ArrayType *keys, int *nkeys);
+static bool stripJsonbKeys(JsonbContainer *container, Datum *keys, int nkeys,
+						   JsonbWriter *w);
+static bool findTextKey(Datum *keys, int nkeys, char *key, int keylen);
+static int compareTextKeys(const void *a, const void *b);
+static void appendConcatState(JsonbConcatState *state, Jsonb *jb, MemoryContext aggcontext);
+static void appendConcatElement(JsonbConcatState *state, JsonbContainer *container, int len,
+								MemoryContext aggcontext);
+static void appendConcatValue(JsonbConcatState *state, JsonbValue *v, MemoryContext aggcontext);
+static void setConcatPair(JsonbConcatState *state, JsonbValue *key, JsonbValue *value,
+						  MemoryContext aggcontext);
+static void growConcatHash(JsonbConcatState *state, MemoryContext aggcontext);
+static void copyConcatValue(JsonbValue *v, MemoryContext aggcontext);
+static void freeConcatValue(JsonbValue *v);
+static int compareConcatPairs(const void *a, const void *b);
 
-PG_FUNCTION_INFO_V1(jsonb_delete_path);
-Datum jsonb_delete_path(PG_FUNCTION_ARGS);
+/*
+ * _PG_init:
+ * Module load callback, see JsonbxStatsInit.
+ */
+void
+_PG_init(void)
+{
+	JsonbxStatsInit();
+}
 
-PG_FUNCTION_INFO_V1(jsonb_set);
-Datum jsonb_set(PG_FUNCTION_ARGS);
 
 /*
  * jsonb_pretty:
- * Pretty-printed text for the jsonb
+ * Pretty-printed text for the jsonb. Optional max_depth and max_bytes
+ * arguments allow to get a preview of a large document: deeper containers
+ * are replaced by the number of their elements, and output stops after
+ * max_bytes.
+ */
+static Datum
+jsonb_pretty_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb			   *jb = PG_GETARG_JSONB(0);
+	JsonbOutputFormat	format;
+
+	format.indent = 4;
+	format.compact = false;
+	format.max_depth = -1;
+	format.max_bytes = -1;
+
+	if (PG_NARGS() > 1)
+	{
+		format.max_depth = PG_GETARG_INT32(1);
+		format.max_bytes = PG_GETARG_INT32(2);
+	}
+
+	PG_RETURN_TEXT_P(JsonbToText(&jb->root, &format));
+}
+
+
+/*
+ * jsonb_serialize:
+ * Text for the jsonb with the given number of spaces per nesting level
+ * (everything is on one line for zero), and without any spaces after commas
+ * and colons in the compact mode. Optional max_depth and max_bytes work
+ * as for jsonb_pretty.
  */
-Datum
-jsonb_pretty(PG_FUNCTION_ARGS)
+static Datum
+jsonb_serialize_internal(PG_FUNCTION_ARGS)
 {
-	Jsonb	   *jb = PG_GETARG_JSONB(0);
-	StringInfo	str = makeStringInfo();
+	Jsonb			   *jb = PG_GETARG_JSONB(0);
+	JsonbOutputFormat	format;
+
+	format.indent = PG_GETARG_INT32(1);
+	format.compact = PG_GETARG_BOOL(2);
+	format.max_depth = -1;
+	format.max_bytes = -1;
+
+	if (format.indent < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("indent must not be negative")));
 
-	JsonbToCStringWorker(str, &jb->root, VARSIZE(jb), true);
+	if (PG_NARGS() > 3)
+	{
+		format.max_depth = PG_GETARG_INT32(3);
+		format.max_bytes = PG_GETARG_INT32(4);
+	}
 
-	PG_RETURN_TEXT_P(cstring_to_text_with_len(str->data, str->len));
+	PG_RETURN_TEXT_P(JsonbToText(&jb->root, &format));
 }
 
 
@@ -54,50 +176,269 @@ jsonb_pretty(PG_FUNCTION_ARGS)
  * original array, and one extra element (which is actually
  * other argument of this function with type jbvObject) at the first or last position.
  */
-Datum
-jsonb_concat(PG_FUNCTION_ARGS)
+static Datum
+jsonb_concat_internal(PG_FUNCTION_ARGS)
 {
-	Jsonb 				*jb1 = PG_GETARG_JSONB(0);
+	Jsonb 				*jb1 = PG_GETARG_JSONB_INPUT(0);
 	Jsonb 				*jb2 = PG_GETARG_JSONB(1);
-	Jsonb 				*out = palloc(VARSIZE(jb1) + VARSIZE(jb2));
-	JsonbParseState 	*state = NULL;
-	JsonbValue 			*res;
+
+	PG_RETURN_JSONB(concatJsonbPair(jb1, jb2));
+}
+
+
+/*
+ * concatJsonbPair:
+ * Common part of jsonb_concat and concatJsonbs. If one of the values is
+ * empty, the other one is returned as is.
+ */
+Jsonb *
+concatJsonbPair(Jsonb *jb1, Jsonb *jb2)
+{
+	JsonbWriter			w;
 	JsonbIterator 		*it1, *it2;
 
-	/*
-	 * If one of the jsonb is empty,
-	 * just return other.
-	 */
 	if (JB_ROOT_COUNT(jb1) == 0)
+		return jb2;
+	else if (JB_ROOT_COUNT(jb2) == 0)
+		return jb1;
+
+	it1 = JsonbIteratorInit(&jb1->root);
+	it2 = JsonbIteratorInit(&jb2->root);
+
+	initJsonbWriter(&w, VARSIZE(jb1) + VARSIZE(jb2));
+	IteratorConcat(&it1, &it2, &w);
+
+	return finishJsonbWriter(&w);
+}
+
+
+/*
+ * jsonb_concat_variadic:
+ * The same as a || b || c ... for any number of values, but objects are
+ * merged and arrays are appended all at once (see concatJsonbs).
+ * NULL is returned if any of the values is NULL, as || does.
+ */
+static Datum
+jsonb_concat_variadic_internal(PG_FUNCTION_ARGS)
+{
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(0);
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	Jsonb	  **jbs;
+	int			i;
+
+	if (ARR_NDIM(array) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("wrong number of array subscripts")));
+
+	deconstruct_array(array, JSONBOID, -1, false, 'i', &elems, &nulls, &nelems);
+
+	if (nelems == 0)
+		PG_RETURN_NULL();
+
+	jbs = palloc(sizeof(Jsonb *) * nelems);
+
+	for (i = 0; i < nelems; i++)
+	{
+		if (nulls[i])
+			PG_RETURN_NULL();
+
+		jbs[i] = DatumGetJsonb(elems[i]);
+	}
+
+	PG_RETURN_JSONB(concatJsonbs(jbs, nelems));
+}
+
+
+/*
+ * concatJsonbs:
+ * Concatenate the values from left to right with the same result as ||.
+ * If all of them are objects, their sorted keys are merged at once, and the
+ * last value of a key wins. If all of them are arrays, their elements are
+ * copied into the new array in bulk. Any other combination is concatenated
+ * pair by pair.
+ */
+Jsonb *
+concatJsonbs(Jsonb **jbs, int njbs)
+{
+	bool		objects = true;
+	bool		arrays = true;
+	bool		owned = false;
+	Jsonb	   *res;
+	int			i;
+
+	if (njbs == 1)
+		return jbs[0];
+
+	for (i = 0; i < njbs; i++)
 	{
-		memcpy(out, jb2, VARSIZE(jb2));
-		PG_RETURN_POINTER(out);
+		objects = objects && JB_ROOT_IS_OBJECT(jbs[i]);
+		arrays = arrays && JB_ROOT_IS_ARRAY(jbs[i]) && !JB_ROOT_IS_SCALAR(jbs[i]);
 	}
-	else if (JB_ROOT_COUNT(jb2) == 0) 
+
+	if (objects)
+		return mergeJsonbObjects(jbs, njbs);
+
+	if (arrays)
+		return JsonbArrayConcat(jbs, njbs);
+
+	/* || may return one of its arguments, only new values are freed */
+	res = jbs[0];
+	for (i = 1; i < njbs; i++)
 	{
-		memcpy(out, jb1, VARSIZE(jb1));
-		PG_RETURN_POINTER(out);
+		Jsonb	   *prev = res;
+
+		res = concatJsonbPair(prev, jbs[i]);
+		if (res != prev)
+		{
+			if (owned)
+				pfree(prev);
+			owned = res != jbs[i];
+		}
 	}
 
-	it1 = JsonbIteratorInit(&jb1->root);
-	it2 = JsonbIteratorInit(&jb2->root);
+	return res;
+}
+
 
-	res = IteratorConcat(&it1, &it2, &state);
+/*
+ * mergeJsonbObjects:
+ * k-way merge of the objects. Keys of every object are already sorted, so
+ * on every step the least key among the current keys of all objects goes
+ * to the result with the value from the last object, which has this key.
+ * Keys and values are taken from the containers by their JEntries, and the
+ * result is serialized once.
+ */
+static Jsonb *
+mergeJsonbObjects(Jsonb **objects, int nobjects)
+{
+	int		   *pos = palloc0(sizeof(int) * nobjects);
+	JsonbValue	res;
+	JsonbValue	key;
+	int			estimated_len = 0;
+	int			npairs = 0;
+	int			i;
 
-	if (res == NULL || (res->type == jbvArray && res->val.array.nElems == 0) ||
-					   (res->type == jbvObject && res->val.object.nPairs == 0) )
+	for (i = 0; i < nobjects; i++)
 	{
-		SET_VARSIZE(out, VARHDRSZ);
+		npairs += JB_ROOT_COUNT(objects[i]);
+		estimated_len += VARSIZE(objects[i]);
 	}
-	else
+
+	res.type = jbvObject;
+	res.val.object.pairs = palloc(sizeof(JsonbPair) * Max(npairs, 1));
+	res.val.object.nPairs = 0;
+
+	for (;;)
+	{
+		JsonbPair  *pair = &res.val.object.pairs[res.val.object.nPairs];
+		int			last = -1;
+
+		/* find the least key */
+		for (i = 0; i < nobjects; i++)
+		{
+			JsonbValue	k;
+
+			if (pos[i] >= JB_ROOT_COUNT(objects[i]))
+				continue;
+
+			getJsonbContainerValue(&objects[i]->root, pos[i], &k);
+
+			if (last < 0 || compareJsonbKeys(k.val.string.val, k.val.string.len,
+											 key.val.string.val,
+											 key.val.string.len) < 0)
+			{
+				key = k;
+				last = i;
+			}
+		}
+
+		if (last < 0)
+			break;
+
+		/* skip the key in all objects, the last one gives the value */
+		for (i = last + 1; i < nobjects; i++)
+		{
+			JsonbValue	k;
+
+			if (pos[i] >= JB_ROOT_COUNT(objects[i]))
+				continue;
+
+			getJsonbContainerValue(&objects[i]->root, pos[i], &k);
+
+			if (compareJsonbKeys(k.val.string.val, k.val.string.len,
+								 key.val.string.val, key.val.string.len) == 0)
+			{
+				pos[last]++;
+				last = i;
+			}
+		}
+
+		pair->key = key;
+		getJsonbContainerValue(&objects[last]->root,
+							   JB_ROOT_COUNT(objects[last]) + pos[last], &pair->value);
+		pair->order = res.val.object.nPairs++;
+		pos[last]++;
+	}
+
+	pfree(pos);
+
+	return JsonbValueToJsonbWorker(&res, estimated_len);
+}
+
+
+/*
+ * jsonb_deep_concat:
+ * Recursive concatenation of two jsonb. Objects are merged as in jsonb_concat,
+ * but if both of them have an object under the same key, these objects are
+ * merged too, and so on for any nesting level. Arrays are handled according
+ * to the optional policy:
+ * - replace (default): the second array replaces the first one
+ * - append: elements of the second array are appended to the first one
+ * - union: the same as append, but skipping elements, which are already present
+ * In all other cases the second value replaces the first one.
+ */
+static Datum
+jsonb_deep_concat_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb 				*jb1 = PG_GETARG_JSONB_INPUT(0);
+	Jsonb 				*jb2 = PG_GETARG_JSONB(1);
+	int					mode = JSONB_CONCAT_REPLACE;
+	JsonbWriter			w;
+
+	if (PG_NARGS() > 2)
 	{
-		if (res->type == jbvArray && res->val.array.nElems > 1)
-			res->val.array.rawScalar = false;
+		char	*policy = text_to_cstring(PG_GETARG_TEXT_PP(2));
 
-		out = JsonbValueToJsonb(res);
+		if (strcmp(policy, "replace") == 0)
+			mode = JSONB_CONCAT_REPLACE;
+		else if (strcmp(policy, "append") == 0)
+			mode = JSONB_CONCAT_APPEND;
+		else if (strcmp(policy, "union") == 0)
+			mode = JSONB_CONCAT_UNION;
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("unknown array policy \"%s\"", policy),
+					 errhint("Valid policies are \"replace\", \"append\" and \"union\".")));
 	}
 
-	PG_RETURN_JSONB(out);
+	/* the second jsonb wins anyway */
+	if (JB_ROOT_COUNT(jb1) == 0)
+	{
+		PG_RETURN_JSONB(jb2);
+	}
+
+	initJsonbWriter(&w, VARSIZE(jb1) + VARSIZE(jb2));
+
+	if (!deepConcatContainers(&jb1->root, &jb2->root, mode, &w))
+	{
+		PG_RETURN_JSONB(jb2);
+	}
+
+	PG_RETURN_JSONB(finishJsonbWriter(&w));
 }
 
 
@@ -107,19 +448,32 @@ jsonb_concat(PG_FUNCTION_ARGS)
  * Item is a one key or element from jsonb, specified by name.
  * If there are many keys or elements with than name,
  * the first one will be removed.
+ * Only the top level of jsonb is considered. Object key is found with
+ * the binary search, and if there is no such key, jsonb is returned as is.
  */
-Datum
-jsonb_delete(PG_FUNCTION_ARGS)
+static Datum
+jsonb_delete_internal(PG_FUNCTION_ARGS)
 {
-	Jsonb 				*in = PG_GETARG_JSONB(0);
+	Jsonb 				*in = PG_GETARG_JSONB_INPUT(0);
 	text 				*key = PG_GETARG_TEXT_PP(1);
-	char 				*keyptr = VARDATA_ANY(key);
-	int					keylen = VARSIZE_ANY_EXHDR(key);
-	JsonbParseState 	*state = NULL;
+
+	PG_RETURN_JSONB(deleteJsonbKey(in, VARDATA_ANY(key), VARSIZE_ANY_EXHDR(key)));
+}
+
+
+/*
+ * deleteJsonbKey:
+ * Common part of jsonb_delete(jsonb, text) and jsonbx_chain.
+ */
+Jsonb *
+deleteJsonbKey(Jsonb *in, char *keyptr, int keylen)
+{
+	JsonbWriter			w;
 	JsonbIterator 		*it;
 	uint32 				r;
-	JsonbValue 			v, *res = NULL;
+	JsonbValue 			v;
 	bool 				skipped = false;
+	int					idx = -1, i = 0;
 
 	if (JB_ROOT_IS_SCALAR(in))
 		ereport(ERROR,
@@ -128,34 +482,51 @@ jsonb_delete(PG_FUNCTION_ARGS)
 
 	if (JB_ROOT_COUNT(in) == 0)
 	{
-		PG_RETURN_JSONB(in);
+		return in;
+	}
+
+	if (JB_ROOT_IS_OBJECT(in))
+	{
+		idx = findJsonbKey(&in->root, keyptr, keylen, NULL);
+		if (idx < 0)
+			return in;
 	}
 
 	it = JsonbIteratorInit(&in->root);
+	initJsonbWriter(&w, VARSIZE(in));
 
-	while((r = JsonbIteratorNext(&it, &v, false)) != 0)
+	while((r = JsonbIteratorNext(&it, &v, true)) != 0)
 	{
-		if (!skipped && (r == WJB_ELEM || r == WJB_KEY) &&
+		/* the key is certainly deleted from an object */
+		if (r == WJB_BEGIN_OBJECT)
+		{
+			v.val.object.nPairs--;
+			pushJsonbWriter(&w, r, &v);
+			expectJsonbWriterKeys(&w, getJsonbOffset(&in->root, JB_ROOT_COUNT(in)) -
+								  getJsonbLength(&in->root, idx));
+			continue;
+		}
+
+		if (r == WJB_KEY && i++ == idx)
+		{
+			/* skip corresponding value */
+			JsonbIteratorNext(&it, &v, true);
+			continue;
+		}
+
+		if (!skipped && r == WJB_ELEM &&
 			(v.type == jbvString && keylen == v.val.string.len &&
 			 memcmp(keyptr, v.val.string.val, keylen) == 0))
 		{
-			/* we should delete only one key/element */
+			/* we should delete only one element */
 			skipped = true;
-
-			if (r == WJB_KEY)
-			{
-				/* skip corresponding value */
-				JsonbIteratorNext(&it, &v, true);
-			}
-
 			continue;
 		}
 
-		res = pushJsonbValue(&state, r, r < WJB_BEGIN_ARRAY ? &v : NULL);
+		pushJsonbWriter(&w, r, &v);
 	}
 
-	Assert(res != NULL);
-	PG_RETURN_JSONB(JsonbValueToJsonb(res));
+	return finishJsonbWriter(&w);
 }
 
 
@@ -165,19 +536,19 @@ jsonb_delete(PG_FUNCTION_ARGS)
  * Delete key (only from the top level of object) or element from jsonb by index (idx).
  * Negative idx value is supported, and it implies the countdown from the last key/element.
  * If idx is more, than numbers of keys/elements, or equal - nothing will be deleted.
- * If idx is negative and -idx is more, than number of keys/elements - the last one will be deleted.
- *
- * TODO: take care about nesting values.
+ * If idx is negative and -idx is more, than number of keys/elements - nothing will be deleted either.
+ * Nested values are not iterated: an element of an array is deleted by JsonbArraySplice,
+ * and values of an object are copied as they are.
  */
-Datum
-jsonb_delete_idx(PG_FUNCTION_ARGS)
+static Datum
+jsonb_delete_idx_internal(PG_FUNCTION_ARGS)
 {
-	Jsonb 				*in = PG_GETARG_JSONB(0);
+	Jsonb 				*in = PG_GETARG_JSONB_INPUT(0);
 	int					idx = PG_GETARG_INT32(1);
-	JsonbParseState 	*state = NULL;
+	JsonbWriter			w;
 	JsonbIterator 		*it;
 	uint32 				r, i = 0, n;
-	JsonbValue 			v, *res = NULL;
+	JsonbValue 			v;
 
 	if (JB_ROOT_IS_SCALAR(in))
 		ereport(ERROR,
@@ -189,13 +560,7 @@ jsonb_delete_idx(PG_FUNCTION_ARGS)
 		PG_RETURN_JSONB(in);
 	}
 
-	it = JsonbIteratorInit(&in->root);
-
-	r = JsonbIteratorNext(&it, &v, false);
-	if (r == WJB_BEGIN_ARRAY)
-		n = v.val.array.nElems;
-	else
-		n = v.val.object.nPairs;
+	n = JB_ROOT_COUNT(in);
 
 	if (idx < 0)
 	{
@@ -210,7 +575,18 @@ jsonb_delete_idx(PG_FUNCTION_ARGS)
 		PG_RETURN_JSONB(in);
 	}
 
-	pushJsonbValue(&state, r, r < WJB_BEGIN_ARRAY ? &v : NULL);
+	/* elements of an array are located directly, see JsonbArraySplice */
+	if (JB_ROOT_IS_ARRAY(in))
+		PG_RETURN_JSONB(JsonbArraySplice(&in->root, idx, idx + 1, NULL, 0));
+
+	it = JsonbIteratorInit(&in->root);
+	initJsonbWriter(&w, VARSIZE(in));
+
+	/* only an object is left, and one of its keys is certainly deleted */
+	r = JsonbIteratorNext(&it, &v, false);
+
+	v.val.object.nPairs--;
+	pushJsonbWriter(&w, r, &v);
 
 	while((r = JsonbIteratorNext(&it, &v, true)) != 0)
 	{
@@ -224,11 +600,10 @@ jsonb_delete_idx(PG_FUNCTION_ARGS)
 			}
 		}
 
-		res = pushJsonbValue(&state, r, r < WJB_BEGIN_ARRAY ? &v : NULL);
+		pushJsonbWriter(&w, r, &v);
 	}
 
-	Assert (res != NULL);
-	PG_RETURN_JSONB(JsonbValueToJsonb(res));
+	PG_RETURN_JSONB(finishJsonbWriter(&w));
 }
 
 /*
@@ -237,25 +612,46 @@ jsonb_delete_idx(PG_FUNCTION_ARGS)
  * Path must be replesented as an array of key names or indexes. If indexes will be used,
  * the same rules implied as for jsonb_delete_idx (negative indexing and edge cases)
  */
-Datum
-jsonb_set(PG_FUNCTION_ARGS)
+static Datum
+jsonb_set_internal(PG_FUNCTION_ARGS)
 {
-	Jsonb 				*in = PG_GETARG_JSONB(0);
-	ArrayType 			*path = PG_GETARG_ARRAYTYPE_P(1);
-	Jsonb 				*newval = PG_GETARG_JSONB(2);
+	Jsonb 				*in = PG_GETARG_JSONB_INPUT(0);
+	JsonbPath			*path = getJsonbPathArg(fcinfo, 1);
+	JsonbValue			newval_buf;
+	JsonbValue			*newval = getJsonbValueArg(fcinfo, 2, &newval_buf);
 	bool       			create = PG_GETARG_BOOL(3);
-	JsonbValue 			*res = NULL;
-	Datum 				*path_elems;
-	bool 				*path_nulls;
-	int					path_len;
-	JsonbIterator 		*it;
-	JsonbParseState 	*st = NULL;
+
+	PG_RETURN_JSONB(setJsonbPath(in, path, newval, create));
+}
 
 
-	if (ARR_NDIM(path) > 1)
-		ereport(ERROR,
-				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
-				 errmsg("wrong number of array subscripts")));
+/*
+ * jsonb_set_jsonbx_path:
+ * jsonbx_set, the same as jsonb_set with the path of jsonbx_path type, which
+ * is already parsed.
+ */
+static Datum
+jsonb_set_jsonbx_path_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb 				*in = PG_GETARG_JSONB_INPUT(0);
+	JsonbPath			*path = getJsonbxPathArg(fcinfo, 1);
+	JsonbValue			newval_buf;
+	JsonbValue			*newval = getJsonbValueArg(fcinfo, 2, &newval_buf);
+	bool       			create = PG_GETARG_BOOL(3);
+
+	PG_RETURN_JSONB(setJsonbPath(in, path, newval, create));
+}
+
+
+/*
+ * setJsonbPath:
+ * Common part of jsonb_set functions.
+ */
+Jsonb *
+setJsonbPath(Jsonb *in, JsonbPath *path, JsonbValue *newval, bool create)
+{
+	JsonbIterator 		*it;
+	JsonbWriter			w;
 
 	if (JB_ROOT_IS_SCALAR(in))
 		ereport(ERROR,
@@ -264,46 +660,60 @@ jsonb_set(PG_FUNCTION_ARGS)
 
 
 	if (JB_ROOT_COUNT(in) == 0 && !create)
-	{
-		PG_RETURN_JSONB(in);
-	}
+		return in;
 
-	deconstruct_array(path, TEXTOID, -1, false, 'i',
-					  &path_elems, &path_nulls, &path_len);
+	if (path->len == 0)
+		return in;
 
-	if (path_len == 0)
-	{
-		PG_RETURN_JSONB(in);
-	}
+	if (!setPathChanges(&in->root, path, create))
+		return in;
 
 	it = JsonbIteratorInit(&in->root);
+	initJsonbWriter(&w, VARSIZE(in) +
+		((newval->type == jbvBinary) ? newval->val.binary.len : 0));
 
-	res = setPath(&it, path_elems, path_nulls, path_len, &st, 0, newval, create);
+	setPath(&it, path, &w, 0, newval, create);
 
-	Assert (res != NULL);
-	PG_RETURN_JSONB(JsonbValueToJsonb(res));
+	return finishJsonbWriter(&w);
 }
 
 
 /*
  * jsonb_delete_path:
  */
-Datum
-jsonb_delete_path(PG_FUNCTION_ARGS)
+static Datum
+jsonb_delete_path_internal(PG_FUNCTION_ARGS)
 {
-	Jsonb	   *in = PG_GETARG_JSONB(0);
-	ArrayType  *path = PG_GETARG_ARRAYTYPE_P(1);
-	JsonbValue *res = NULL;
-	Datum	   *path_elems;
-	bool	   *path_nulls;
-	int			path_len;
-	JsonbIterator *it;
-	JsonbParseState *st = NULL;
+	Jsonb	   *in = PG_GETARG_JSONB_INPUT(0);
+	JsonbPath  *path = getJsonbPathArg(fcinfo, 1);
+
+	PG_RETURN_JSONB(deleteJsonbPath(in, path));
+}
 
-	if (ARR_NDIM(path) > 1)
-		ereport(ERROR,
-				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
-				 errmsg("wrong number of array subscripts")));
+
+/*
+ * jsonb_delete_jsonbx_path:
+ * jsonb_delete_path with the path of jsonbx_path type.
+ */
+static Datum
+jsonb_delete_jsonbx_path_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb	   *in = PG_GETARG_JSONB_INPUT(0);
+	JsonbPath  *path = getJsonbxPathArg(fcinfo, 1);
+
+	PG_RETURN_JSONB(deleteJsonbPath(in, path));
+}
+
+
+/*
+ * deleteJsonbPath:
+ * Common part of jsonb_delete_path functions.
+ */
+Jsonb *
+deleteJsonbPath(Jsonb *in, JsonbPath *path)
+{
+	JsonbIterator *it;
+	JsonbWriter w;
 
 	if (JB_ROOT_IS_SCALAR(in))
 		ereport(ERROR,
@@ -311,22 +721,1163 @@ jsonb_delete_path(PG_FUNCTION_ARGS)
 				 errmsg("cannot delete path in scalar")));
 
 	if (JB_ROOT_COUNT(in) == 0)
-	{
+		return in;
+
+	if (path->len == 0)
+		return in;
+
+	if (!setPathChanges(&in->root, path, false))
+		return in;
+
+	it = JsonbIteratorInit(&in->root);
+	initJsonbWriter(&w, VARSIZE(in));
+
+	setPath(&it, path, &w, 0, NULL, false);
+
+	return finishJsonbWriter(&w);
+}
+
+
+/*
+ * jsonb_increment:
+ * Add the delta to the number, which can be found by the specified path.
+ * A missing number is created with the delta as jsonb_set does, i.e. only
+ * the last path element can be missing. If the sum has the same length as
+ * the old number, its bytes are replaced in a copy of jsonb, and nothing is
+ * rebuilt. Otherwise the sum is set by setJsonbPath.
+ */
+static Datum
+jsonb_increment_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb				*in = PG_GETARG_JSONB_INPUT(0);
+	JsonbPath			*path = getJsonbPathArg(fcinfo, 1);
+	Numeric				delta = PG_GETARG_NUMERIC(2);
+	JsonbValue			v;
+	Numeric				sum;
+	Jsonb				*out;
+
+	if (JB_ROOT_IS_SCALAR(in))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot set path in scalar")));
+
+	/* NaN is not a valid JSON number */
+	if (numeric_is_nan(delta))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot increment by NaN")));
+
+	if (path->len == 0)
 		PG_RETURN_JSONB(in);
+
+	if (!findJsonbPathValue(&in->root, path, &v))
+	{
+		v.type = jbvNumeric;
+		v.val.numeric = delta;
+
+		PG_RETURN_JSONB(setJsonbPath(in, path, &v, true));
 	}
 
-	deconstruct_array(path, TEXTOID, -1, false, 'i',
-					  &path_elems, &path_nulls, &path_len);
+	if (v.type != jbvNumeric)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot increment a non-numeric value")));
+
+	sum = DatumGetNumeric(DirectFunctionCall2(numeric_add,
+											  NumericGetDatum(v.val.numeric),
+											  NumericGetDatum(delta)));
 
-	if (path_len == 0)
+	if (VARSIZE_ANY(sum) != VARSIZE_ANY(v.val.numeric))
 	{
-		PG_RETURN_JSONB(in);
+		v.val.numeric = sum;
+
+		PG_RETURN_JSONB(setJsonbPath(in, path, &v, true));
 	}
 
-	it = JsonbIteratorInit(&in->root);
+	/*
+	 * Always a fresh copy, even if the argument was detoasted: the detoasted
+	 * argument is what the stats compare with to detect a no-op.
+	 */
+	out = (Jsonb *) memcpy(palloc(VARSIZE(in)), in, VARSIZE(in));
+	memcpy((char *) out + ((char *) v.val.numeric - (char *) in),
+		   sum, VARSIZE_ANY(sum));
+
+	PG_RETURN_JSONB(out);
+}
 
-	res = setPath(&it, path_elems, path_nulls, path_len, &st, 0, NULL, false);
 
-	Assert (res != NULL);
-	PG_RETURN_JSONB(JsonbValueToJsonb(res));
+/*
+ * jsonb_array_delete_range:
+ * Delete elements of the array, which can be found by the specified path,
+ * from the index 'from' up to the index 'to' inclusive. Negative indexes
+ * imply the countdown from the last element, indexes out of the array are
+ * limited to its bounds. If there is no value at the path or the range
+ * is empty, nothing will be deleted.
+ */
+static Datum
+jsonb_array_delete_range_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb	   *in = PG_GETARG_JSONB_INPUT(0);
+	JsonbPath  *path = getJsonbPathArg(fcinfo, 1);
+	int			from = PG_GETARG_INT32(2);
+	int			to = PG_GETARG_INT32(3);
+	JsonbContainer *array;
+	int			count;
+
+	if (JB_ROOT_IS_SCALAR(in))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot delete from scalar")));
+
+	array = getJsonbPathArray(in, path);
+	if (array == NULL)
+		PG_RETURN_JSONB(in);
+
+	count = array->header & JB_CMASK;
+
+	if (from < 0)
+		from = Max(from + count, 0);
+
+	if (to < 0)
+		to += count;
+	else if (to >= count)
+		to = count - 1;
+
+	if (from > to)
+		PG_RETURN_JSONB(in);
+
+	PG_RETURN_JSONB(spliceJsonbPath(in, path, array, from, to + 1, NULL, 0));
+}
+
+
+/*
+ * jsonb_array_insert:
+ * Insert values into the array, which can be found by the specified path,
+ * before the element with the index 'idx'. Negative idx implies the countdown
+ * from the last element. If idx is more than the number of elements, values
+ * are appended, if -idx is more than that, they are prepended. If there is
+ * no value at the path, nothing will be inserted.
+ */
+static Datum
+jsonb_array_insert_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb	   *in = PG_GETARG_JSONB_INPUT(0);
+	JsonbPath  *path = getJsonbPathArg(fcinfo, 1);
+	int			idx = PG_GETARG_INT32(2);
+	ArrayType  *values = PG_GETARG_ARRAYTYPE_P(3);
+	JsonbContainer *array;
+	Datum	   *value_elems;
+	bool	   *value_nulls;
+	int			nvalues;
+	Jsonb	  **items;
+	int			count;
+	int			i;
+
+	if (JB_ROOT_IS_SCALAR(in))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot insert into scalar")));
+
+	if (ARR_NDIM(values) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("wrong number of array subscripts")));
+
+	deconstruct_array(values, JSONBOID, -1, false, 'i',
+					  &value_elems, &value_nulls, &nvalues);
+
+	items = palloc(sizeof(Jsonb *) * Max(nvalues, 1));
+	for (i = 0; i < nvalues; i++)
+	{
+		if (value_nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("value at the position %d is NULL", i + 1)));
+
+		items[i] = DatumGetJsonb(value_elems[i]);
+	}
+
+	array = getJsonbPathArray(in, path);
+	if (array == NULL || nvalues == 0)
+		PG_RETURN_JSONB(in);
+
+	count = array->header & JB_CMASK;
+
+	if (idx < 0)
+		idx = Max(idx + count, 0);
+	else if (idx > count)
+		idx = count;
+
+	PG_RETURN_JSONB(spliceJsonbPath(in, path, array, idx, idx, items, nvalues));
+}
+
+
+/*
+ * getJsonbPathArray:
+ * The array at the path or NULL, if there is no value at the path.
+ */
+static JsonbContainer *
+getJsonbPathArray(Jsonb *in, JsonbPath *path)
+{
+	JsonbContainer *container;
+
+	if (!findJsonbPathContainer(&in->root, path, &container))
+		return NULL;
+
+	if (container == NULL || !(container->header & JB_FARRAY))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("path does not point to an array")));
+
+	return container;
+}
+
+
+/*
+ * spliceJsonbPath:
+ * Common part of the array splice functions. The new array is built by
+ * JsonbArraySplice, and if it's not the root, it's placed at the path as
+ * a binary value, so only the containers along the path are rebuilt.
+ */
+static Jsonb *
+spliceJsonbPath(Jsonb *in, JsonbPath *path, JsonbContainer *array,
+				int from, int to, Jsonb **items, int nitems)
+{
+	Jsonb	   *res = JsonbArraySplice(array, from, to, items, nitems);
+	JsonbValue	v;
+
+	if (path->len == 0)
+		return res;
+
+	v.type = jbvBinary;
+	v.val.binary.data = &res->root;
+	v.val.binary.len = VARSIZE(res) - VARHDRSZ;
+
+	return setJsonbPath(in, path, &v, false);
+}
+
+
+/*
+ * getSetPathCache:
+ * Per call site cache of jsonb_set and jsonb_delete_path arguments. A call
+ * without flinfo (e.g. by DirectFunctionCall) has no call site, so it gets
+ * the empty local cache, and no argument is stable for it.
+ */
+static SetPathCache *
+getSetPathCache(FunctionCallInfo fcinfo, SetPathCache *local)
+{
+	if (fcinfo->flinfo == NULL)
+	{
+		memset(local, 0, sizeof(SetPathCache));
+		return local;
+	}
+
+	if (fcinfo->flinfo->fn_extra == NULL)
+		fcinfo->flinfo->fn_extra = MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+														  sizeof(SetPathCache));
+
+	return (SetPathCache *) fcinfo->flinfo->fn_extra;
+}
+
+
+/*
+ * getJsonbPathArg:
+ * Prepare the path argument with makeJsonbPath. If the argument is the same
+ * for every call (e.g. a constant), the path is prepared only once and kept
+ * in fn_extra.
+ */
+static JsonbPath *
+getJsonbPathArg(FunctionCallInfo fcinfo, int argno)
+{
+	SetPathCache	local;
+	SetPathCache   *cache = getSetPathCache(fcinfo, &local);
+	ArrayType	   *array;
+	MemoryContext	oldcontext;
+
+	if (cache->path != NULL)
+		return cache->path;
+
+	array = PG_GETARG_ARRAYTYPE_P(argno);
+
+	if (ARR_NDIM(array) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("wrong number of array subscripts")));
+
+	if (!get_fn_expr_arg_stable(fcinfo->flinfo, argno))
+		return makeJsonbPath(array);
+
+	/* the path refers to the array, so it must be copied as well */
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+	array = (ArrayType *) memcpy(palloc(VARSIZE(array)), array, VARSIZE(array));
+	cache->path = makeJsonbPath(array);
+	MemoryContextSwitchTo(oldcontext);
+
+	return cache->path;
+}
+
+
+/*
+ * getJsonbxPathArg:
+ * The same as getJsonbPathArg for the jsonbx_path argument. The path is
+ * already parsed, so only pointers to its elements are prepared.
+ */
+static JsonbPath *
+getJsonbxPathArg(FunctionCallInfo fcinfo, int argno)
+{
+	SetPathCache	local;
+	SetPathCache   *cache = getSetPathCache(fcinfo, &local);
+	JsonbxPath	   *jxpath;
+	MemoryContext	oldcontext;
+
+	if (cache->path != NULL)
+		return cache->path;
+
+	jxpath = PG_GETARG_JSONBX_PATH(argno);
+
+	if (!get_fn_expr_arg_stable(fcinfo->flinfo, argno))
+		return makeJsonbPathFromJsonbx(jxpath);
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+	jxpath = (JsonbxPath *) memcpy(palloc(VARSIZE(jxpath)), jxpath, VARSIZE(jxpath));
+	cache->path = makeJsonbPathFromJsonbx(jxpath);
+	MemoryContextSwitchTo(oldcontext);
+
+	return cache->path;
+}
+
+
+/*
+ * getJsonbValueArg:
+ * Get the jsonb argument in the form, which is ready to be pushed into
+ * a parse state (see JsonbToJsonbValue). If the argument is the same for every
+ * call, it's converted only once and kept in fn_extra, otherwise buf is used.
+ */
+static JsonbValue *
+getJsonbValueArg(FunctionCallInfo fcinfo, int argno, JsonbValue *buf)
+{
+	SetPathCache	local;
+	SetPathCache   *cache = getSetPathCache(fcinfo, &local);
+	Jsonb		   *jb;
+	MemoryContext	oldcontext;
+
+	/* the local cache is empty and must not outlive this call */
+	if (cache == &local || !get_fn_expr_arg_stable(fcinfo->flinfo, argno))
+	{
+		JsonbToJsonbValue(PG_GETARG_JSONB(argno), buf);
+		return buf;
+	}
+
+	if (cache->hasValue)
+		return &cache->value;
+
+	jb = PG_GETARG_JSONB(argno);
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+	jb = (Jsonb *) memcpy(palloc(VARSIZE(jb)), jb, VARSIZE(jb));
+	JsonbToJsonbValue(jb, &cache->value);
+	cache->hasValue = true;
+	MemoryContextSwitchTo(oldcontext);
+
+	return &cache->value;
+}
+
+
+/*
+ * jsonb_modify:
+ * Apply a batch of operations to jsonb in one pass.
+ * Paths are rows of a two-dimensional array, shorter paths must be padded
+ * with NULLs at the end. For every path there is a value and an operation:
+ * - set: the same as jsonb_set with create_if_missing = true
+ * - insert: the same as set, except that an existing key can't be replaced,
+ *   and a new array element is placed before the specified one
+ * - delete: the same as jsonb_delete(jsonb, text[]), value is ignored
+ *
+ * All paths are merged into a trie, and jsonb is traversed once by modifyPath.
+ * Operations are applied as if they were executed one by one, except that
+ * array indexes always refer to the elements of the original jsonb.
+ */
+static Datum
+jsonb_modify_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb 				*in = PG_GETARG_JSONB_INPUT(0);
+	ArrayType 			*paths = PG_GETARG_ARRAYTYPE_P(1);
+	ArrayType 			*values = PG_GETARG_ARRAYTYPE_P(2);
+	ArrayType 			*ops = PG_GETARG_ARRAYTYPE_P(3);
+	Datum 				*path_elems, *value_elems, *op_elems;
+	bool 				*path_nulls, *value_nulls, *op_nulls;
+	int					npath_elems, nvalues, nops;
+	int					npaths, path_len;
+	int					i;
+	PathTrieNode		*root;
+	JsonbIterator 		*it;
+	JsonbWriter			w;
+
+	if (ARR_NDIM(paths) > 2)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("wrong number of array subscripts")));
+
+	if (ARR_NDIM(values) > 1 || ARR_NDIM(ops) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("wrong number of array subscripts")));
+
+	if (JB_ROOT_IS_SCALAR(in))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot set path in scalar")));
+
+	deconstruct_array(paths, TEXTOID, -1, false, 'i',
+					  &path_elems, &path_nulls, &npath_elems);
+	deconstruct_array(values, JSONBOID, -1, false, 'i',
+					  &value_elems, &value_nulls, &nvalues);
+	deconstruct_array(ops, TEXTOID, -1, false, 'i',
+					  &op_elems, &op_nulls, &nops);
+
+	/* one-dimensional array is a single path */
+	if (ARR_NDIM(paths) == 2)
+	{
+		npaths = ARR_DIMS(paths)[0];
+		path_len = ARR_DIMS(paths)[1];
+	}
+	else
+	{
+		npaths = (npath_elems > 0) ? 1 : 0;
+		path_len = npath_elems;
+	}
+
+	if (nvalues != npaths || nops != npaths)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("number of paths, values and operations must be the same")));
+
+	root = makePathTrieNode((Datum) 0);
+
+	for (i = 0; i < npaths; i++)
+	{
+		Datum		*path = path_elems + i * path_len;
+		bool		*nulls = path_nulls + i * path_len;
+		int			len = path_len;
+		int			op;
+		char		*opname;
+		int			j;
+
+		if (op_nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("operation must not be null")));
+
+		opname = TextDatumGetCString(op_elems[i]);
+		if (strcmp(opname, "set") == 0)
+			op = JSONB_MODIFY_SET;
+		else if (strcmp(opname, "insert") == 0)
+			op = JSONB_MODIFY_INSERT;
+		else if (strcmp(opname, "delete") == 0)
+			op = JSONB_MODIFY_DELETE;
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("unknown operation \"%s\"", opname),
+					 errhint("Valid operations are \"set\", \"insert\" and \"delete\".")));
+
+		if (op != JSONB_MODIFY_DELETE && value_nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("value for the operation \"%s\" must not be null", opname)));
+
+		/* cut off the padding */
+		while (len > 0 && nulls[len - 1])
+			len--;
+
+		for (j = 0; j < len; j++)
+		{
+			if (nulls[j])
+				elog(ERROR, "path element at the position %d is NULL", j + 1);
+		}
+
+		/* the same as jsonb_set with an empty path */
+		if (len == 0)
+			continue;
+
+		addPathToTrie(root, path, len, op,
+					  (op != JSONB_MODIFY_DELETE) ? DatumGetJsonb(value_elems[i]) : NULL);
+	}
+
+	if (root->nchildren == 0)
+	{
+		PG_RETURN_JSONB(in);
+	}
+
+	it = JsonbIteratorInit(&in->root);
+
+	initJsonbWriter(&w, VARSIZE(in));
+	modifyPath(&it, root, &w, 0);
+
+	PG_RETURN_JSONB(finishJsonbWriter(&w));
+}
+
+
+/*
+ * jsonb_delete_keys:
+ * Return copy of jsonb without all the specified keys.
+ * For an array all string elements equal to one of the keys are removed.
+ */
+static Datum
+jsonb_delete_keys_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb 				*in = PG_GETARG_JSONB_INPUT(0);
+	ArrayType 			*keys = PG_GETARG_ARRAYTYPE_P(1);
+
+	if (JB_ROOT_IS_SCALAR(in))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot delete from scalar")));
+
+	PG_RETURN_JSONB(filterJsonbKeys(in, keys, false));
+}
+
+
+/*
+ * jsonb_select_keys:
+ * Return copy of jsonb with only the specified keys.
+ * For an array only string elements equal to one of the keys are kept.
+ */
+static Datum
+jsonb_select_keys_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb 				*in = PG_GETARG_JSONB_INPUT(0);
+	ArrayType 			*keys = PG_GETARG_ARRAYTYPE_P(1);
+
+	if (JB_ROOT_IS_SCALAR(in))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot select keys from scalar")));
+
+	PG_RETURN_JSONB(filterJsonbKeys(in, keys, true));
+}
+
+
+/*
+ * filterJsonbKeys:
+ * Keep (or remove, if keep is false) only the specified keys on the top level.
+ * Keys are sorted once in the same order as jsonb object keys, so the object
+ * is filtered in one pass, merging both sorted lists.
+ * If nothing should be changed, the original jsonb is returned.
+ */
+static Jsonb *
+filterJsonbKeys(Jsonb *in, ArrayType *keys, bool keep)
+{
+	JsonbWriter			w;
+	JsonbIterator 		*it;
+	uint32 				r;
+	JsonbValue 			v;
+	Datum				*key_elems;
+	int					nkeys, i, j;
+	int					nfound = 0;
+
+	key_elems = getSortedTextKeys(keys, &nkeys);
+
+	if (JB_ROOT_COUNT(in) == 0)
+		return in;
+
+	if (JB_ROOT_IS_OBJECT(in))
+	{
+		for (i = 0; i < nkeys; i++)
+		{
+			if (findJsonbKey(&in->root, VARDATA_ANY(key_elems[i]),
+							 VARSIZE_ANY_EXHDR(key_elems[i]), NULL) >= 0)
+				nfound++;
+		}
+
+		if ((keep && nfound == JB_ROOT_COUNT(in)) || (!keep && nfound == 0))
+			return in;
+	}
+
+	it = JsonbIteratorInit(&in->root);
+	initJsonbWriter(&w, VARSIZE(in));
+	j = 0;
+
+	while((r = JsonbIteratorNext(&it, &v, true)) != 0)
+	{
+		/* the number of remaining keys is already known */
+		if (r == WJB_BEGIN_OBJECT)
+			v.val.object.nPairs = keep ? nfound : v.val.object.nPairs - nfound;
+
+		if (r == WJB_KEY)
+		{
+			int		cmp = 1;
+
+			while (j < nkeys &&
+				   (cmp = compareJsonbKeys(VARDATA_ANY(key_elems[j]),
+										   VARSIZE_ANY_EXHDR(key_elems[j]),
+										   v.val.string.val, v.val.string.len)) < 0)
+				j++;
+
+			if ((j < nkeys && cmp == 0) != keep)
+			{
+				/* skip corresponding value */
+				JsonbIteratorNext(&it, &v, true);
+				continue;
+			}
+		}
+		else if (r == WJB_ELEM)
+		{
+			bool	found = (v.type == jbvString &&
+							 findTextKey(key_elems, nkeys,
+										 v.val.string.val, v.val.string.len));
+
+			if (found != keep)
+				continue;
+		}
+
+		pushJsonbWriter(&w, r, &v);
+	}
+
+	return finishJsonbWriter(&w);
+}
+
+
+/*
+ * jsonb_strip_key:
+ * Return copy of jsonb without all pairs with the specified keys on any
+ * nesting level. If there are no such keys, the original jsonb is returned.
+ */
+static Datum
+jsonb_strip_key_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb 				*in = PG_GETARG_JSONB_INPUT(0);
+	ArrayType 			*keys = PG_GETARG_ARRAYTYPE_P(1);
+	Datum				*key_elems;
+	int					nkeys;
+	JsonbWriter			w;
+	bool				stripped;
+
+	key_elems = getSortedTextKeys(keys, &nkeys);
+
+	if (nkeys == 0 || JB_ROOT_IS_SCALAR(in))
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+
+	initJsonbWriter(&w, VARSIZE(in));
+	stripped = stripJsonbKeys(&in->root, key_elems, nkeys, &w);
+
+	if (!stripped)
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+
+	PG_RETURN_JSONB(finishJsonbWriter(&w));
+}
+
+
+/*
+ * getSortedTextKeys:
+ * Non-NULL elements of the text array, sorted in the same order as jsonb
+ * object keys and without duplicates, so they can be looked up by findTextKey
+ * or merged with keys of an object.
+ */
+static Datum *
+getSortedTextKeys(ArrayType *keys, int *nkeys)
+{
+	Datum				*key_elems;
+	bool				*key_nulls;
+	int					n, i, j;
+
+	if (ARR_NDIM(keys) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("wrong number of array subscripts")));
+
+	deconstruct_array(keys, TEXTOID, -1, false, 'i',
+					  &key_elems, &key_nulls, &n);
+
+	/* NULL never matches any key */
+	for (i = 0, j = 0; i < n; i++)
+	{
+		if (!key_nulls[i])
+			key_elems[j++] = key_elems[i];
+	}
+	n = j;
+
+	if (n > 1)
+	{
+		qsort(key_elems, n, sizeof(Datum), compareTextKeys);
+
+		for (i = 1, j = 1; i < n; i++)
+		{
+			if (compareTextKeys(&key_elems[j - 1], &key_elems[i]) != 0)
+				key_elems[j++] = key_elems[i];
+		}
+		n = j;
+	}
+
+	*nkeys = n;
+	return key_elems;
+}
+
+
+/*
+ * Write the container without pairs with the keys, as walkJsonb does, but
+ * nested containers are written value by value as well. The document is
+ * passed only once, and returns whether anything was stripped.
+ */
+static bool
+stripJsonbKeys(JsonbContainer *container, Datum *keys, int nkeys, JsonbWriter *w)
+{
+	JsonbIterator 		*it = JsonbIteratorInit(container);
+	uint32 				r;
+	JsonbValue 			v;
+	bool				stripped = false;
+
+	check_stack_depth();
+
+	while((r = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		if (r == WJB_KEY &&
+			findTextKey(keys, nkeys, v.val.string.val, v.val.string.len))
+		{
+			/* skip corresponding value */
+			JsonbIteratorNext(&it, &v, true);
+			stripped = true;
+			continue;
+		}
+
+		if ((r == WJB_VALUE || r == WJB_ELEM) && v.type == jbvBinary)
+		{
+			if (stripJsonbKeys(v.val.binary.data, keys, nkeys, w))
+				stripped = true;
+			continue;
+		}
+
+		pushJsonbWriter(w, r, &v);
+	}
+
+	return stripped;
+}
+
+
+/*
+ * Binary search of the key in the sorted array of text keys.
+ */
+static bool
+findTextKey(Datum *keys, int nkeys, char *key, int keylen)
+{
+	int		stopLow = 0,
+			stopHigh = nkeys;
+
+	while (stopLow < stopHigh)
+	{
+		int		stopMiddle = stopLow + (stopHigh - stopLow) / 2;
+		int		difference;
+
+		difference = compareJsonbKeys(VARDATA_ANY(keys[stopMiddle]),
+									  VARSIZE_ANY_EXHDR(keys[stopMiddle]),
+									  key, keylen);
+
+		if (difference == 0)
+			return true;
+		else if (difference < 0)
+			stopLow = stopMiddle + 1;
+		else
+			stopHigh = stopMiddle;
+	}
+
+	return false;
+}
+
+
+/*
+ * qsort comparator for text keys, the order is the same as for jsonb keys.
+ */
+static int
+compareTextKeys(const void *a, const void *b)
+{
+	Datum	ka = *(const Datum *) a;
+	Datum	kb = *(const Datum *) b;
+
+	return compareJsonbKeys(VARDATA_ANY(ka), VARSIZE_ANY_EXHDR(ka),
+							VARDATA_ANY(kb), VARSIZE_ANY_EXHDR(kb));
+}
+
+
+/*
+ * jsonb_concat_agg_transfn:
+ * Transition function of jsonb_concat_agg, which folds all values with ||.
+ * Keys and values of objects (or elements of arrays) are collected into
+ * growable vectors in the aggregate context, so the accumulated result is
+ * never serialized until the final function. A key, which is already in
+ * the object, gets the new value in place, so the state doesn't grow with
+ * overridden keys. Only the values themselves are copied, not the inputs.
+ */
+static Datum
+jsonb_concat_agg_transfn_internal(PG_FUNCTION_ARGS)
+{
+	MemoryContext		aggcontext,
+						oldcontext;
+	JsonbConcatState   *state;
+	Jsonb			   *jb;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "jsonb_concat_agg_transfn called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+	{
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+		state = (JsonbConcatState *) palloc0(sizeof(JsonbConcatState));
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (JsonbConcatState *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(state);
+
+	jb = PG_GETARG_JSONB(1);
+
+	/*
+	 * As for ||, an empty value gives the other one. So the only value is
+	 * returned as is, even a scalar one, and it's replaced by the next one,
+	 * if it's empty.
+	 */
+	if (state->ninputs == 0 ||
+		(state->ninputs == 1 && JB_ROOT_COUNT(state->first) == 0))
+	{
+		if (state->first != NULL)
+			pfree(state->first);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+		state->first = (Jsonb *) memcpy(palloc(VARSIZE(jb)), jb, VARSIZE(jb));
+		MemoryContextSwitchTo(oldcontext);
+
+		state->ninputs = 1;
+		PG_RETURN_POINTER(state);
+	}
+
+	if (JB_ROOT_COUNT(jb) == 0)
+		PG_RETURN_POINTER(state);
+
+	/* as for ||, an object and a scalar can't be concatenated */
+	if (state->ninputs == 1 ?
+		(JB_ROOT_IS_OBJECT(state->first) && JB_ROOT_IS_SCALAR(jb)) ||
+		(JB_ROOT_IS_SCALAR(state->first) && JB_ROOT_IS_OBJECT(jb)) :
+		state->isObject && JB_ROOT_IS_SCALAR(jb))
+		elog(ERROR, "invalid concatnation of jsonb objects");
+
+	if (state->ninputs == 1)
+	{
+		state->isObject = JB_ROOT_IS_OBJECT(state->first);
+		appendConcatState(state, state->first, aggcontext);
+		pfree(state->first);
+		state->first = NULL;
+	}
+
+	/*
+	 * Concatenation of an object with an array gives an array, so
+	 * the accumulated object becomes its first element.
+	 */
+	if (state->isObject && !JB_ROOT_IS_OBJECT(jb))
+	{
+		JsonbValue	object;
+		Jsonb	   *merged;
+		int			i;
+
+		if (state->npairs > 1)
+			qsort(state->pairs, state->npairs, sizeof(JsonbPair), compareConcatPairs);
+
+		object.type = jbvObject;
+		object.val.object.nPairs = state->npairs;
+		object.val.object.pairs = state->pairs;
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+		merged = JsonbValueToJsonbWorker(&object, -1);
+		MemoryContextSwitchTo(oldcontext);
+
+		for (i = 0; i < state->npairs; i++)
+		{
+			freeConcatValue(&state->pairs[i].key);
+			freeConcatValue(&state->pairs[i].value);
+		}
+
+		state->isObject = false;
+		state->npairs = 0;
+
+		if (state->hashslots != NULL)
+		{
+			pfree(state->hashslots);
+			state->hashslots = NULL;
+			state->hashsize = 0;
+		}
+		appendConcatElement(state, &merged->root, VARSIZE(merged) - VARHDRSZ,
+							aggcontext);
+		pfree(merged);
+	}
+
+	appendConcatState(state, jb, aggcontext);
+	state->ninputs++;
+
+	PG_RETURN_POINTER(state);
+}
+
+
+/*
+ * jsonb_concat_agg_finalfn:
+ * Serialize the accumulated object or array. The state is not modified,
+ * since the final function can be called more than once for the same state.
+ */
+static Datum
+jsonb_concat_agg_finalfn_internal(PG_FUNCTION_ARGS)
+{
+	JsonbConcatState   *state;
+	JsonbValue			res;
+
+	/* cannot be called directly because of internal-type argument */
+	Assert(AggCheckCallContext(fcinfo, NULL));
+
+	state = PG_ARGISNULL(0) ? NULL : (JsonbConcatState *) PG_GETARG_POINTER(0);
+
+	if (state == NULL || state->ninputs == 0)
+		PG_RETURN_NULL();
+
+	if (state->ninputs == 1)
+		PG_RETURN_JSONB(memcpy(palloc(VARSIZE(state->first)), state->first,
+							   VARSIZE(state->first)));
+
+	if (state->isObject)
+	{
+		res.type = jbvObject;
+		res.val.object.pairs = palloc(sizeof(JsonbPair) * state->npairs);
+		memcpy(res.val.object.pairs, state->pairs, sizeof(JsonbPair) * state->npairs);
+		res.val.object.nPairs = state->npairs;
+
+		if (state->npairs > 1)
+			qsort(res.val.object.pairs, state->npairs, sizeof(JsonbPair),
+				  compareConcatPairs);
+	}
+	else
+	{
+		res.type = jbvArray;
+		res.val.array.rawScalar = false;
+		res.val.array.nElems = state->nelems;
+		res.val.array.elems = state->elems;
+	}
+
+	PG_RETURN_JSONB(JsonbValueToJsonbWorker(&res, -1));
+}
+
+
+/*
+ * Append all keys and values (if the state is an object) or all elements
+ * of the jsonb to the state. Values are copied into the aggregate context,
+ * nested containers as binary values.
+ */
+static void
+appendConcatState(JsonbConcatState *state, Jsonb *jb, MemoryContext aggcontext)
+{
+	JsonbIterator  *it;
+	JsonbValue		v;
+	int				r;
+
+	if (!state->isObject && JB_ROOT_IS_OBJECT(jb))
+	{
+		appendConcatElement(state, &jb->root, VARSIZE(jb) - VARHDRSZ, aggcontext);
+		return;
+	}
+
+	it = JsonbIteratorInit(&jb->root);
+
+	while ((r = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		if (r == WJB_KEY)
+		{
+			JsonbValue	value;
+
+			r = JsonbIteratorNext(&it, &value, true);
+			Assert(r == WJB_VALUE);
+
+			setConcatPair(state, &v, &value, aggcontext);
+		}
+		else if (r == WJB_ELEM)
+			appendConcatValue(state, &v, aggcontext);
+	}
+}
+
+
+static void
+appendConcatElement(JsonbConcatState *state, JsonbContainer *container, int len,
+					MemoryContext aggcontext)
+{
+	JsonbValue	v;
+
+	v.type = jbvBinary;
+	v.val.binary.data = container;
+	v.val.binary.len = len;
+
+	appendConcatValue(state, &v, aggcontext);
+}
+
+
+static void
+appendConcatValue(JsonbConcatState *state, JsonbValue *v, MemoryContext aggcontext)
+{
+	if (state->nelems >= state->elemsSize)
+	{
+		state->elemsSize = Max(state->elemsSize * 2, 16);
+		state->elems = (state->elems == NULL) ?
+			MemoryContextAlloc(aggcontext, sizeof(JsonbValue) * state->elemsSize) :
+			repalloc(state->elems, sizeof(JsonbValue) * state->elemsSize);
+	}
+
+	state->elems[state->nelems] = *v;
+	copyConcatValue(&state->elems[state->nelems++], aggcontext);
+}
+
+
+/*
+ * Set the value of the key in the accumulated object. The pair is found by
+ * the hash table with linear probing, a new key is added to the end.
+ */
+static void
+setConcatPair(JsonbConcatState *state, JsonbValue *key, JsonbValue *value,
+			  MemoryContext aggcontext)
+{
+	uint32		mask;
+	uint32		slot;
+	JsonbPair  *pair;
+
+	if (state->npairs * 2 >= state->hashsize)
+		growConcatHash(state, aggcontext);
+
+	mask = state->hashsize - 1;
+	slot = DatumGetUInt32(hash_any((unsigned char *) key->val.string.val,
+								   key->val.string.len)) & mask;
+
+	while (state->hashslots[slot] >= 0)
+	{
+		pair = &state->pairs[state->hashslots[slot]];
+
+		if (pair->key.val.string.len == key->val.string.len &&
+			memcmp(pair->key.val.string.val, key->val.string.val,
+				   key->val.string.len) == 0)
+		{
+			freeConcatValue(&pair->value);
+			pair->value = *value;
+			copyConcatValue(&pair->value, aggcontext);
+			return;
+		}
+
+		slot = (slot + 1) & mask;
+	}
+
+	if (state->npairs >= state->pairsSize)
+	{
+		state->pairsSize = Max(state->pairsSize * 2, 16);
+		state->pairs = (state->pairs == NULL) ?
+			MemoryContextAlloc(aggcontext, sizeof(JsonbPair) * state->pairsSize) :
+			repalloc(state->pairs, sizeof(JsonbPair) * state->pairsSize);
+	}
+
+	pair = &state->pairs[state->npairs];
+	pair->key = *key;
+	pair->value = *value;
+	pair->order = state->npairs;
+	copyConcatValue(&pair->key, aggcontext);
+	copyConcatValue(&pair->value, aggcontext);
+
+	state->hashslots[slot] = state->npairs++;
+}
+
+
+/*
+ * Double the hash table of the accumulated object and put all pairs into it
+ * again. An empty object has no table, so it's created here as well.
+ */
+static void
+growConcatHash(JsonbConcatState *state, MemoryContext aggcontext)
+{
+	int			size = Max(state->hashsize * 2, 32);
+	uint32		mask = size - 1;
+	int			i;
+
+	if (state->hashslots != NULL)
+		pfree(state->hashslots);
+
+	state->hashslots = MemoryContextAlloc(aggcontext, sizeof(int) * size);
+	state->hashsize = size;
+	memset(state->hashslots, -1, sizeof(int) * size);
+
+	for (i = 0; i < state->npairs; i++)
+	{
+		JsonbValue *key = &state->pairs[i].key;
+		uint32		slot;
+
+		slot = DatumGetUInt32(hash_any((unsigned char *) key->val.string.val,
+									   key->val.string.len)) & mask;
+
+		while (state->hashslots[slot] >= 0)
+			slot = (slot + 1) & mask;
+
+		state->hashslots[slot] = i;
+	}
+}
+
+
+/*
+ * Copy the data of the value into the aggregate context, so the value doesn't
+ * refer to the input anymore. A container is copied as a binary value.
+ */
+static void
+copyConcatValue(JsonbValue *v, MemoryContext aggcontext)
+{
+	switch (v->type)
+	{
+		case jbvString:
+			v->val.string.val = memcpy(MemoryContextAlloc(aggcontext, v->val.string.len + 1),
+									   v->val.string.val, v->val.string.len);
+			break;
+		case jbvNumeric:
+			v->val.numeric = memcpy(MemoryContextAlloc(aggcontext, VARSIZE_ANY(v->val.numeric)),
+									v->val.numeric, VARSIZE_ANY(v->val.numeric));
+			break;
+		case jbvBinary:
+			v->val.binary.data = memcpy(MemoryContextAlloc(aggcontext, v->val.binary.len),
+										v->val.binary.data, v->val.binary.len);
+			break;
+		default:
+			break;
+	}
+}
+
+
+/*
+ * Free the data of the value copied by copyConcatValue.
+ */
+static void
+freeConcatValue(JsonbValue *v)
+{
+	switch (v->type)
+	{
+		case jbvString:
+			pfree(v->val.string.val);
+			break;
+		case jbvNumeric:
+			pfree(v->val.numeric);
+			break;
+		case jbvBinary:
+			pfree(v->val.binary.data);
+			break;
+		default:
+			break;
+	}
+}
+
+
+/*
+ * Compare pairs by keys, keys of the accumulated object are unique.
+ */
+static int
+compareConcatPairs(const void *a, const void *b)
+{
+	const JsonbPair *pa = (const JsonbPair *) a;
+	const JsonbPair *pb = (const JsonbPair *) b;
+
+	return compareJsonbKeys(pa->key.val.string.val, pa->key.val.string.len,
+							pb->key.val.string.val, pb->key.val.string.len);
 }
@@ -1,11 +1,300 @@
 #ifndef __JSONBX_H__
 #define __JSONBX_H__
 
+#include "utils/array.h"
 
-extern char * JsonbToCStringWorker(StringInfo out, JsonbContainer *in, int estimated_len, bool pretty_print);
-extern JsonbValue* setPath(JsonbIterator **it, Datum *path_elems, bool *path_nulls, int path_len,
-        JsonbParseState  **st, int level, Jsonb *newval, bool create);
+/*
+ * Operations of jsonb_modify. Replace is the same as set, but a missing key
+ * is not created (jsonb_set with create_if_missing = false), it's used only
+ * by jsonbx_chain and jsonb_patch. Add is the "add" of jsonb_patch: set for
+ * an object key and insert for an array element.
+ */
+#define JSONB_MODIFY_NONE		0
+#define JSONB_MODIFY_SET		1
+#define JSONB_MODIFY_INSERT		2
+#define JSONB_MODIFY_DELETE		3
+#define JSONB_MODIFY_REPLACE	4
+#define JSONB_MODIFY_ADD		5
 
-extern JsonbValue * IteratorConcat(JsonbIterator **it1, JsonbIterator **it2, JsonbParseState **state);
+/*
+ * Modes of concatJsonbObjects. Only the top level is merged in the shallow
+ * mode, the other ones merge nested objects as well, and differ in the way
+ * nested arrays are handled.
+ */
+#define JSONB_CONCAT_SHALLOW	0
+#define JSONB_CONCAT_REPLACE	1
+#define JSONB_CONCAT_APPEND		2
+#define JSONB_CONCAT_UNION		3
+
+/*
+ * JsonbOutputFormat:
+ * Layout of the jsonb text representation, see JsonbToText and jsonbToOutput.
+ */
+typedef struct JsonbOutputFormat
+{
+	int		indent;		/* spaces per nesting level, 0 - no line breaks */
+	bool	compact;	/* no spaces after commas and colons */
+	int		max_depth;	/* deeper containers are summarized, -1 - no limit */
+	int		max_bytes;	/* output is truncated after it, -1 - no limit */
+} JsonbOutputFormat;
+
+/*
+ * JsonbPath:
+ * Path of setPath with every element resolved in advance: elements are
+ * used as object keys in the text form, and as array indexes in the integer
+ * form, if they are integers. See makeJsonbPath and makeJsonbPathFromJsonbx.
+ */
+typedef struct JsonbPath
+{
+	int		len;
+	char  **keys;		/* not NUL-terminated */
+	int	   *keylens;
+	bool   *nulls;
+	int	   *indexes;	/* valid only if isIndex */
+	bool   *isIndex;
+} JsonbPath;
+
+/*
+ * JsonbxPath:
+ * On-disk format of the jsonbx_path type, a path which is parsed and
+ * validated only once. It consists of the header, element descriptors and
+ * the key bytes of all elements. Array indexes are already decoded, and key
+ * lengths are at hand for the comparison with object keys (see
+ * compareJsonbKeys), so the path can be used without any parsing.
+ */
+typedef struct JsonbxPathElem
+{
+	uint32		keyoff;		/* offset of the key from the start of key bytes */
+	uint32		keylen;
+	int32		index;		/* valid only if JSONBX_PATH_INDEX is set */
+	uint32		flags;
+} JsonbxPathElem;
+
+#define JSONBX_PATH_INDEX	0x01
+
+typedef struct JsonbxPath
+{
+	int32			vl_len_;	/* varlena header (do not touch directly!) */
+	uint32			nelems;
+	JsonbxPathElem	elems[1];	/* variable length */
+	/* key bytes follow the last element */
+} JsonbxPath;
+
+#define JSONBX_PATH_HDRSZ		offsetof(JsonbxPath, elems)
+#define JSONBX_PATH_KEYS(p)		((char *) ((p)->elems + (p)->nelems))
+
+#define DatumGetJsonbxPath(d)	((JsonbxPath *) PG_DETOAST_DATUM(d))
+#define PG_GETARG_JSONBX_PATH(x)	DatumGetJsonbxPath(PG_GETARG_DATUM(x))
+#define PG_RETURN_JSONBX_PATH(x)	PG_RETURN_POINTER(x)
+
+/*
+ * JsonbxArray:
+ * On-disk format of the jsonbx_array type, a jsonb array for logs, which grow
+ * only at the end. Elements are kept in chunks, every chunk is a complete
+ * jsonb array, and the datum consists of the header, offsets of the chunks
+ * and the chunks themselves, int-aligned. All chunks except the last one are
+ * sealed, the last one is the tail with less than JSONBX_ARRAY_CHUNK_SIZE
+ * elements, where new elements are appended. So an append rebuilds only the
+ * tail, the sealed chunks are copied as they are.
+ */
+typedef struct JsonbxArray
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	uint32		nchunks;		/* including the tail, so at least one */
+	uint32		nelems;			/* elements in all chunks */
+	uint32		offsets[1];		/* variable length, from the start of chunks */
+	/* chunks follow the last offset */
+} JsonbxArray;
+
+#define JSONBX_ARRAY_CHUNK_SIZE		128
+
+#define JSONBX_ARRAY_HDRSZ			offsetof(JsonbxArray, offsets)
+#define JSONBX_ARRAY_DATA(a)		((char *) ((a)->offsets + (a)->nchunks))
+#define JSONBX_ARRAY_CHUNK(a, i)	((Jsonb *) (JSONBX_ARRAY_DATA(a) + (a)->offsets[i]))
+
+#define DatumGetJsonbxArray(d)		((JsonbxArray *) PG_DETOAST_DATUM(d))
+#define PG_GETARG_JSONBX_ARRAY(x)	DatumGetJsonbxArray(PG_GETARG_DATUM(x))
+#define PG_RETURN_JSONBX_ARRAY(x)	PG_RETURN_POINTER(x)
+
+/*
+ * JsonbWriter:
+ * Streaming serializer of jsonb, see pushJsonbWriter. Values are written
+ * straight into the final varlena, an open container keeps aside only JEntries
+ * of its values and bytes of its keys, until it's closed.
+ */
+typedef struct JsonbWriterLevel
+{
+	int				start;		/* offset of the padding before the container */
+	int				header;		/* offset of the container header */
+	int				nreserved;	/* number of values with reserved JEntries */
+	int				keysreserved;	/* bytes reserved for keys of an object */
+	int				nvalues;
+	int				nkeys;
+	int				size;		/* allocated length of entries and keylens */
+	bool			isObject;
+	bool			rawScalar;
+	JEntry		   *entries;	/* types and lengths of values */
+	int			   *keylens;	/* lengths of keys of an object */
+	StringInfoData	keys;		/* bytes of keys of an object */
+} JsonbWriterLevel;
+
+typedef struct JsonbWriter
+{
+	StringInfoData		buffer;
+	JsonbWriterLevel   *levels;
+	int					nlevels;
+	int					size;
+} JsonbWriter;
+
+/*
+ * Functions with counters in jsonbx_stats, in the order of rows of the view
+ */
+typedef enum JsonbxStatsFunctionId
+{
+	JSONBX_STATS_PRETTY,
+	JSONBX_STATS_SERIALIZE,
+	JSONBX_STATS_CONCAT,
+	JSONBX_STATS_DEEP_CONCAT,
+	JSONBX_STATS_DELETE,
+	JSONBX_STATS_DELETE_IDX,
+	JSONBX_STATS_DELETE_PATH,
+	JSONBX_STATS_SET,
+	JSONBX_STATS_SET_JSONBX_PATH,
+	JSONBX_STATS_DELETE_JSONBX_PATH,
+	JSONBX_STATS_ARRAY_DELETE_RANGE,
+	JSONBX_STATS_ARRAY_INSERT,
+	JSONBX_STATS_MODIFY,
+	JSONBX_STATS_DELETE_KEYS,
+	JSONBX_STATS_SELECT_KEYS,
+	JSONBX_STATS_CONCAT_AGG_TRANSFN,
+	JSONBX_STATS_CONCAT_AGG_FINALFN,
+	JSONBX_STATS_CHAIN,
+	JSONBX_STATS_CONCAT_VARIADIC,
+	JSONBX_STATS_DIFF,
+	JSONBX_STATS_PATCH,
+	JSONBX_STATS_INCREMENT,
+	JSONBX_STATS_ARRAY_APPEND,
+	JSONBX_STATS_ARRAY_DELETE_IDX,
+	JSONBX_STATS_STRIP_KEY,
+	JSONBX_STATS_NFUNCS
+} JsonbxStatsFunctionId;
+
+/*
+ * JSONBX_FUNCTION:
+ * Declare the SQL-callable function, which is defined as name_internal.
+ * If neither the stats nor the arena are enabled, the call goes directly to
+ * name_internal, so the overhead is one branch. Otherwise see jsonbxCall.
+ */
+#define JSONBX_FUNCTION(name, id) \
+	static Datum name##_internal(PG_FUNCTION_ARGS); \
+	PG_FUNCTION_INFO_V1(name); \
+	Datum name(PG_FUNCTION_ARGS); \
+	Datum \
+	name(PG_FUNCTION_ARGS) \
+	{ \
+		if (jsonbxWrapCalls) \
+			return jsonbxCall(fcinfo, name##_internal, id); \
+		return name##_internal(fcinfo); \
+	}
+
+/*
+ * JsonbxMemoryUsage:
+ * Bytes requested from JsonbxCountingContext. The peak is the maximum of
+ * bytes in use at the same time.
+ */
+typedef struct JsonbxMemoryUsage
+{
+	Size		allocated;
+	int64		current;
+	int64		peak;
+} JsonbxMemoryUsage;
+
+extern bool jsonbxWrapCalls;
+extern JsonbxMemoryUsage jsonbxMemoryUsage;
+extern Pointer jsonbxInput;
+
+/*
+ * Fetch the input document of a function with stats, see input_arg in
+ * jsonbx_stats.c. The detoasted value is remembered, so if the function
+ * returns it as is, the call is a no-op without comparing any bytes.
+ */
+#define PG_GETARG_JSONB_INPUT(x) \
+	((Jsonb *) (jsonbxInput = (Pointer) PG_GETARG_JSONB(x)))
+#define PG_GETARG_JSONBX_ARRAY_INPUT(x) \
+	((JsonbxArray *) (jsonbxInput = (Pointer) PG_GETARG_JSONBX_ARRAY(x)))
+
+/*
+ * PathTrieNode:
+ * Node of the trie, which is built from all paths of jsonb_modify.
+ * Every node is one path element, its children are the next elements of
+ * all paths with the same prefix. The node can have an operation, if there is
+ * a path, which ends at this node.
+ */
+typedef struct PathTrieNode
+{
+	Datum					key;		/* path element, unused for the root */
+	int						op;			/* one of JSONB_MODIFY_* */
+	Jsonb				   *value;		/* new value for set and insert */
+	int						order;		/* position among siblings, see addPathToTrie */
+	int						nchildren;
+	int						size;		/* allocated length of children */
+	struct PathTrieNode	  **children;
+} PathTrieNode;
+
+extern int JsonbToCStringLength(JsonbContainer *in, JsonbOutputFormat *format);
+extern text * JsonbToText(JsonbContainer *in, JsonbOutputFormat *format);
+extern void setPath(JsonbIterator **it, JsonbPath *path, JsonbWriter *w, int level,
+					JsonbValue *newval, bool create);
+extern bool setPathChanges(JsonbContainer *container, JsonbPath *path, bool create);
+extern bool findJsonbPathContainer(JsonbContainer *container, JsonbPath *path,
+								   JsonbContainer **result);
+extern bool findJsonbPathValue(JsonbContainer *container, JsonbPath *path,
+							   JsonbValue *result);
+extern JsonbPath * makeJsonbPath(ArrayType *array);
+extern JsonbPath * allocJsonbPath(int len);
+extern JsonbPath * makeJsonbPathFromJsonbx(JsonbxPath *jxpath);
+extern bool parseArrayIndex(const char *key, int keylen, int *index);
+extern void JsonbToJsonbValue(Jsonb *jb, JsonbValue *v);
+extern int findJsonbKey(JsonbContainer *container, const char *key, int keylen, int *insert_at);
+extern int compareJsonbKeys(const char *a, int alen, const char *b, int blen);
+extern void getJsonbContainerValue(JsonbContainer *container, int index, JsonbValue *v);
+extern bool equalJsonbValues(JsonbValue *a, JsonbValue *b);
+
+extern PathTrieNode * makePathTrieNode(Datum key);
+extern void addPathToTrie(PathTrieNode *root, Datum *path_elems, int path_len, int op, Jsonb *value);
+extern void modifyPath(JsonbIterator **it, PathTrieNode *node, JsonbWriter *w, int level);
+
+extern Jsonb * JsonbValueToJsonbWorker(JsonbValue *val, int estimated_len);
+extern void initJsonbWriter(JsonbWriter *w, int estimated_len);
+extern void pushJsonbWriter(JsonbWriter *w, int r, JsonbValue *v);
+extern void expectJsonbWriterValues(JsonbWriter *w, int nvalues);
+extern void expectJsonbWriterKeys(JsonbWriter *w, int keyslen);
+extern Jsonb * finishJsonbWriter(JsonbWriter *w);
+extern Jsonb * setJsonbPath(Jsonb *in, JsonbPath *path, JsonbValue *newval, bool create);
+extern Jsonb * deleteJsonbPath(Jsonb *in, JsonbPath *path);
+extern Jsonb * JsonbArraySplice(JsonbContainer *array, int from, int to,
+								Jsonb **items, int nitems);
+extern Jsonb * JsonbArrayConcat(Jsonb **arrays, int narrays);
+extern Jsonb * JsonbArraySlice(JsonbContainer *array, int from, int to);
+extern Jsonb * concatJsonbs(Jsonb **jbs, int njbs);
+extern Jsonb * concatJsonbPair(Jsonb *jb1, Jsonb *jb2);
+extern Jsonb * deleteJsonbKey(Jsonb *in, char *keyptr, int keylen);
+
+extern int findJsonEscape(const char *str, int len);
+
+extern void JsonbxStatsInit(void);
+extern Datum jsonbxStatsCall(FunctionCallInfo fcinfo, PGFunction func, int id);
+extern Datum jsonbxCall(FunctionCallInfo fcinfo, PGFunction func, int id);
+extern MemoryContext JsonbxCountingContext(MemoryContext parent);
+
+extern void IteratorConcat(JsonbIterator **it1, JsonbIterator **it2, JsonbWriter *w);
+extern void concatJsonbObjects(JsonbIterator **it1, JsonbIterator **it2, uint32 npairs,
+							   int mode, JsonbWriter *w);
+extern void concatJsonbArrays(JsonbIterator **it1, JsonbIterator **it2, uint32 nelems,
+							  JsonbWriter *w);
+extern void unionJsonbArrays(JsonbIterator **it1, JsonbIterator **it2, uint32 nelems,
+							 JsonbWriter *w);
+extern bool deepConcatContainers(JsonbContainer *c1, JsonbContainer *c2, int mode,
+								 JsonbWriter *w);
 
 #endif
@@ -0,0 +1,354 @@
+#include "postgres.h"
+
+#include "utils/builtins.h"
+#include "utils/jsonb.h"
+
+#include "jsonbx.h"
+
+JSONBX_FUNCTION(jsonbx_array_append, JSONBX_STATS_ARRAY_APPEND)
+JSONBX_FUNCTION(jsonbx_array_delete_idx, JSONBX_STATS_ARRAY_DELETE_IDX)
+
+PG_FUNCTION_INFO_V1(jsonbx_array_in);
+Datum jsonbx_array_in(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(jsonbx_array_out);
+Datum jsonbx_array_out(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(jsonbx_array_recv);
+Datum jsonbx_array_recv(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(jsonbx_array_send);
+Datum jsonbx_array_send(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(jsonbx_array_from_jsonb);
+Datum jsonbx_array_from_jsonb(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(jsonbx_array_to_jsonb);
+Datum jsonbx_array_to_jsonb(PG_FUNCTION_ARGS);
+
+static JsonbxArray * JsonbToJsonbxArray(Jsonb *jb);
+static Jsonb * JsonbxArrayToJsonb(JsonbxArray *array);
+static int splitJsonbArray(Jsonb *jb, Jsonb ***chunks);
+static JsonbxArray * spliceJsonbxArray(JsonbxArray *array, int from, int to,
+									   Jsonb **chunks, int nchunks);
+
+
+/*
+ * jsonbx_array_in:
+ * Input of jsonbx_array. The syntax is the same as for a jsonb array.
+ */
+Datum
+jsonbx_array_in(PG_FUNCTION_ARGS)
+{
+	Datum		jb = DirectFunctionCall1(jsonb_in, PG_GETARG_DATUM(0));
+
+	PG_RETURN_JSONBX_ARRAY(JsonbToJsonbxArray(DatumGetJsonb(jb)));
+}
+
+
+/*
+ * jsonbx_array_out:
+ * Output of jsonbx_array in the same form as of the jsonb array.
+ */
+Datum
+jsonbx_array_out(PG_FUNCTION_ARGS)
+{
+	JsonbxArray *array = PG_GETARG_JSONBX_ARRAY(0);
+	Jsonb	   *jb = JsonbxArrayToJsonb(array);
+
+	PG_RETURN_CSTRING(JsonbToCString(NULL, &jb->root, VARSIZE(jb)));
+}
+
+
+/*
+ * jsonbx_array_recv:
+ * Binary input of jsonbx_array in the same format as of jsonb.
+ */
+Datum
+jsonbx_array_recv(PG_FUNCTION_ARGS)
+{
+	Datum		jb = DirectFunctionCall1(jsonb_recv, PG_GETARG_DATUM(0));
+
+	PG_RETURN_JSONBX_ARRAY(JsonbToJsonbxArray(DatumGetJsonb(jb)));
+}
+
+
+/*
+ * jsonbx_array_send:
+ * Binary output of jsonbx_array in the same format as of jsonb.
+ */
+Datum
+jsonbx_array_send(PG_FUNCTION_ARGS)
+{
+	JsonbxArray *array = PG_GETARG_JSONBX_ARRAY(0);
+	Jsonb	   *jb = JsonbxArrayToJsonb(array);
+
+	return DirectFunctionCall1(jsonb_send, PointerGetDatum(jb));
+}
+
+
+/*
+ * jsonbx_array_from_jsonb:
+ * Cast jsonb to jsonbx_array, only an array can be converted.
+ */
+Datum
+jsonbx_array_from_jsonb(PG_FUNCTION_ARGS)
+{
+	Jsonb	   *jb = PG_GETARG_JSONB(0);
+
+	PG_RETURN_JSONBX_ARRAY(JsonbToJsonbxArray(jb));
+}
+
+
+/*
+ * jsonbx_array_to_jsonb:
+ * Cast jsonbx_array to jsonb. It's an implicit cast, so all functions and
+ * operators of jsonb, which are not defined for jsonbx_array, work on it as
+ * well, e.g. jsonb_pretty and ->.
+ */
+Datum
+jsonbx_array_to_jsonb(PG_FUNCTION_ARGS)
+{
+	JsonbxArray *array = PG_GETARG_JSONBX_ARRAY(0);
+
+	PG_RETURN_JSONB(JsonbxArrayToJsonb(array));
+}
+
+
+/*
+ * jsonbx_array_append:
+ * Append elements of the jsonb array, or any other jsonb value as one element,
+ * in the same way as || does for a jsonb array. Only the tail is rebuilt,
+ * and if it becomes too long, it's split into new sealed chunks and a new
+ * tail. The sealed chunks before it are copied in bulk, so the cost of an
+ * append doesn't depend on the number of elements in them.
+ */
+static Datum
+jsonbx_array_append_internal(PG_FUNCTION_ARGS)
+{
+	JsonbxArray	   *array = PG_GETARG_JSONBX_ARRAY_INPUT(0);
+	Jsonb		   *jb = PG_GETARG_JSONB(1);
+	int				last = array->nchunks - 1;
+	Jsonb		   *tail = JSONBX_ARRAY_CHUNK(array, last);
+	uint32			count = JB_ROOT_COUNT(tail);
+	Jsonb		   *arrays[2];
+	Jsonb		   *newtail;
+	Jsonb		  **chunks;
+	int				nchunks;
+
+	if (JB_ROOT_IS_ARRAY(jb) && !JB_ROOT_IS_SCALAR(jb))
+	{
+		if (JB_ROOT_COUNT(jb) == 0)
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+
+		arrays[0] = tail;
+		arrays[1] = jb;
+		newtail = JsonbArrayConcat(arrays, 2);
+	}
+	else
+		newtail = JsonbArraySplice(&tail->root, count, count, &jb, 1);
+
+	nchunks = splitJsonbArray(newtail, &chunks);
+
+	PG_RETURN_JSONBX_ARRAY(spliceJsonbxArray(array, last, last + 1, chunks, nchunks));
+}
+
+
+/*
+ * jsonbx_array_delete_idx:
+ * Delete the element with the index in the same way as jsonb_delete_idx does.
+ * Only the chunk with this element is rebuilt, and it's dropped, if it was
+ * sealed and has no elements left. The other sealed chunks aren't filled up,
+ * they can have less than JSONBX_ARRAY_CHUNK_SIZE elements after a deletion.
+ */
+static Datum
+jsonbx_array_delete_idx_internal(PG_FUNCTION_ARGS)
+{
+	JsonbxArray	   *array = PG_GETARG_JSONBX_ARRAY_INPUT(0);
+	int				idx = PG_GETARG_INT32(1);
+	uint32			n = array->nelems;
+	Jsonb		   *chunk;
+	uint32			count;
+	int				i;
+
+	if (idx < 0)
+	{
+		if (-idx > n)
+			idx = n;
+		else
+			idx = n + idx;
+	}
+
+	if (idx >= n)
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+
+	for (i = 0;; i++)
+	{
+		chunk = JSONBX_ARRAY_CHUNK(array, i);
+		count = JB_ROOT_COUNT(chunk);
+
+		if (idx < count)
+			break;
+
+		idx -= count;
+	}
+
+	if (count == 1 && i < array->nchunks - 1)
+		PG_RETURN_JSONBX_ARRAY(spliceJsonbxArray(array, i, i + 1, NULL, 0));
+
+	chunk = JsonbArraySplice(&chunk->root, idx, idx + 1, NULL, 0);
+
+	PG_RETURN_JSONBX_ARRAY(spliceJsonbxArray(array, i, i + 1, &chunk, 1));
+}
+
+
+/*
+ * Split the jsonb array into chunks, see splitJsonbArray.
+ */
+static JsonbxArray *
+JsonbToJsonbxArray(Jsonb *jb)
+{
+	Jsonb	  **chunks;
+	int			nchunks;
+
+	if (!JB_ROOT_IS_ARRAY(jb) || JB_ROOT_IS_SCALAR(jb))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot convert non-array jsonb to jsonbx_array")));
+
+	nchunks = splitJsonbArray(jb, &chunks);
+
+	return spliceJsonbxArray(NULL, 0, 0, chunks, nchunks);
+}
+
+
+/*
+ * Concatenate all chunks into one jsonb array. If there is only the tail, it's
+ * returned as it is.
+ */
+static Jsonb *
+JsonbxArrayToJsonb(JsonbxArray *array)
+{
+	Jsonb	  **chunks;
+	int			i;
+
+	if (array->nchunks == 1)
+		return JSONBX_ARRAY_CHUNK(array, 0);
+
+	chunks = palloc(sizeof(Jsonb *) * array->nchunks);
+	for (i = 0; i < array->nchunks; i++)
+		chunks[i] = JSONBX_ARRAY_CHUNK(array, i);
+
+	return JsonbArrayConcat(chunks, array->nchunks);
+}
+
+
+/*
+ * Split the jsonb array into sealed chunks of JSONBX_ARRAY_CHUNK_SIZE elements
+ * and the tail with the rest of them, which can be empty. Returns the number
+ * of chunks including the tail.
+ */
+static int
+splitJsonbArray(Jsonb *jb, Jsonb ***chunks)
+{
+	uint32		count = JB_ROOT_COUNT(jb);
+	int			nchunks = count / JSONBX_ARRAY_CHUNK_SIZE + 1;
+	int			i;
+
+	*chunks = palloc(sizeof(Jsonb *) * nchunks);
+
+	if (nchunks == 1)
+	{
+		(*chunks)[0] = jb;
+		return 1;
+	}
+
+	for (i = 0; i < nchunks; i++)
+		(*chunks)[i] = JsonbArraySlice(&jb->root, i * JSONBX_ARRAY_CHUNK_SIZE,
+									   Min((i + 1) * JSONBX_ARRAY_CHUNK_SIZE, count));
+
+	return nchunks;
+}
+
+
+/*
+ * Build a new jsonbx_array, where the chunks [from, to) of the array are
+ * replaced with the new ones. Chunks before and after them are copied in bulk,
+ * only offsets of the chunks after them are shifted. The array can be NULL,
+ * then the result consists only of the new chunks.
+ */
+static JsonbxArray *
+spliceJsonbxArray(JsonbxArray *array, int from, int to, Jsonb **chunks, int nchunks)
+{
+	int				oldnchunks = array ? array->nchunks : 0;
+	int				newnchunks = oldnchunks - (to - from) + nchunks;
+	char		   *olddata = NULL;
+	uint32			olddatalen = 0;
+	uint32			prefixlen = 0;
+	uint32			suffixstart = 0;
+	uint32			nelems = 0;
+	uint32			offset;
+	Size			len;
+	JsonbxArray	   *res;
+	char		   *data;
+	int				i;
+
+	Assert(newnchunks > 0);
+
+	if (array)
+	{
+		olddata = JSONBX_ARRAY_DATA(array);
+		olddatalen = (char *) array + VARSIZE(array) - olddata;
+		prefixlen = from < oldnchunks ? array->offsets[from] : olddatalen;
+		suffixstart = to < oldnchunks ? array->offsets[to] : olddatalen;
+		nelems = array->nelems;
+
+		for (i = from; i < to; i++)
+			nelems -= JB_ROOT_COUNT(JSONBX_ARRAY_CHUNK(array, i));
+	}
+
+	/* every new chunk and the suffix can be preceded by padding */
+	len = JSONBX_ARRAY_HDRSZ + sizeof(uint32) * newnchunks + prefixlen +
+		(olddatalen - suffixstart) + sizeof(int32);
+	for (i = 0; i < nchunks; i++)
+	{
+		len += VARSIZE(chunks[i]) + sizeof(int32);
+		nelems += JB_ROOT_COUNT(chunks[i]);
+	}
+
+	res = palloc0(len);
+	res->nchunks = newnchunks;
+	res->nelems = nelems;
+	data = JSONBX_ARRAY_DATA(res);
+
+	/* the prefix keeps its offsets */
+	if (from > 0)
+	{
+		memcpy(res->offsets, array->offsets, sizeof(uint32) * from);
+		memcpy(data, olddata, prefixlen);
+	}
+	offset = prefixlen;
+
+	for (i = 0; i < nchunks; i++)
+	{
+		offset = INTALIGN(offset);
+		res->offsets[from + i] = offset;
+		memcpy(data + offset, chunks[i], VARSIZE(chunks[i]));
+		offset += VARSIZE(chunks[i]);
+	}
+
+	/* the suffix is shifted as a whole, its padding stays the same */
+	if (to < oldnchunks)
+	{
+		offset = INTALIGN(offset);
+		for (i = to; i < oldnchunks; i++)
+			res->offsets[from + nchunks + i - to] = array->offsets[i] - suffixstart + offset;
+		memcpy(data + offset, olddata + suffixstart, olddatalen - suffixstart);
+		offset += olddatalen - suffixstart;
+	}
+
+	Assert(data + offset <= (char *) res + len);
+	SET_VARSIZE(res, data + offset - (char *) res);
+
+	return res;
+}
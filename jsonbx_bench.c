@@ -0,0 +1,361 @@
+#include "postgres.h"
+
+#include <math.h>
+
+#include "access/htup_details.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/jsonb.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+#include "jsonbx.h"
+
+PG_FUNCTION_INFO_V1(jsonbx_generate);
+Datum jsonbx_generate(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(jsonbx_bench_call);
+Datum jsonbx_bench_call(PG_FUNCTION_ARGS);
+
+/*
+ * The generated document may not have more values than that
+ */
+#define JSONBX_GENERATE_MAX_VALUES	10000000
+
+#define JSONBX_GENERATE_OBJECT		0
+#define JSONBX_GENERATE_ARRAY		1
+#define JSONBX_GENERATE_MIXED		2
+
+typedef struct JsonbGenerator
+{
+	uint64		state;
+	int			fanout;
+	int			key_len;
+	int			string_len;
+	int			shape;
+	char	   *buf;
+} JsonbGenerator;
+
+static JsonbValue * generateValue(JsonbGenerator *gen, JsonbParseState **st,
+								  int depth, int r);
+static void generateScalar(JsonbGenerator *gen, JsonbValue *v);
+static void generateString(JsonbGenerator *gen, int len);
+static uint32 generateNext(JsonbGenerator *gen);
+static int compareLatencies(const void *a, const void *b);
+
+
+/*
+ * jsonbx_generate:
+ * Deterministic synthetic document for benchmarks. Every container has
+ * fanout values, the even ones are nested containers until the depth is
+ * reached, the odd ones are scalars, so the document grows with the depth
+ * as (fanout / 2) ^ depth. Keys are key_len random letters followed by the
+ * number of the key, strings are string_len random letters. Containers are
+ * objects, arrays or randomly both, depending on the shape. The same
+ * arguments always produce the same document.
+ */
+Datum
+jsonbx_generate(PG_FUNCTION_ARGS)
+{
+	int				depth = PG_GETARG_INT32(0);
+	JsonbGenerator	gen;
+	JsonbParseState *st = NULL;
+	JsonbValue	   *res;
+	char		   *shape;
+	double			nvalues = 1;
+	int				i;
+
+	gen.fanout = PG_GETARG_INT32(1);
+	gen.key_len = PG_GETARG_INT32(2);
+	gen.string_len = PG_GETARG_INT32(3);
+	gen.state = (uint64) PG_GETARG_INT64(4);
+	shape = text_to_cstring(PG_GETARG_TEXT_PP(5));
+
+	if (depth < 0 || gen.fanout < 0 || gen.key_len < 0 || gen.string_len < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("depth, fanout and lengths must not be negative")));
+
+	if (strcmp(shape, "object") == 0)
+		gen.shape = JSONBX_GENERATE_OBJECT;
+	else if (strcmp(shape, "array") == 0)
+		gen.shape = JSONBX_GENERATE_ARRAY;
+	else if (strcmp(shape, "mixed") == 0)
+		gen.shape = JSONBX_GENERATE_MIXED;
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unrecognized shape \"%s\"", shape),
+				 errhint("Shape must be \"object\", \"array\" or \"mixed\".")));
+
+	for (i = 0; i < depth && nvalues <= JSONBX_GENERATE_MAX_VALUES; i++)
+		nvalues = 1 + (gen.fanout / 2) + ((gen.fanout + 1) / 2) * nvalues;
+
+	if (nvalues > JSONBX_GENERATE_MAX_VALUES)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("document with depth %d and fanout %d is too large",
+						depth, gen.fanout)));
+
+	gen.buf = palloc(Max(gen.key_len, gen.string_len) + 16);
+
+	/* a scalar is wrapped into the raw scalar array by JsonbValueToJsonbWorker */
+	res = generateValue(&gen, &st, depth, WJB_ELEM);
+
+	PG_RETURN_JSONB(JsonbValueToJsonbWorker(res, 0));
+}
+
+
+/*
+ * Generate a value with the depth, and push it into the parse state as r
+ * (WJB_VALUE or WJB_ELEM). A scalar at the top level is only returned.
+ */
+static JsonbValue *
+generateValue(JsonbGenerator *gen, JsonbParseState **st, int depth, int r)
+{
+	JsonbValue	v;
+	bool		isObject;
+	int			i;
+
+	check_stack_depth();
+
+	if (depth == 0)
+	{
+		generateScalar(gen, &v);
+
+		if (*st == NULL)
+		{
+			JsonbValue *res = palloc(sizeof(JsonbValue));
+
+			*res = v;
+			return res;
+		}
+
+		return pushJsonbValue(st, r, &v);
+	}
+
+	if (gen->shape == JSONBX_GENERATE_MIXED)
+		isObject = generateNext(gen) % 2 == 0;
+	else
+		isObject = gen->shape == JSONBX_GENERATE_OBJECT;
+
+	pushJsonbValue(st, isObject ? WJB_BEGIN_OBJECT : WJB_BEGIN_ARRAY, NULL);
+
+	for (i = 0; i < gen->fanout; i++)
+	{
+		if (isObject)
+		{
+			generateString(gen, gen->key_len);
+			sprintf(gen->buf + gen->key_len, "%d", i);
+
+			v.type = jbvString;
+			v.val.string.len = strlen(gen->buf);
+			v.val.string.val = pstrdup(gen->buf);
+			pushJsonbValue(st, WJB_KEY, &v);
+		}
+
+		if (i % 2 == 0)
+			generateValue(gen, st, depth - 1, isObject ? WJB_VALUE : WJB_ELEM);
+		else
+		{
+			generateScalar(gen, &v);
+			pushJsonbValue(st, isObject ? WJB_VALUE : WJB_ELEM, &v);
+		}
+	}
+
+	return pushJsonbValue(st, isObject ? WJB_END_OBJECT : WJB_END_ARRAY, NULL);
+}
+
+
+/*
+ * Half of scalars are strings, the rest are numbers, booleans and nulls.
+ */
+static void
+generateScalar(JsonbGenerator *gen, JsonbValue *v)
+{
+	uint32		kind = generateNext(gen) % 10;
+
+	if (kind < 5)
+	{
+		generateString(gen, gen->string_len);
+
+		v->type = jbvString;
+		v->val.string.len = gen->string_len;
+		v->val.string.val = pnstrdup(gen->buf, gen->string_len);
+	}
+	else if (kind < 8)
+	{
+		v->type = jbvNumeric;
+		v->val.numeric = DatumGetNumeric(DirectFunctionCall1(int4_numeric,
+							Int32GetDatum(generateNext(gen) % 1000000)));
+	}
+	else if (kind < 9)
+	{
+		v->type = jbvBool;
+		v->val.boolean = generateNext(gen) % 2 == 0;
+	}
+	else
+		v->type = jbvNull;
+}
+
+
+/*
+ * Random lowercase letters in the generator buffer.
+ */
+static void
+generateString(JsonbGenerator *gen, int len)
+{
+	int			i;
+
+	for (i = 0; i < len; i++)
+		gen->buf[i] = 'a' + generateNext(gen) % 26;
+
+	gen->buf[len] = '\0';
+}
+
+
+/*
+ * A linear congruential generator, which is the same on every platform,
+ * unlike random().
+ */
+static uint32
+generateNext(JsonbGenerator *gen)
+{
+	gen->state = gen->state * UINT64CONST(6364136223846793005) +
+		UINT64CONST(1442695040888963407);
+
+	return (uint32) (gen->state >> 33);
+}
+
+
+/*
+ * jsonbx_bench_call:
+ * Call the function with the arguments the specified number of times, and
+ * return its throughput, latency percentiles in microseconds and the number
+ * of bytes it allocates per call. The function is looked up once, so its
+ * fn_extra is kept between calls as within one query, and every call gets
+ * a fresh memory context, which is reset afterwards. Allocated bytes are
+ * counted by JsonbxCountingContext.
+ */
+Datum
+jsonbx_bench_call(PG_FUNCTION_ARGS)
+{
+	Oid					funcid = PG_GETARG_OID(0);
+	int					calls = PG_GETARG_INT32(1);
+	int					nargs = PG_NARGS() - 2;
+	Oid				   *argtypes;
+	int					nfuncargs;
+	FmgrInfo			flinfo;
+	FunctionCallInfoData callinfo;
+	MemoryContext		callcontext;
+	MemoryContext		oldcontext;
+	double			   *latencies;
+	double				total = 0;
+	Size				allocated = 0;
+	TupleDesc			tupdesc;
+	Datum				values[8];
+	bool				nulls[8];
+	AclResult			aclresult;
+	int					i;
+
+	if (calls <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of calls must be positive")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* the function is called directly, so EXECUTE is checked here */
+	aclresult = pg_proc_aclcheck(funcid, GetUserId(), ACL_EXECUTE);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, ACL_KIND_PROC, get_func_name(funcid));
+
+	get_func_signature(funcid, &argtypes, &nfuncargs);
+
+	if (nfuncargs != nargs)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("function %s expects %d arguments, got %d",
+						format_procedure(funcid), nfuncargs, nargs)));
+
+	fmgr_info(funcid, &flinfo);
+	InitFunctionCallInfoData(callinfo, &flinfo, nargs, PG_GET_COLLATION(), NULL, NULL);
+
+	for (i = 0; i < nargs; i++)
+	{
+		if (get_fn_expr_argtype(fcinfo->flinfo, i + 2) != argtypes[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+					 errmsg("argument %d must be of type %s", i + 1,
+							format_type_be(argtypes[i]))));
+
+		callinfo.arg[i] = PG_GETARG_DATUM(i + 2);
+		callinfo.argnull[i] = false;
+	}
+
+	latencies = palloc(sizeof(double) * calls);
+	callcontext = AllocSetContextCreate(CurrentMemoryContext,
+										"jsonbx bench",
+										ALLOCSET_DEFAULT_MINSIZE,
+										ALLOCSET_DEFAULT_INITSIZE,
+										ALLOCSET_DEFAULT_MAXSIZE);
+
+	for (i = 0; i < calls; i++)
+	{
+		instr_time	start;
+		instr_time	duration;
+
+		CHECK_FOR_INTERRUPTS();
+
+		memset(&jsonbxMemoryUsage, 0, sizeof(JsonbxMemoryUsage));
+		oldcontext = MemoryContextSwitchTo(JsonbxCountingContext(callcontext));
+
+		INSTR_TIME_SET_CURRENT(start);
+		callinfo.isnull = false;
+		(void) FunctionCallInvoke(&callinfo);
+		INSTR_TIME_SET_CURRENT(duration);
+
+		MemoryContextSwitchTo(oldcontext);
+
+		INSTR_TIME_SUBTRACT(duration, start);
+		latencies[i] = INSTR_TIME_GET_DOUBLE(duration) * 1000000.0;
+		total += latencies[i];
+
+		allocated += jsonbxMemoryUsage.allocated;
+		MemoryContextResetAndDeleteChildren(callcontext);
+	}
+
+	MemoryContextDelete(callcontext);
+
+	qsort(latencies, calls, sizeof(double), compareLatencies);
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int32GetDatum(calls);
+	values[1] = Float8GetDatum(total / 1000.0);
+	values[2] = Float8GetDatum(total > 0 ? calls / (total / 1000000.0) : 0);
+	values[3] = Float8GetDatum(latencies[(int) ceil(calls * 0.50) - 1]);
+	values[4] = Float8GetDatum(latencies[(int) ceil(calls * 0.95) - 1]);
+	values[5] = Float8GetDatum(latencies[(int) ceil(calls * 0.99) - 1]);
+	values[6] = Float8GetDatum(latencies[calls - 1]);
+	values[7] = Int64GetDatum((int64) (allocated / calls));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc),
+													  values, nulls)));
+}
+
+
+static int
+compareLatencies(const void *a, const void *b)
+{
+	double		la = *(const double *) a;
+	double		lb = *(const double *) b;
+
+	if (la == lb)
+		return 0;
+
+	return (la < lb) ? -1 : 1;
+}
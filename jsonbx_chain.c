@@ -0,0 +1,678 @@
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "parser/parse_func.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/jsonb.h"
+#include "utils/lsyscache.h"
+#include "utils/syscache.h"
+
+#include "jsonbx.h"
+
+JSONBX_FUNCTION(jsonbx_chain, JSONBX_STATS_CHAIN)
+
+PG_FUNCTION_INFO_V1(jsonbx_chain_transform);
+Datum jsonbx_chain_transform(PG_FUNCTION_ARGS);
+
+/*
+ * Operations of jsonbx_chain, in the order of their names
+ */
+#define CHAIN_SET			0
+#define CHAIN_DELETE		1
+#define CHAIN_DELETE_KEY	2
+#define CHAIN_CONCAT		3
+
+static const char *chainOpNames[] = {"set", "delete", "delete_key", "concat"};
+
+/* Number of arguments of every operation after the document */
+static const int chainOpNargs[] = {3, 1, 1, 1};
+
+/*
+ * ChainOp:
+ * One operation of jsonbx_chain with its arguments. The path is NULL if it
+ * can't be applied in one pass (it has NULLs or more than one dimension),
+ * it's prepared again and checked by the operation itself then.
+ */
+typedef struct ChainOp
+{
+	int			op;
+	int			argno;			/* the first argument of the operation */
+	JsonbPath  *path;			/* set and delete */
+	Jsonb	   *value;			/* set and concat */
+	bool		create;			/* set */
+	text	   *key;			/* delete_key */
+} ChainOp;
+
+/*
+ * ChainPath:
+ * Path of an operation in the trie. Every key of concat is a separate path.
+ */
+typedef struct ChainPath
+{
+	JsonbPath  *path;
+	int			op;				/* one of JSONB_MODIFY_* */
+	Jsonb	   *value;
+} ChainPath;
+
+static int getChainOp(Datum name);
+static Node * getChainCall(Node *node, Oid transform, Oid chain,
+						   List **ops, List **args);
+static JsonbPath * getChainPathArg(FunctionCallInfo fcinfo, int argno, bool check);
+static void checkChainArgType(FunctionCallInfo fcinfo, int argno, Oid type);
+static bool collectChainPaths(Jsonb *in, ChainOp *ops, int nops,
+							  ChainPath **paths, int *npaths);
+static bool independentChainPaths(ChainPath *paths, int npaths);
+static int compareChainPaths(const void *a, const void *b);
+static JsonbPath * makeSingleKeyPath(char *key, int keylen);
+static Jsonb * applyChainPaths(Jsonb *in, ChainPath *paths, int npaths);
+static Jsonb * applyChainOps(Jsonb *in, ChainOp *ops, int nops, FunctionCallInfo fcinfo);
+
+
+/*
+ * jsonbx_chain_transform:
+ * Planner transform (protransform) of jsonb_set, jsonb_delete and
+ * jsonb_concat. If the document argument of the call is another call of
+ * these functions, both of them are folded into one call of jsonbx_chain,
+ * so a chain like ((doc || a) - 'x') || b produces only one new jsonb.
+ * Arguments of the calls become arguments of jsonbx_chain in the same order
+ * after the list of operations.
+ */
+Datum
+jsonbx_chain_transform(PG_FUNCTION_ARGS)
+{
+	FuncExpr   *expr = (FuncExpr *) PG_GETARG_POINTER(0);
+	Oid			transform = fcinfo->flinfo->fn_oid;
+	Oid			argtypes[3] = {JSONBOID, TEXTARRAYOID, ANYOID};
+	char	   *nspname;
+	Oid			chain;
+	Node	   *doc;
+	List	   *ops = NIL;
+	List	   *args = NIL;
+	List	   *outer_ops = NIL;
+	List	   *outer_args = NIL;
+	Datum	   *op_elems;
+	ListCell   *lc;
+	int			i;
+
+	Assert(IsA(expr, FuncExpr));
+
+	if (list_length(expr->args) < 2 ||
+		!(IsA(linitial(expr->args), FuncExpr) || IsA(linitial(expr->args), OpExpr)))
+		PG_RETURN_POINTER(NULL);
+
+	/* jsonbx_chain is in the same schema as this function */
+	nspname = get_namespace_name(get_func_namespace(transform));
+	chain = LookupFuncName(list_make2(makeString(nspname), makeString("jsonbx_chain")),
+						   3, argtypes, true);
+	if (!OidIsValid(chain))
+		PG_RETURN_POINTER(NULL);
+
+	doc = getChainCall(linitial(expr->args), transform, chain, &ops, &args);
+	if (doc == NULL)
+		PG_RETURN_POINTER(NULL);
+
+	if (getChainCall((Node *) expr, transform, chain, &outer_ops, &outer_args) == NULL)
+		PG_RETURN_POINTER(NULL);
+
+	ops = list_concat(ops, outer_ops);
+	args = list_concat(args, outer_args);
+
+	if (list_length(args) + 2 > FUNC_MAX_ARGS)
+		PG_RETURN_POINTER(NULL);
+
+	op_elems = palloc(sizeof(Datum) * list_length(ops));
+	i = 0;
+	foreach(lc, ops)
+		op_elems[i++] = CStringGetTextDatum(chainOpNames[lfirst_int(lc)]);
+
+	args = lcons(makeConst(TEXTARRAYOID, -1, InvalidOid, -1,
+						   PointerGetDatum(construct_array(op_elems, i, TEXTOID,
+														   -1, false, 'i')),
+						   false, false),
+				 args);
+	args = lcons(doc, args);
+
+	PG_RETURN_POINTER(makeFuncExpr(chain, JSONBOID, args, InvalidOid,
+								   expr->inputcollid, COERCE_EXPLICIT_CALL));
+}
+
+
+/*
+ * getChainCall:
+ * If the node is a call of jsonbx_chain or of a function with this transform,
+ * add its operations and arguments (except the document) to the lists and
+ * return the document argument, otherwise return NULL.
+ */
+static Node *
+getChainCall(Node *node, Oid transform, Oid chain, List **ops, List **args)
+{
+	Oid			funcid;
+	List	   *fargs;
+	HeapTuple	tuple;
+	Form_pg_proc procform;
+	Datum		prosrc;
+	bool		isnull;
+	char	   *src;
+	int			op;
+
+	if (IsA(node, FuncExpr))
+	{
+		funcid = ((FuncExpr *) node)->funcid;
+		fargs = ((FuncExpr *) node)->args;
+	}
+	else if (IsA(node, OpExpr))
+	{
+		set_opfuncid((OpExpr *) node);
+		funcid = ((OpExpr *) node)->opfuncid;
+		fargs = ((OpExpr *) node)->args;
+	}
+	else
+		return NULL;
+
+	if (funcid == chain)
+	{
+		Const	   *names = (Const *) lsecond(fargs);
+		Datum	   *elems;
+		bool	   *nulls;
+		int			nelems;
+		int			i;
+
+		if (!IsA(names, Const) || names->constisnull)
+			return NULL;
+
+		deconstruct_array(DatumGetArrayTypeP(names->constvalue), TEXTOID, -1, false, 'i',
+						  &elems, &nulls, &nelems);
+
+		for (i = 0; i < nelems; i++)
+			*ops = lappend_int(*ops, getChainOp(elems[i]));
+
+		*args = list_concat(*args, list_copy_tail(fargs, 2));
+
+		return linitial(fargs);
+	}
+
+	tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcid));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for function %u", funcid);
+
+	procform = (Form_pg_proc) GETSTRUCT(tuple);
+	if (procform->protransform != transform)
+	{
+		ReleaseSysCache(tuple);
+		return NULL;
+	}
+
+	prosrc = SysCacheGetAttr(PROCOID, tuple, Anum_pg_proc_prosrc, &isnull);
+	src = TextDatumGetCString(prosrc);
+	ReleaseSysCache(tuple);
+
+	if (strcmp(src, "jsonb_set") == 0 || strcmp(src, "jsonb_set_jsonbx_path") == 0)
+		op = CHAIN_SET;
+	else if (strcmp(src, "jsonb_delete_path") == 0 ||
+			 strcmp(src, "jsonb_delete_jsonbx_path") == 0)
+		op = CHAIN_DELETE;
+	else if (strcmp(src, "jsonb_delete") == 0)
+		op = CHAIN_DELETE_KEY;
+	else if (strcmp(src, "jsonb_concat") == 0)
+		op = CHAIN_CONCAT;
+	else
+		return NULL;
+
+	if (list_length(fargs) != chainOpNargs[op] + 1)
+		return NULL;
+
+	*ops = lappend_int(*ops, op);
+	*args = list_concat(*args, list_copy_tail(fargs, 1));
+
+	return linitial(fargs);
+}
+
+
+static int
+getChainOp(Datum name)
+{
+	char	   *opname = TextDatumGetCString(name);
+	int			op;
+
+	for (op = 0; op < lengthof(chainOpNames); op++)
+	{
+		if (strcmp(opname, chainOpNames[op]) == 0)
+			return op;
+	}
+
+	elog(ERROR, "unknown jsonbx_chain operation \"%s\"", opname);
+	return -1;					/* keep compiler quiet */
+}
+
+
+/*
+ * jsonbx_chain:
+ * Apply the operations to jsonb one by one, with the same result as the
+ * chain of calls it replaces (see jsonbx_chain_transform). If the root is
+ * an object, and paths of all operations are independent, all of them are
+ * merged into a trie and applied in one pass by modifyPath, otherwise every
+ * operation gets the result of the previous one. The result is the same in
+ * both cases, but if several operations fail in one pass, the reported error
+ * may belong to another one.
+ *
+ * The first argument is the document, the second one is the list of
+ * operations, then arguments of every operation follow:
+ * - set: path (text[] or jsonbx_path), value, create_if_missing
+ * - delete: path (text[] or jsonbx_path)
+ * - delete_key: text
+ * - concat: jsonb
+ */
+static Datum
+jsonbx_chain_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb	   *in = PG_GETARG_JSONB_INPUT(0);
+	ArrayType  *names = PG_GETARG_ARRAYTYPE_P(1);
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nops;
+	ChainOp	   *ops;
+	ChainPath  *paths;
+	int			npaths;
+	int			argno = 2;
+	bool		onepass = true;
+	int			i;
+
+	deconstruct_array(names, TEXTOID, -1, false, 'i', &elems, &nulls, &nops);
+
+	ops = palloc0(sizeof(ChainOp) * Max(nops, 1));
+
+	for (i = 0; i < nops; i++)
+	{
+		ChainOp    *op = &ops[i];
+
+		op->op = getChainOp(elems[i]);
+		op->argno = argno;
+
+		if (argno + chainOpNargs[op->op] > PG_NARGS())
+			elog(ERROR, "wrong number of jsonbx_chain arguments");
+
+		switch (op->op)
+		{
+			case CHAIN_SET:
+				checkChainArgType(fcinfo, argno + 1, JSONBOID);
+				checkChainArgType(fcinfo, argno + 2, BOOLOID);
+				op->path = getChainPathArg(fcinfo, argno, false);
+				op->value = PG_GETARG_JSONB(argno + 1);
+				op->create = PG_GETARG_BOOL(argno + 2);
+				break;
+			case CHAIN_DELETE:
+				op->path = getChainPathArg(fcinfo, argno, false);
+				break;
+			case CHAIN_DELETE_KEY:
+				checkChainArgType(fcinfo, argno, TEXTOID);
+				op->key = PG_GETARG_TEXT_PP(argno);
+				break;
+			case CHAIN_CONCAT:
+				checkChainArgType(fcinfo, argno, JSONBOID);
+				op->value = PG_GETARG_JSONB(argno);
+				break;
+		}
+
+		onepass = onepass && (op->op == CHAIN_DELETE_KEY || op->op == CHAIN_CONCAT ||
+							  op->path != NULL);
+		argno += chainOpNargs[op->op];
+	}
+
+	if (argno != PG_NARGS())
+		elog(ERROR, "wrong number of jsonbx_chain arguments");
+
+	if (onepass && collectChainPaths(in, ops, nops, &paths, &npaths) &&
+		independentChainPaths(paths, npaths))
+		PG_RETURN_JSONB(applyChainPaths(in, paths, npaths));
+
+	PG_RETURN_JSONB(applyChainOps(in, ops, nops, fcinfo));
+}
+
+
+/*
+ * getChainPathArg:
+ * Prepare the path argument, which is text[] or jsonbx_path. If check is
+ * false, NULL is returned for a path, which is not valid for the one pass
+ * application, otherwise the errors of jsonb_set are reported.
+ */
+static JsonbPath *
+getChainPathArg(FunctionCallInfo fcinfo, int argno, bool check)
+{
+	Oid			type = get_fn_expr_argtype(fcinfo->flinfo, argno);
+	ArrayType  *array;
+	JsonbPath  *path;
+	int			i;
+
+	if (type != TEXTARRAYOID)
+	{
+		/* jsonbx_path is in the same schema as jsonbx_chain */
+		Oid		nsp = get_func_namespace(fcinfo->flinfo->fn_oid);
+
+		checkChainArgType(fcinfo, argno,
+						  GetSysCacheOid2(TYPENAMENSP, CStringGetDatum("jsonbx_path"),
+										  ObjectIdGetDatum(nsp)));
+
+		return makeJsonbPathFromJsonbx(PG_GETARG_JSONBX_PATH(argno));
+	}
+
+	array = PG_GETARG_ARRAYTYPE_P(argno);
+
+	if (ARR_NDIM(array) > 1)
+	{
+		if (!check)
+			return NULL;
+
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("wrong number of array subscripts")));
+	}
+
+	path = makeJsonbPath(array);
+
+	for (i = 0; i < path->len && !check; i++)
+	{
+		if (path->nulls[i])
+			return NULL;
+	}
+
+	return path;
+}
+
+
+/*
+ * checkChainArgType:
+ * jsonbx_chain takes arguments of any type, so they are checked at runtime.
+ */
+static void
+checkChainArgType(FunctionCallInfo fcinfo, int argno, Oid type)
+{
+	if (get_fn_expr_argtype(fcinfo->flinfo, argno) != type || !OidIsValid(type))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("argument %d of jsonbx_chain must be of type %s", argno + 1,
+						OidIsValid(type) ? format_type_be(type) : "jsonbx_path")));
+}
+
+
+/*
+ * collectChainPaths:
+ * Convert the operations to paths in the trie. It's possible only for an
+ * object, where a deleted key is the path of one element, and concatenation
+ * with another object sets every key of it. Returns false, if the operations
+ * can't be converted.
+ */
+static bool
+collectChainPaths(Jsonb *in, ChainOp *ops, int nops, ChainPath **paths, int *npaths)
+{
+	int			size = nops;
+	int			n = 0;
+	int			i;
+
+	if (!JB_ROOT_IS_OBJECT(in))
+		return false;
+
+	for (i = 0; i < nops; i++)
+	{
+		if (ops[i].op != CHAIN_CONCAT)
+			continue;
+
+		if (!JB_ROOT_IS_OBJECT(ops[i].value))
+			return false;
+
+		size += JB_ROOT_COUNT(ops[i].value);
+	}
+
+	*paths = palloc(sizeof(ChainPath) * Max(size, 1));
+
+	for (i = 0; i < nops; i++)
+	{
+		ChainOp    *op = &ops[i];
+
+		switch (op->op)
+		{
+			case CHAIN_SET:
+				/* the same as jsonb_set with an empty path */
+				if (op->path->len == 0)
+					break;
+
+				(*paths)[n].path = op->path;
+				(*paths)[n].op = op->create ? JSONB_MODIFY_SET : JSONB_MODIFY_REPLACE;
+				(*paths)[n++].value = op->value;
+				break;
+			case CHAIN_DELETE:
+				if (op->path->len == 0)
+					break;
+
+				(*paths)[n].path = op->path;
+				(*paths)[n].op = JSONB_MODIFY_DELETE;
+				(*paths)[n++].value = NULL;
+				break;
+			case CHAIN_DELETE_KEY:
+				(*paths)[n].path = makeSingleKeyPath(VARDATA_ANY(op->key),
+													 VARSIZE_ANY_EXHDR(op->key));
+				(*paths)[n].op = JSONB_MODIFY_DELETE;
+				(*paths)[n++].value = NULL;
+				break;
+			case CHAIN_CONCAT:
+				{
+					JsonbIterator  *it = JsonbIteratorInit(&op->value->root);
+					JsonbValue		k, v;
+					int				r;
+
+					while ((r = JsonbIteratorNext(&it, &k, true)) != WJB_DONE)
+					{
+						Jsonb	   *value;
+
+						if (r != WJB_KEY)
+							continue;
+
+						r = JsonbIteratorNext(&it, &v, true);
+						Assert(r == WJB_VALUE);
+
+						if (v.type == jbvBinary)
+						{
+							/* the nested container gets a varlena header */
+							value = palloc(VARHDRSZ + v.val.binary.len);
+							SET_VARSIZE(value, VARHDRSZ + v.val.binary.len);
+							memcpy(&value->root, v.val.binary.data, v.val.binary.len);
+						}
+						else
+							value = JsonbValueToJsonb(&v);
+
+						(*paths)[n].path = makeSingleKeyPath(k.val.string.val,
+															 k.val.string.len);
+						(*paths)[n].op = JSONB_MODIFY_SET;
+						(*paths)[n++].value = value;
+					}
+				}
+				break;
+		}
+	}
+
+	*npaths = n;
+	return true;
+}
+
+
+/*
+ * independentChainPaths:
+ * Paths are independent, if none of them is a prefix of another, and any two
+ * of them diverge at an object key, so the order of operations doesn't
+ * matter. Array indexes are not allowed at the point of divergence, since
+ * deletion of an element shifts the following ones, and only the root
+ * is known to be an object. Sorted paths can be compared with the neighbours
+ * only.
+ */
+static bool
+independentChainPaths(ChainPath *paths, int npaths)
+{
+	int			i;
+
+	qsort(paths, npaths, sizeof(ChainPath), compareChainPaths);
+
+	for (i = 1; i < npaths; i++)
+	{
+		JsonbPath  *a = paths[i - 1].path;
+		JsonbPath  *b = paths[i].path;
+		int			level = 0;
+
+		while (level < a->len && level < b->len &&
+			   compareJsonbKeys(a->keys[level], a->keylens[level],
+								b->keys[level], b->keylens[level]) == 0)
+			level++;
+
+		if (level == a->len || level == b->len)
+			return false;
+
+		if (level > 0 && (a->isIndex[level] || b->isIndex[level]))
+			return false;
+	}
+
+	return true;
+}
+
+
+static int
+compareChainPaths(const void *a, const void *b)
+{
+	JsonbPath  *pa = ((const ChainPath *) a)->path;
+	JsonbPath  *pb = ((const ChainPath *) b)->path;
+	int			level;
+
+	for (level = 0; level < pa->len && level < pb->len; level++)
+	{
+		int			cmp = compareJsonbKeys(pa->keys[level], pa->keylens[level],
+										   pb->keys[level], pb->keylens[level]);
+
+		if (cmp != 0)
+			return cmp;
+	}
+
+	return (pa->len > pb->len) ? 1 : ((pa->len < pb->len) ? -1 : 0);
+}
+
+
+static JsonbPath *
+makeSingleKeyPath(char *key, int keylen)
+{
+	JsonbPath  *path = allocJsonbPath(1);
+
+	path->keys[0] = key;
+	path->keylens[0] = keylen;
+	path->isIndex[0] = parseArrayIndex(key, keylen, &path->indexes[0]);
+
+	return path;
+}
+
+
+/*
+ * applyChainPaths:
+ * Apply independent paths in one pass, as jsonb_modify does.
+ */
+static Jsonb *
+applyChainPaths(Jsonb *in, ChainPath *paths, int npaths)
+{
+	PathTrieNode	*root = makePathTrieNode((Datum) 0);
+	JsonbIterator	*it;
+	JsonbWriter		w;
+	int				estimated_len = VARSIZE(in);
+	int				i;
+
+	if (npaths == 0)
+		return in;
+
+	for (i = 0; i < npaths; i++)
+	{
+		JsonbPath  *path = paths[i].path;
+		Datum	   *elems = palloc(sizeof(Datum) * path->len);
+		int			level;
+
+		for (level = 0; level < path->len; level++)
+			elems[level] = PointerGetDatum(cstring_to_text_with_len(path->keys[level],
+																	path->keylens[level]));
+
+		addPathToTrie(root, elems, path->len, paths[i].op, paths[i].value);
+
+		if (paths[i].value != NULL)
+			estimated_len += VARSIZE(paths[i].value);
+	}
+
+	it = JsonbIteratorInit(&in->root);
+	initJsonbWriter(&w, estimated_len);
+	modifyPath(&it, root, &w, 0);
+
+	return finishJsonbWriter(&w);
+}
+
+
+/*
+ * applyChainOps:
+ * Apply the operations one by one in the same way as the functions they
+ * come from. Intermediate results are freed as soon as they are used.
+ */
+static Jsonb *
+applyChainOps(Jsonb *in, ChainOp *ops, int nops, FunctionCallInfo fcinfo)
+{
+	Jsonb	   *res = in;
+	bool		owned = false;	/* res is an intermediate value */
+	int			i;
+
+	for (i = 0; i < nops; i++)
+	{
+		ChainOp    *op = &ops[i];
+		bool		isArg = false;
+		Jsonb	   *prev = res;
+		JsonbValue	v;
+
+		switch (op->op)
+		{
+			case CHAIN_SET:
+				JsonbToJsonbValue(op->value, &v);
+				res = setJsonbPath(res, op->path ? op->path :
+								   getChainPathArg(fcinfo, op->argno, true),
+								   &v, op->create);
+				break;
+			case CHAIN_DELETE:
+				res = deleteJsonbPath(res, op->path ? op->path :
+									  getChainPathArg(fcinfo, op->argno, true));
+				break;
+			case CHAIN_DELETE_KEY:
+				res = deleteJsonbKey(res, VARDATA_ANY(op->key),
+									 VARSIZE_ANY_EXHDR(op->key));
+				break;
+			case CHAIN_CONCAT:
+				{
+					/* consecutive concatenations are done at once */
+					Jsonb	  **jbs = palloc(sizeof(Jsonb *) * (nops - i + 1));
+					int			njbs = 0;
+
+					jbs[njbs++] = res;
+					while (i < nops && ops[i].op == CHAIN_CONCAT)
+						jbs[njbs++] = ops[i++].value;
+					i--;
+
+					res = concatJsonbs(jbs, njbs);
+
+					/* || may return one of the values as is */
+					while (--njbs > 0)
+						isArg = isArg || res == jbs[njbs];
+					pfree(jbs);
+				}
+				break;
+		}
+
+		if (res != prev)
+		{
+			if (owned)
+				pfree(prev);
+			owned = !isArg;
+		}
+	}
+
+	return res;
+}
@@ -0,0 +1,735 @@
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "utils/jsonb.h"
+
+#include "jsonbx.h"
+
+static void convertJsonbValue(StringInfo buffer, JEntry *header, JsonbValue *val, int level);
+static void convertJsonbArray(StringInfo buffer, JEntry *header, JsonbValue *val, int level);
+static void convertJsonbObject(StringInfo buffer, JEntry *header, JsonbValue *val, int level);
+static void convertJsonbScalar(StringInfo buffer, JEntry *header, JsonbValue *scalarVal);
+static void convertJsonbBinary(StringInfo buffer, JEntry *header, JsonbValue *binaryVal);
+
+static void beginWriterContainer(JsonbWriter *w, bool isObject, int nvalues,
+								 bool rawScalar);
+static void endWriterContainer(JsonbWriter *w);
+static void addWriterKey(JsonbWriter *w, JsonbValue *key);
+static void addWriterValue(JsonbWriter *w, JsonbValue *val);
+static void addWriterEntry(JsonbWriterLevel *level, JEntry entry);
+
+static int reserveFromBuffer(StringInfo buffer, int len);
+static void appendToBuffer(StringInfo buffer, const char *data, int len);
+static void copyToBuffer(StringInfo buffer, int offset, const char *data, int len);
+static short padBufferToInt(StringInfo buffer);
+
+
+/*
+ * JsonbValueToJsonbWorker:
+ * Turn an in-memory JsonbValue into a Jsonb for on-disk storage.
+ * See the original function JsonbValueToJsonb in the jsonb_util.c
+ * The only considerable change is that jbvBinary values are accepted
+ * at any nesting level: their containers are copied as is, together with
+ * all JEntries and data, instead of being decoded and encoded again.
+ * This allows to rebuild only the modified part of a document.
+ */
+Jsonb *
+JsonbValueToJsonbWorker(JsonbValue *val, int estimated_len)
+{
+	StringInfoData	buffer;
+	JEntry			jentry;
+	Jsonb		   *res;
+
+	initStringInfo(&buffer);
+
+	if (estimated_len > buffer.maxlen)
+		enlargeStringInfo(&buffer, estimated_len);
+
+	/* Make room for the varlena header */
+	reserveFromBuffer(&buffer, VARHDRSZ);
+
+	if (IsAJsonbScalar(val))
+	{
+		/* Scalar value should be wrapped into the raw scalar array */
+		JsonbValue	scalarArray;
+
+		scalarArray.type = jbvArray;
+		scalarArray.val.array.rawScalar = true;
+		scalarArray.val.array.nElems = 1;
+		scalarArray.val.array.elems = val;
+
+		convertJsonbValue(&buffer, &jentry, &scalarArray, 0);
+	}
+	else
+		convertJsonbValue(&buffer, &jentry, val, 0);
+
+	res = (Jsonb *) buffer.data;
+
+	SET_VARSIZE(res, buffer.len);
+
+	return res;
+}
+
+
+/*
+ * Convert a single JsonbValue into the buffer, producing a JEntry for it
+ * in the *header. Containers and scalars are handled as in jsonb_util.c,
+ * binary values are copied without any decoding.
+ */
+static void
+convertJsonbValue(StringInfo buffer, JEntry *header, JsonbValue *val, int level)
+{
+	check_stack_depth();
+
+	if (!val)
+		return;
+
+	if (IsAJsonbScalar(val))
+		convertJsonbScalar(buffer, header, val);
+	else if (val->type == jbvArray)
+		convertJsonbArray(buffer, header, val, level);
+	else if (val->type == jbvObject)
+		convertJsonbObject(buffer, header, val, level);
+	else if (val->type == jbvBinary)
+		convertJsonbBinary(buffer, header, val);
+	else
+		elog(ERROR, "unknown type of jsonb container to convert");
+}
+
+static void
+convertJsonbArray(StringInfo buffer, JEntry *pheader, JsonbValue *val, int level)
+{
+	int			base_offset;
+	int			jentry_offset;
+	int			i;
+	int			totallen;
+	uint32		header;
+	int			nElems = val->val.array.nElems;
+
+	/* Remember where in the buffer this array starts. */
+	base_offset = buffer->len;
+
+	/* Align to 4-byte boundary (any padding counts as part of my data) */
+	padBufferToInt(buffer);
+
+	header = nElems | JB_FARRAY;
+	if (val->val.array.rawScalar)
+	{
+		Assert(nElems == 1);
+		Assert(level == 0);
+		header |= JB_FSCALAR;
+	}
+
+	appendToBuffer(buffer, (char *) &header, sizeof(uint32));
+
+	/* Reserve space for the JEntries of the elements. */
+	jentry_offset = reserveFromBuffer(buffer, sizeof(JEntry) * nElems);
+
+	totallen = 0;
+	for (i = 0; i < nElems; i++)
+	{
+		JsonbValue *elem = &val->val.array.elems[i];
+		int			len;
+		JEntry		meta;
+
+		convertJsonbValue(buffer, &meta, elem, level + 1);
+
+		len = JBE_OFFLENFLD(meta);
+		totallen += len;
+
+		if (totallen > JENTRY_OFFLENMASK)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("total size of jsonb array elements exceeds the maximum of %u bytes",
+							JENTRY_OFFLENMASK)));
+
+		/* Convert each JB_OFFSET_STRIDE'th length to an offset. */
+		if ((i % JB_OFFSET_STRIDE) == 0)
+			meta = (meta & JENTRY_TYPEMASK) | totallen | JENTRY_HAS_OFF;
+
+		copyToBuffer(buffer, jentry_offset, (char *) &meta, sizeof(JEntry));
+		jentry_offset += sizeof(JEntry);
+	}
+
+	/* Total data size is everything we've appended to buffer */
+	totallen = buffer->len - base_offset;
+
+	if (totallen > JENTRY_OFFLENMASK)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("total size of jsonb array elements exceeds the maximum of %u bytes",
+						JENTRY_OFFLENMASK)));
+
+	*pheader = JENTRY_ISCONTAINER | totallen;
+}
+
+static void
+convertJsonbObject(StringInfo buffer, JEntry *pheader, JsonbValue *val, int level)
+{
+	int			base_offset;
+	int			jentry_offset;
+	int			i;
+	int			totallen;
+	uint32		header;
+	int			nPairs = val->val.object.nPairs;
+
+	/* Remember where in the buffer this object starts. */
+	base_offset = buffer->len;
+
+	/* Align to 4-byte boundary (any padding counts as part of my data) */
+	padBufferToInt(buffer);
+
+	header = nPairs | JB_FOBJECT;
+	appendToBuffer(buffer, (char *) &header, sizeof(uint32));
+
+	/* Reserve space for the JEntries of the keys and values. */
+	jentry_offset = reserveFromBuffer(buffer, sizeof(JEntry) * nPairs * 2);
+
+	/*
+	 * Iterate over the keys, then over the values, since that is the ordering
+	 * we want in the on-disk representation.
+	 */
+	totallen = 0;
+	for (i = 0; i < nPairs; i++)
+	{
+		JsonbPair  *pair = &val->val.object.pairs[i];
+		int			len;
+		JEntry		meta;
+
+		convertJsonbScalar(buffer, &meta, &pair->key);
+
+		len = JBE_OFFLENFLD(meta);
+		totallen += len;
+
+		if (totallen > JENTRY_OFFLENMASK)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("total size of jsonb object elements exceeds the maximum of %u bytes",
+							JENTRY_OFFLENMASK)));
+
+		if ((i % JB_OFFSET_STRIDE) == 0)
+			meta = (meta & JENTRY_TYPEMASK) | totallen | JENTRY_HAS_OFF;
+
+		copyToBuffer(buffer, jentry_offset, (char *) &meta, sizeof(JEntry));
+		jentry_offset += sizeof(JEntry);
+	}
+	for (i = 0; i < nPairs; i++)
+	{
+		JsonbPair  *pair = &val->val.object.pairs[i];
+		int			len;
+		JEntry		meta;
+
+		convertJsonbValue(buffer, &meta, &pair->value, level + 1);
+
+		len = JBE_OFFLENFLD(meta);
+		totallen += len;
+
+		if (totallen > JENTRY_OFFLENMASK)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("total size of jsonb object elements exceeds the maximum of %u bytes",
+							JENTRY_OFFLENMASK)));
+
+		if (((i + nPairs) % JB_OFFSET_STRIDE) == 0)
+			meta = (meta & JENTRY_TYPEMASK) | totallen | JENTRY_HAS_OFF;
+
+		copyToBuffer(buffer, jentry_offset, (char *) &meta, sizeof(JEntry));
+		jentry_offset += sizeof(JEntry);
+	}
+
+	/* Total data size is everything we've appended to buffer */
+	totallen = buffer->len - base_offset;
+
+	if (totallen > JENTRY_OFFLENMASK)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("total size of jsonb object elements exceeds the maximum of %u bytes",
+						JENTRY_OFFLENMASK)));
+
+	*pheader = JENTRY_ISCONTAINER | totallen;
+}
+
+static void
+convertJsonbScalar(StringInfo buffer, JEntry *jentry, JsonbValue *scalarVal)
+{
+	int			numlen;
+	short		padlen;
+
+	switch (scalarVal->type)
+	{
+		case jbvNull:
+			*jentry = JENTRY_ISNULL;
+			break;
+
+		case jbvString:
+			appendToBuffer(buffer, scalarVal->val.string.val, scalarVal->val.string.len);
+
+			*jentry = scalarVal->val.string.len;
+			break;
+
+		case jbvNumeric:
+			numlen = VARSIZE_ANY(scalarVal->val.numeric);
+			padlen = padBufferToInt(buffer);
+
+			appendToBuffer(buffer, (char *) scalarVal->val.numeric, numlen);
+
+			*jentry = JENTRY_ISNUMERIC | (padlen + numlen);
+			break;
+
+		case jbvBool:
+			*jentry = (scalarVal->val.boolean) ?
+				JENTRY_ISBOOL_TRUE : JENTRY_ISBOOL_FALSE;
+			break;
+
+		default:
+			elog(ERROR, "invalid jsonb scalar type");
+	}
+}
+
+/*
+ * Copy an already serialized container. Containers are always stored
+ * int-aligned, and every nested container or numeric inside of it is aligned
+ * relative to the same boundary, so after padding the buffer the raw bytes
+ * remain valid at the new position.
+ */
+static void
+convertJsonbBinary(StringInfo buffer, JEntry *jentry, JsonbValue *binaryVal)
+{
+	short		padlen;
+
+	padlen = padBufferToInt(buffer);
+
+	appendToBuffer(buffer, (char *) binaryVal->val.binary.data,
+				   binaryVal->val.binary.len);
+
+	*jentry = JENTRY_ISCONTAINER | (padlen + binaryVal->val.binary.len);
+}
+
+
+/*
+ * initJsonbWriter:
+ * Prepare the writer with the buffer for the whole result. Then the result
+ * is written by pushJsonbWriter token by token, as pushJsonbValue does, but
+ * without the tree of JsonbValues: every value goes to its final place at
+ * once, and only the headers and JEntries of a container are filled, when
+ * it's closed. Keys of an object must come sorted and unique, as they are in
+ * any existing container. The result is returned by finishJsonbWriter.
+ */
+void
+initJsonbWriter(JsonbWriter *w, int estimated_len)
+{
+	initStringInfo(&w->buffer);
+
+	if (estimated_len > w->buffer.maxlen)
+		enlargeStringInfo(&w->buffer, estimated_len);
+
+	/* Make room for the varlena header */
+	reserveFromBuffer(&w->buffer, VARHDRSZ);
+
+	w->nlevels = 0;
+	w->size = 8;
+	w->levels = palloc(sizeof(JsonbWriterLevel) * w->size);
+}
+
+
+/*
+ * pushJsonbWriter:
+ * Write the token with the value, tokens are the same as of pushJsonbValue.
+ * A value may be a scalar, jbvBinary (its container is copied as is) or an
+ * in-memory array or object. For the beginning of a container the value is
+ * optional, it's the one returned by JsonbIteratorNext, which tells the
+ * number of values in advance, so their JEntries are reserved right away.
+ * A value outside of any container becomes the whole result.
+ */
+void
+pushJsonbWriter(JsonbWriter *w, int r, JsonbValue *v)
+{
+	switch (r)
+	{
+		case WJB_BEGIN_ARRAY:
+			beginWriterContainer(w, false, v ? v->val.array.nElems : 0,
+								 v ? v->val.array.rawScalar : false);
+			break;
+		case WJB_BEGIN_OBJECT:
+			beginWriterContainer(w, true, v ? v->val.object.nPairs : 0, false);
+			break;
+		case WJB_KEY:
+			addWriterKey(w, v);
+			break;
+		case WJB_VALUE:
+		case WJB_ELEM:
+			addWriterValue(w, v);
+			break;
+		case WJB_END_ARRAY:
+		case WJB_END_OBJECT:
+			endWriterContainer(w);
+			break;
+		default:
+			elog(ERROR, "unknown jsonb token %d", r);
+	}
+}
+
+
+/*
+ * expectJsonbWriterValues:
+ * Reserve JEntries for the number of values in the current container, if it
+ * differs from the one given at its beginning. Must be called before any
+ * value of the container is written.
+ */
+void
+expectJsonbWriterValues(JsonbWriter *w, int nvalues)
+{
+	JsonbWriterLevel *level = &w->levels[w->nlevels - 1];
+
+	Assert(level->nvalues == 0 && level->nkeys == 0);
+
+	w->buffer.len = level->header + sizeof(uint32);
+	reserveFromBuffer(&w->buffer,
+					  sizeof(JEntry) * nvalues * (level->isObject ? 2 : 1) +
+					  level->keysreserved);
+	level->nreserved = nvalues;
+}
+
+
+/*
+ * expectJsonbWriterKeys:
+ * Reserve the room for keys of the current object, if the total length of
+ * its keys is known in advance (e.g. from the container it's copied from).
+ * Then the values are written right at their final place, and nothing is
+ * moved, when the object is closed. If the length turns out to be different,
+ * the values are moved as without the reservation. Must be called before any
+ * key of the object is written.
+ */
+void
+expectJsonbWriterKeys(JsonbWriter *w, int keyslen)
+{
+	JsonbWriterLevel *level = &w->levels[w->nlevels - 1];
+
+	Assert(level->isObject && level->nvalues == 0 && level->nkeys == 0);
+
+	w->buffer.len = level->header + sizeof(uint32) +
+		sizeof(JEntry) * level->nreserved * 2;
+	reserveFromBuffer(&w->buffer, keyslen);
+	level->keysreserved = keyslen;
+}
+
+
+/*
+ * finishJsonbWriter:
+ * Return the written jsonb, all containers must be closed.
+ */
+Jsonb *
+finishJsonbWriter(JsonbWriter *w)
+{
+	Jsonb	   *res;
+
+	Assert(w->nlevels == 0);
+
+	pfree(w->levels);
+
+	res = (Jsonb *) w->buffer.data;
+	SET_VARSIZE(res, w->buffer.len);
+
+	return res;
+}
+
+
+static void
+beginWriterContainer(JsonbWriter *w, bool isObject, int nvalues, bool rawScalar)
+{
+	JsonbWriterLevel *level;
+
+	check_stack_depth();
+
+	if (w->nlevels == w->size)
+	{
+		w->size *= 2;
+		w->levels = repalloc(w->levels, sizeof(JsonbWriterLevel) * w->size);
+	}
+
+	level = &w->levels[w->nlevels++];
+
+	/* the padding belongs to the container, as in convertJsonbArray */
+	level->start = w->buffer.len;
+	padBufferToInt(&w->buffer);
+	level->header = reserveFromBuffer(&w->buffer, sizeof(uint32));
+	level->nreserved = nvalues;
+	level->keysreserved = 0;
+	reserveFromBuffer(&w->buffer, sizeof(JEntry) * nvalues * (isObject ? 2 : 1));
+
+	level->isObject = isObject;
+	level->rawScalar = rawScalar;
+	level->nvalues = 0;
+	level->nkeys = 0;
+	level->size = Max(nvalues, 4);
+	level->entries = palloc(sizeof(JEntry) * level->size);
+
+	if (isObject)
+	{
+		level->keylens = palloc(sizeof(int) * level->size);
+		initStringInfo(&level->keys);
+	}
+}
+
+
+/*
+ * Close the current container. Its values were written right after the
+ * reserved JEntries and keys, now JEntries of the actual number of values and
+ * the keys of an object are placed before them. If the reservation was not
+ * exact, the values are shifted as a whole, and since the keys have an
+ * arbitrary length, the first numeric or container value may get a different
+ * padding. Everything after it keeps its alignment, as in appendElements.
+ * A shift moves the whole subtree of the container, so a path of unreserved
+ * objects costs its depth times the size of the document.
+ */
+static void
+endWriterContainer(JsonbWriter *w)
+{
+	JsonbWriterLevel *level = &w->levels[--w->nlevels];
+	StringInfo	buffer = &w->buffer;
+	int			width = level->isObject ? 2 : 1;
+	int			nentries = level->nvalues * width;
+	int			jentries = level->header + sizeof(uint32);
+	int			oldstart = jentries + sizeof(JEntry) * level->nreserved * width +
+		level->keysreserved;
+	int			keysstart = jentries + sizeof(JEntry) * nentries;
+	int			keyslen = level->isObject ? level->keys.len : 0;
+	int			newstart = keysstart + keyslen;
+	int			headlen = 0;
+	int			oldpad = 0;
+	int			newpad = 0;
+	int			restlen;
+	int			newend;
+	int			first;
+	uint32		totallen;
+	uint32		header;
+	int			i;
+
+	Assert(!level->isObject || level->nkeys == level->nvalues);
+
+	/* values before the first aligned one may be shifted by any distance */
+	for (first = 0; first < level->nvalues; first++)
+	{
+		JEntry		entry = level->entries[first];
+
+		if (JBE_ISNUMERIC(entry) || JBE_ISCONTAINER(entry))
+		{
+			oldpad = INTALIGN(oldstart + headlen) - (oldstart + headlen);
+			newpad = INTALIGN(newstart + headlen) - (newstart + headlen);
+			level->entries[first] = (entry & JENTRY_TYPEMASK) |
+				(JBE_OFFLENFLD(entry) - oldpad + newpad);
+			break;
+		}
+
+		headlen += JBE_OFFLENFLD(entry);
+	}
+
+	restlen = buffer->len - (oldstart + headlen + oldpad);
+	newend = newstart + headlen + newpad + restlen;
+
+	if (newend > buffer->len)
+		enlargeStringInfo(buffer, newend - buffer->len);
+
+	/* both parts are shifted in the same direction */
+	if (newstart > oldstart)
+	{
+		memmove(buffer->data + newstart + headlen + newpad,
+				buffer->data + oldstart + headlen + oldpad, restlen);
+		memmove(buffer->data + newstart, buffer->data + oldstart, headlen);
+	}
+	else if (newstart < oldstart)
+	{
+		memmove(buffer->data + newstart, buffer->data + oldstart, headlen);
+		memmove(buffer->data + newstart + headlen + newpad,
+				buffer->data + oldstart + headlen + oldpad, restlen);
+	}
+
+	memset(buffer->data + newstart + headlen, 0, newpad);
+	memcpy(buffer->data + keysstart, level->keys.data, keyslen);
+	buffer->len = newend;
+	buffer->data[buffer->len] = '\0';
+
+	/* keys go first, then values, convert each stride'th length to offset */
+	totallen = 0;
+	for (i = 0; i < nentries; i++)
+	{
+		JEntry		entry;
+
+		if (i < level->nkeys)
+			entry = level->keylens[i];
+		else
+			entry = level->entries[i - level->nkeys];
+
+		totallen += JBE_OFFLENFLD(entry);
+
+		if (totallen > JENTRY_OFFLENMASK)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("total size of jsonb %s elements exceeds the maximum of %u bytes",
+							level->isObject ? "object" : "array",
+							JENTRY_OFFLENMASK)));
+
+		if ((i % JB_OFFSET_STRIDE) == 0)
+			entry = (entry & JENTRY_TYPEMASK) | totallen | JENTRY_HAS_OFF;
+
+		copyToBuffer(buffer, jentries + i * sizeof(JEntry), (char *) &entry,
+					 sizeof(JEntry));
+	}
+
+	header = level->nvalues | (level->isObject ? JB_FOBJECT : JB_FARRAY);
+	if (level->rawScalar)
+	{
+		Assert(level->nvalues == 1 && w->nlevels == 0);
+		header |= JB_FSCALAR;
+	}
+	copyToBuffer(buffer, level->header, (char *) &header, sizeof(uint32));
+
+	totallen = buffer->len - level->start;
+
+	if (totallen > JENTRY_OFFLENMASK)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("total size of jsonb %s elements exceeds the maximum of %u bytes",
+						level->isObject ? "object" : "array",
+						JENTRY_OFFLENMASK)));
+
+	pfree(level->entries);
+	if (level->isObject)
+	{
+		pfree(level->keylens);
+		pfree(level->keys.data);
+	}
+
+	if (w->nlevels > 0)
+		addWriterEntry(&w->levels[w->nlevels - 1], JENTRY_ISCONTAINER | totallen);
+}
+
+
+static void
+addWriterKey(JsonbWriter *w, JsonbValue *key)
+{
+	JsonbWriterLevel *level = &w->levels[w->nlevels - 1];
+
+	Assert(level->isObject && level->nkeys == level->nvalues);
+	Assert(key->type == jbvString);
+
+	if (level->nkeys == level->size)
+	{
+		level->size *= 2;
+		level->entries = repalloc(level->entries, sizeof(JEntry) * level->size);
+		level->keylens = repalloc(level->keylens, sizeof(int) * level->size);
+	}
+
+	appendBinaryStringInfo(&level->keys, key->val.string.val, key->val.string.len);
+	level->keylens[level->nkeys++] = key->val.string.len;
+}
+
+
+static void
+addWriterValue(JsonbWriter *w, JsonbValue *val)
+{
+	JEntry		entry;
+
+	if (w->nlevels == 0)
+	{
+		/* Scalar value should be wrapped into the raw scalar array */
+		if (IsAJsonbScalar(val))
+		{
+			beginWriterContainer(w, false, 1, true);
+			addWriterValue(w, val);
+			endWriterContainer(w);
+		}
+		else
+			convertJsonbValue(&w->buffer, &entry, val, 0);
+
+		return;
+	}
+
+	convertJsonbValue(&w->buffer, &entry, val, w->nlevels);
+	addWriterEntry(&w->levels[w->nlevels - 1], entry);
+}
+
+
+static void
+addWriterEntry(JsonbWriterLevel *level, JEntry entry)
+{
+	Assert(!level->isObject || level->nkeys == level->nvalues + 1);
+
+	if (level->nvalues == level->size)
+	{
+		level->size *= 2;
+		level->entries = repalloc(level->entries, sizeof(JEntry) * level->size);
+		if (level->isObject)
+			level->keylens = repalloc(level->keylens, sizeof(int) * level->size);
+	}
+
+	level->entries[level->nvalues++] = entry;
+}
+
+
+/*
+ * Reserve 'len' bytes, at the end of the buffer, enlarging it if necessary.
+ * Returns the offset to the reserved area. The caller is expected to fill
+ * the reserved area later with copyToBuffer().
+ */
+static int
+reserveFromBuffer(StringInfo buffer, int len)
+{
+	int			offset;
+
+	enlargeStringInfo(buffer, len);
+
+	offset = buffer->len;
+	buffer->len += len;
+
+	/*
+	 * Keep a trailing null in place, even though it's not useful for us; it
+	 * seems best to preserve the invariants of StringInfos.
+	 */
+	buffer->data[buffer->len] = '\0';
+
+	return offset;
+}
+
+/*
+ * Copy 'len' bytes to a previously reserved area in buffer.
+ */
+static void
+copyToBuffer(StringInfo buffer, int offset, const char *data, int len)
+{
+	memcpy(buffer->data + offset, data, len);
+}
+
+/*
+ * A shorthand for reserveFromBuffer + copyToBuffer.
+ */
+static void
+appendToBuffer(StringInfo buffer, const char *data, int len)
+{
+	int			offset;
+
+	offset = reserveFromBuffer(buffer, len);
+	copyToBuffer(buffer, offset, data, len);
+}
+
+/*
+ * Append padding, so that the length of the StringInfo is int-aligned.
+ * Returns the number of padding bytes appended.
+ */
+static short
+padBufferToInt(StringInfo buffer)
+{
+	int			padlen,
+				p,
+				offset;
+
+	padlen = INTALIGN(buffer->len) - buffer->len;
+
+	offset = reserveFromBuffer(buffer, padlen);
+
+	/* padlen must be small, so this is probably faster than a memset */
+	for (p = 0; p < padlen; p++)
+		buffer->data[offset + p] = '\0';
+
+	return padlen;
+}
@@ -0,0 +1,504 @@
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "utils/builtins.h"
+#include "utils/jsonb.h"
+
+#include "jsonbx.h"
+
+JSONBX_FUNCTION(jsonb_diff, JSONBX_STATS_DIFF)
+JSONBX_FUNCTION(jsonb_patch, JSONBX_STATS_PATCH)
+
+/*
+ * JsonbDiffState:
+ * The patch being written by jsonb_diff, and JSON Pointer of the values
+ * being compared.
+ */
+typedef struct JsonbDiffState
+{
+	JsonbWriter		w;
+	StringInfoData	path;
+} JsonbDiffState;
+
+static void diffJsonbValues(JsonbDiffState *state, JsonbValue *a, JsonbValue *b);
+static void diffJsonbObjects(JsonbDiffState *state, JsonbContainer *a,
+							 JsonbContainer *b);
+static void diffJsonbArrays(JsonbDiffState *state, JsonbContainer *a,
+							JsonbContainer *b);
+static void addDiffOp(JsonbDiffState *state, char *op, JsonbValue *value);
+static void appendPointerKey(StringInfo path, char *key, int keylen);
+static void pushJsonbWriterString(JsonbWriter *w, int r, char *str, int len);
+static JsonbValue * getPatchMember(JsonbContainer *op, char *name, int opno);
+static int parseJsonPointer(JsonbValue *pointer, Datum **elems);
+
+
+/*
+ * jsonb_diff:
+ * Return the patch, which turns the old jsonb into the new one, in the form
+ * of JSON Patch (RFC 6902) with "add", "remove" and "replace" operations.
+ * Both documents are walked in lockstep: keys of objects are merged as in
+ * concatJsonbObjects, since they are sorted in both, and arrays are compared
+ * element by element. Equal containers are skipped without decoding, if they
+ * have the same binary form. The patch can be applied by jsonb_patch, or by
+ * any other implementation of RFC 6902: array indexes of the operations are
+ * the same, whether they refer to the original document or to the result of
+ * the previous operations.
+ */
+static Datum
+jsonb_diff_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb			*jb1 = PG_GETARG_JSONB(0);
+	Jsonb			*jb2 = PG_GETARG_JSONB(1);
+	JsonbDiffState	state;
+	JsonbValue		v1, v2;
+
+	initJsonbWriter(&state.w, 0);
+	initStringInfo(&state.path);
+
+	pushJsonbWriter(&state.w, WJB_BEGIN_ARRAY, NULL);
+
+	JsonbToJsonbValue(jb1, &v1);
+	JsonbToJsonbValue(jb2, &v2);
+	diffJsonbValues(&state, &v1, &v2);
+
+	pushJsonbWriter(&state.w, WJB_END_ARRAY, NULL);
+
+	PG_RETURN_JSONB(finishJsonbWriter(&state.w));
+}
+
+
+/*
+ * diffJsonbValues:
+ * Write operations for the values at the current path. Two objects or two
+ * arrays are compared recursively, any other value is replaced as a whole.
+ */
+static void
+diffJsonbValues(JsonbDiffState *state, JsonbValue *a, JsonbValue *b)
+{
+	check_stack_depth();
+
+	if (a->type == jbvBinary && b->type == jbvBinary)
+	{
+		JsonbContainer	*ca = a->val.binary.data;
+		JsonbContainer	*cb = b->val.binary.data;
+
+		if (a->val.binary.len == b->val.binary.len &&
+			memcmp(ca, cb, a->val.binary.len) == 0)
+			return;
+
+		if ((ca->header & JB_FOBJECT) && (cb->header & JB_FOBJECT))
+		{
+			diffJsonbObjects(state, ca, cb);
+			return;
+		}
+
+		if ((ca->header & JB_FARRAY) && (cb->header & JB_FARRAY))
+		{
+			diffJsonbArrays(state, ca, cb);
+			return;
+		}
+	}
+	else if (equalJsonbValues(a, b))
+		return;
+
+	addDiffOp(state, "replace", b);
+}
+
+
+/*
+ * Merge sorted keys of two objects: a key of the old object only is removed,
+ * a key of the new object only is added.
+ */
+static void
+diffJsonbObjects(JsonbDiffState *state, JsonbContainer *a, JsonbContainer *b)
+{
+	JsonbIterator	*it1 = JsonbIteratorInit(a);
+	JsonbIterator	*it2 = JsonbIteratorInit(b);
+	JsonbValue		k1, k2, v1, v2;
+	uint32			r1, r2;
+	int				pathlen = state->path.len;
+
+	(void) JsonbIteratorNext(&it1, &k1, false);
+	(void) JsonbIteratorNext(&it2, &k2, false);
+
+	r1 = JsonbIteratorNext(&it1, &k1, true);
+	r2 = JsonbIteratorNext(&it2, &k2, true);
+
+	while (r1 == WJB_KEY || r2 == WJB_KEY)
+	{
+		int		cmp;
+
+		if (r1 != WJB_KEY)
+			cmp = 1;
+		else if (r2 != WJB_KEY)
+			cmp = -1;
+		else
+			cmp = compareJsonbKeys(k1.val.string.val, k1.val.string.len,
+								   k2.val.string.val, k2.val.string.len);
+
+		if (cmp <= 0)
+		{
+			appendPointerKey(&state->path, k1.val.string.val, k1.val.string.len);
+			(void) JsonbIteratorNext(&it1, &v1, true);
+		}
+		else
+			appendPointerKey(&state->path, k2.val.string.val, k2.val.string.len);
+
+		if (cmp >= 0)
+			(void) JsonbIteratorNext(&it2, &v2, true);
+
+		if (cmp < 0)
+			addDiffOp(state, "remove", NULL);
+		else if (cmp > 0)
+			addDiffOp(state, "add", &v2);
+		else
+			diffJsonbValues(state, &v1, &v2);
+
+		state->path.len = pathlen;
+		state->path.data[pathlen] = '\0';
+
+		if (cmp <= 0)
+			r1 = JsonbIteratorNext(&it1, &k1, true);
+		if (cmp >= 0)
+			r2 = JsonbIteratorNext(&it2, &k2, true);
+	}
+}
+
+
+/*
+ * Compare elements with the same indexes, extra elements of the new array
+ * are added, extra elements of the old one are removed from the end. If some
+ * elements are removed from the middle of the array, and the rest is equal,
+ * only these elements are removed.
+ */
+static void
+diffJsonbArrays(JsonbDiffState *state, JsonbContainer *a, JsonbContainer *b)
+{
+	int				n1 = a->header & JB_CMASK;
+	int				n2 = b->header & JB_CMASK;
+	int				pathlen = state->path.len;
+	JsonbValue		v1, v2;
+	int				prefix = 0;
+	int				i;
+
+	/* equal elements at the beginning */
+	for (; prefix < n1 && prefix < n2; prefix++)
+	{
+		getJsonbContainerValue(a, prefix, &v1);
+		getJsonbContainerValue(b, prefix, &v2);
+
+		if (!equalJsonbValues(&v1, &v2))
+			break;
+	}
+
+	if (n2 < n1)
+	{
+		int		suffix = 0;
+
+		for (; prefix + suffix < n2; suffix++)
+		{
+			getJsonbContainerValue(a, n1 - 1 - suffix, &v1);
+			getJsonbContainerValue(b, n2 - 1 - suffix, &v2);
+
+			if (!equalJsonbValues(&v1, &v2))
+				break;
+		}
+
+		/* the rest is at the end, it's removed below */
+		if (prefix + suffix == n2)
+		{
+			n1 -= suffix;
+			n2 = prefix;
+		}
+	}
+
+	for (i = prefix; i < n1 && i < n2; i++)
+	{
+		getJsonbContainerValue(a, i, &v1);
+		getJsonbContainerValue(b, i, &v2);
+
+		appendStringInfo(&state->path, "/%d", i);
+		diffJsonbValues(state, &v1, &v2);
+		state->path.len = pathlen;
+		state->path.data[pathlen] = '\0';
+	}
+
+	for (; i < n2; i++)
+	{
+		getJsonbContainerValue(b, i, &v2);
+
+		appendStringInfo(&state->path, "/%d", i);
+		addDiffOp(state, "add", &v2);
+		state->path.len = pathlen;
+		state->path.data[pathlen] = '\0';
+	}
+
+	/* the last element goes first, so indexes of the rest don't change */
+	for (i = n1 - 1; i >= n2; i--)
+	{
+		appendStringInfo(&state->path, "/%d", i);
+		addDiffOp(state, "remove", NULL);
+		state->path.len = pathlen;
+		state->path.data[pathlen] = '\0';
+	}
+}
+
+
+/*
+ * Write the operation for the current path, with the value for "add" and
+ * "replace".
+ */
+static void
+addDiffOp(JsonbDiffState *state, char *op, JsonbValue *value)
+{
+	JsonbValue	v;
+
+	v.type = jbvObject;
+	v.val.object.nPairs = (value != NULL) ? 3 : 2;
+	pushJsonbWriter(&state->w, WJB_BEGIN_OBJECT, &v);
+
+	pushJsonbWriterString(&state->w, WJB_KEY, "op", 2);
+	pushJsonbWriterString(&state->w, WJB_VALUE, op, strlen(op));
+	pushJsonbWriterString(&state->w, WJB_KEY, "path", 4);
+	pushJsonbWriterString(&state->w, WJB_VALUE, state->path.data, state->path.len);
+
+	if (value != NULL)
+	{
+		pushJsonbWriterString(&state->w, WJB_KEY, "value", 5);
+		pushJsonbWriter(&state->w, WJB_VALUE, value);
+	}
+
+	pushJsonbWriter(&state->w, WJB_END_OBJECT, NULL);
+}
+
+
+/*
+ * Append the object key to JSON Pointer, "~" and "/" are escaped as "~0"
+ * and "~1" (RFC 6901).
+ */
+static void
+appendPointerKey(StringInfo path, char *key, int keylen)
+{
+	int		i;
+
+	appendStringInfoChar(path, '/');
+
+	for (i = 0; i < keylen; i++)
+	{
+		if (key[i] == '~')
+			appendBinaryStringInfo(path, "~0", 2);
+		else if (key[i] == '/')
+			appendBinaryStringInfo(path, "~1", 2);
+		else
+			appendStringInfoChar(path, key[i]);
+	}
+}
+
+
+static void
+pushJsonbWriterString(JsonbWriter *w, int r, char *str, int len)
+{
+	JsonbValue	v;
+
+	v.type = jbvString;
+	v.val.string.val = str;
+	v.val.string.len = len;
+
+	pushJsonbWriter(w, r, &v);
+}
+
+
+/*
+ * jsonb_patch:
+ * Apply the JSON Patch (RFC 6902), e.g. produced by jsonb_diff. Operations
+ * "add", "remove" and "replace" are supported, paths are JSON Pointers.
+ * All paths are merged into a trie, and jsonb is traversed once by modifyPath,
+ * as in jsonb_modify, so array indexes refer to the elements of the original
+ * jsonb. Missing values of "remove" and "replace" are ignored.
+ */
+static Datum
+jsonb_patch_internal(PG_FUNCTION_ARGS)
+{
+	Jsonb			*in = PG_GETARG_JSONB_INPUT(0);
+	Jsonb			*patch = PG_GETARG_JSONB(1);
+	Jsonb			*doc = in;
+	PathTrieNode	*root;
+	JsonbIterator	*it;
+	JsonbValue		v;
+	JsonbWriter		w;
+	uint32			r;
+	int				opno = 0;
+
+	if (!JB_ROOT_IS_ARRAY(patch) || JB_ROOT_IS_SCALAR(patch))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("patch must be an array of operations")));
+
+	root = makePathTrieNode((Datum) 0);
+
+	it = JsonbIteratorInit(&patch->root);
+
+	while ((r = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		JsonbValue	*opname;
+		JsonbValue	*value = NULL;
+		Datum		*path;
+		int			path_len;
+		int			op;
+
+		if (r != WJB_ELEM)
+			continue;
+
+		opno++;
+
+		if (v.type != jbvBinary || !(v.val.binary.data->header & JB_FOBJECT))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("patch operation %d must be an object", opno)));
+
+		opname = getPatchMember(v.val.binary.data, "op", opno);
+		path_len = parseJsonPointer(getPatchMember(v.val.binary.data, "path", opno),
+									&path);
+
+		if (opname->val.string.len == 3 &&
+			memcmp(opname->val.string.val, "add", 3) == 0)
+			op = JSONB_MODIFY_ADD;
+		else if (opname->val.string.len == 6 &&
+				 memcmp(opname->val.string.val, "remove", 6) == 0)
+			op = JSONB_MODIFY_DELETE;
+		else if (opname->val.string.len == 7 &&
+				 memcmp(opname->val.string.val, "replace", 7) == 0)
+			op = JSONB_MODIFY_REPLACE;
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("unknown operation \"%s\"",
+							pnstrdup(opname->val.string.val, opname->val.string.len)),
+					 errhint("Valid operations are \"add\", \"remove\" and \"replace\".")));
+
+		if (op == JSONB_MODIFY_DELETE && path_len == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("cannot remove the whole document")));
+
+		if (op != JSONB_MODIFY_DELETE)
+		{
+			JsonbValue	key;
+
+			key.type = jbvString;
+			key.val.string.val = "value";
+			key.val.string.len = 5;
+
+			value = findJsonbValueFromContainer(v.val.binary.data, JB_FOBJECT, &key);
+			if (value == NULL)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("patch operation %d must have \"value\"", opno)));
+		}
+
+		addPathToTrie(root, path, path_len, op,
+					  value ? JsonbValueToJsonbWorker(value, 0) : NULL);
+	}
+
+	/* the whole document is replaced, the rest is applied to the new one */
+	if (root->op != JSONB_MODIFY_NONE)
+		doc = root->value;
+
+	if (root->nchildren == 0)
+		PG_RETURN_JSONB(doc);
+
+	if (JB_ROOT_IS_SCALAR(doc))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot set path in scalar")));
+
+	it = JsonbIteratorInit(&doc->root);
+
+	initJsonbWriter(&w, VARSIZE(doc) + VARSIZE(patch));
+	modifyPath(&it, root, &w, 0);
+
+	PG_RETURN_JSONB(finishJsonbWriter(&w));
+}
+
+
+/*
+ * Return the string member of the patch operation.
+ */
+static JsonbValue *
+getPatchMember(JsonbContainer *op, char *name, int opno)
+{
+	JsonbValue	key;
+	JsonbValue	*v;
+
+	key.type = jbvString;
+	key.val.string.val = name;
+	key.val.string.len = strlen(name);
+
+	v = findJsonbValueFromContainer(op, JB_FOBJECT, &key);
+
+	if (v == NULL || v->type != jbvString)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("patch operation %d must have \"%s\" string", opno, name)));
+
+	return v;
+}
+
+
+/*
+ * parseJsonPointer:
+ * Split JSON Pointer (RFC 6901) into path elements for addPathToTrie, and
+ * return the number of them. The empty pointer is the whole document.
+ */
+static int
+parseJsonPointer(JsonbValue *pointer, Datum **elems)
+{
+	char		   *str = pointer->val.string.val;
+	int				len = pointer->val.string.len;
+	int				nelems = 0;
+	int				i;
+	StringInfoData	key;
+
+	for (i = 0; i < len; i++)
+	{
+		if (str[i] == '/')
+			nelems++;
+	}
+
+	*elems = palloc(sizeof(Datum) * Max(nelems, 1));
+
+	if (len == 0)
+		return 0;
+
+	if (str[0] != '/')
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid JSON pointer \"%s\"", pnstrdup(str, len)),
+				 errdetail("JSON pointer must be empty or start with \"/\".")));
+
+	initStringInfo(&key);
+	nelems = 0;
+
+	for (i = 1; i <= len; i++)
+	{
+		if (i == len || str[i] == '/')
+		{
+			(*elems)[nelems++] = PointerGetDatum(cstring_to_text_with_len(key.data,
+																		  key.len));
+			resetStringInfo(&key);
+		}
+		else if (str[i] != '~')
+			appendStringInfoChar(&key, str[i]);
+		else if (i + 1 < len && (str[i + 1] == '0' || str[i + 1] == '1'))
+			appendStringInfoChar(&key, str[++i] == '0' ? '~' : '/');
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid JSON pointer \"%s\"", pnstrdup(str, len)),
+					 errdetail("\"~\" must be followed by \"0\" or \"1\".")));
+	}
+
+	pfree(key.data);
+
+	return nelems;
+}
@@ -0,0 +1,149 @@
+#include "postgres.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define USE_SSE2_ESCAPE
+#define USE_AVX2_ESCAPE
+#include <immintrin.h>
+#endif
+
+#include "utils/jsonb.h"
+
+#include "jsonbx.h"
+
+/*
+ * A character must be escaped in json, if it's a quote, a backslash
+ * or a control character.
+ */
+#define NEEDS_ESCAPE(c) \
+	((unsigned char) (c) < ' ' || (c) == '"' || (c) == '\\')
+
+static int findJsonEscapeScalar(const char *str, int len);
+static int findJsonEscapeChoose(const char *str, int len);
+
+#ifdef USE_SSE2_ESCAPE
+static int findJsonEscapeSSE2(const char *str, int len);
+#endif
+#ifdef USE_AVX2_ESCAPE
+static int findJsonEscapeAVX2(const char *str, int len);
+#endif
+
+/*
+ * The kernel is chosen at the first call, depending on what the CPU supports.
+ */
+static int (*findJsonEscapeImpl) (const char *str, int len) = findJsonEscapeChoose;
+
+
+/*
+ * findJsonEscape:
+ * Offset of the first character of the string, which must be escaped in json,
+ * or len if there is no such character. The string doesn't need to be
+ * NUL-terminated. Long strings are scanned by 16 or 32 bytes at a time.
+ */
+int
+findJsonEscape(const char *str, int len)
+{
+	return findJsonEscapeImpl(str, len);
+}
+
+
+static int
+findJsonEscapeChoose(const char *str, int len)
+{
+	findJsonEscapeImpl = findJsonEscapeScalar;
+
+#ifdef USE_SSE2_ESCAPE
+	/* SSE2 is a part of x86-64 */
+	findJsonEscapeImpl = findJsonEscapeSSE2;
+#endif
+#ifdef USE_AVX2_ESCAPE
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		findJsonEscapeImpl = findJsonEscapeAVX2;
+#endif
+
+	return findJsonEscapeImpl(str, len);
+}
+
+
+static int
+findJsonEscapeScalar(const char *str, int len)
+{
+	int			i;
+
+	for (i = 0; i < len; i++)
+	{
+		if (NEEDS_ESCAPE(str[i]))
+			break;
+	}
+
+	return i;
+}
+
+
+#ifdef USE_SSE2_ESCAPE
+/*
+ * Every 16 bytes are compared with a quote and a backslash, and control
+ * characters are found as bytes, which are not changed by the unsigned
+ * minimum with 0x1F.
+ */
+static int
+findJsonEscapeSSE2(const char *str, int len)
+{
+	const __m128i	quote = _mm_set1_epi8('"');
+	const __m128i	backslash = _mm_set1_epi8('\\');
+	const __m128i	control = _mm_set1_epi8(0x1F);
+	int				i = 0;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i		chunk = _mm_loadu_si128((const __m128i *) (str + i));
+		__m128i		found;
+		int			mask;
+
+		found = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+							 _mm_cmpeq_epi8(chunk, backslash));
+		found = _mm_or_si128(found,
+							 _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+
+		mask = _mm_movemask_epi8(found);
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + findJsonEscapeScalar(str + i, len - i);
+}
+#endif
+
+
+#ifdef USE_AVX2_ESCAPE
+/*
+ * The same as findJsonEscapeSSE2, but for 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static int
+findJsonEscapeAVX2(const char *str, int len)
+{
+	const __m256i	quote = _mm256_set1_epi8('"');
+	const __m256i	backslash = _mm256_set1_epi8('\\');
+	const __m256i	control = _mm256_set1_epi8(0x1F);
+	int				i = 0;
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i		chunk = _mm256_loadu_si256((const __m256i *) (str + i));
+		__m256i		found;
+		uint32		mask;
+
+		found = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+								_mm256_cmpeq_epi8(chunk, backslash));
+		found = _mm256_or_si256(found,
+								_mm256_cmpeq_epi8(_mm256_min_epu8(chunk, control), chunk));
+
+		mask = (uint32) _mm256_movemask_epi8(found);
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + findJsonEscapeSSE2(str + i, len - i);
+}
+#endif
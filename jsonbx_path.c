@@ -0,0 +1,224 @@
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "lib/stringinfo.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/jsonb.h"
+#include "utils/lsyscache.h"
+
+#include "jsonbx.h"
+
+PG_FUNCTION_INFO_V1(jsonbx_path_in);
+Datum jsonbx_path_in(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(jsonbx_path_out);
+Datum jsonbx_path_out(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(jsonbx_path_recv);
+Datum jsonbx_path_recv(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(jsonbx_path_send);
+Datum jsonbx_path_send(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(jsonbx_path_from_text_array);
+Datum jsonbx_path_from_text_array(PG_FUNCTION_ARGS);
+
+static JsonbxPath * textArrayToJsonbxPath(ArrayType *array);
+static ArrayType * jsonbxPathToTextArray(JsonbxPath *path);
+
+
+/*
+ * jsonbx_path_in:
+ * Input of jsonbx_path. The syntax is the same as for a one-dimensional
+ * text array, and NULL elements are not allowed.
+ */
+Datum
+jsonbx_path_in(PG_FUNCTION_ARGS)
+{
+	char	   *str = PG_GETARG_CSTRING(0);
+	ArrayType  *array;
+	Oid			typinput;
+	Oid			typioparam;
+
+	getTypeInputInfo(TEXTARRAYOID, &typinput, &typioparam);
+	array = DatumGetArrayTypeP(OidInputFunctionCall(typinput, str, typioparam, -1));
+
+	PG_RETURN_JSONBX_PATH(textArrayToJsonbxPath(array));
+}
+
+
+/*
+ * jsonbx_path_out:
+ * Output of jsonbx_path in the form of a text array.
+ */
+Datum
+jsonbx_path_out(PG_FUNCTION_ARGS)
+{
+	JsonbxPath *path = PG_GETARG_JSONBX_PATH(0);
+	Oid			typoutput;
+	bool		typisvarlena;
+
+	getTypeOutputInfo(TEXTARRAYOID, &typoutput, &typisvarlena);
+	PG_RETURN_CSTRING(OidOutputFunctionCall(typoutput,
+						PointerGetDatum(jsonbxPathToTextArray(path))));
+}
+
+
+/*
+ * jsonbx_path_recv:
+ * Binary input of jsonbx_path in the format of a text array, so a client
+ * can bind the path as text[]. It's validated as the text input.
+ */
+Datum
+jsonbx_path_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+	ArrayType  *array;
+	Oid			typreceive;
+	Oid			typioparam;
+
+	getTypeBinaryInputInfo(TEXTARRAYOID, &typreceive, &typioparam);
+	array = DatumGetArrayTypeP(OidReceiveFunctionCall(typreceive, buf,
+													  typioparam, -1));
+
+	PG_RETURN_JSONBX_PATH(textArrayToJsonbxPath(array));
+}
+
+
+/*
+ * jsonbx_path_send:
+ * Binary output of jsonbx_path in the format of a text array.
+ */
+Datum
+jsonbx_path_send(PG_FUNCTION_ARGS)
+{
+	JsonbxPath *path = PG_GETARG_JSONBX_PATH(0);
+	Oid			typsend;
+	bool		typisvarlena;
+
+	getTypeBinaryOutputInfo(TEXTARRAYOID, &typsend, &typisvarlena);
+	PG_RETURN_BYTEA_P(OidSendFunctionCall(typsend,
+						PointerGetDatum(jsonbxPathToTextArray(path))));
+}
+
+
+/*
+ * jsonbx_path_from_text_array:
+ * Cast text[] to jsonbx_path.
+ */
+Datum
+jsonbx_path_from_text_array(PG_FUNCTION_ARGS)
+{
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(0);
+
+	PG_RETURN_JSONBX_PATH(textArrayToJsonbxPath(array));
+}
+
+
+/*
+ * Validate the text array as a path and build jsonbx_path from it.
+ * Integer elements are decoded as array indexes here, so this is the only
+ * place where they are parsed.
+ */
+static JsonbxPath *
+textArrayToJsonbxPath(ArrayType *array)
+{
+	JsonbxPath *path;
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	int			keyslen = 0;
+	char	   *keys;
+	int			i;
+
+	if (ARR_NDIM(array) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("wrong number of array subscripts")));
+
+	deconstruct_array(array, TEXTOID, -1, false, 'i',
+					  &elems, &nulls, &nelems);
+
+	for (i = 0; i < nelems; i++)
+	{
+		if (nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("path element at the position %d is NULL", i + 1)));
+
+		keyslen += VARSIZE_ANY_EXHDR(elems[i]);
+	}
+
+	path = palloc0(JSONBX_PATH_HDRSZ + sizeof(JsonbxPathElem) * nelems + keyslen);
+	SET_VARSIZE(path, JSONBX_PATH_HDRSZ + sizeof(JsonbxPathElem) * nelems + keyslen);
+	path->nelems = nelems;
+
+	keys = JSONBX_PATH_KEYS(path);
+	keyslen = 0;
+
+	for (i = 0; i < nelems; i++)
+	{
+		JsonbxPathElem *elem = &path->elems[i];
+		int				index;
+
+		elem->keyoff = keyslen;
+		elem->keylen = VARSIZE_ANY_EXHDR(elems[i]);
+		memcpy(keys + keyslen, VARDATA_ANY(elems[i]), elem->keylen);
+		keyslen += elem->keylen;
+
+		if (parseArrayIndex(VARDATA_ANY(elems[i]), elem->keylen, &index))
+		{
+			elem->index = index;
+			elem->flags |= JSONBX_PATH_INDEX;
+		}
+	}
+
+	return path;
+}
+
+
+/*
+ * Keys of jsonbx_path as a text array, for the output functions.
+ */
+static ArrayType *
+jsonbxPathToTextArray(JsonbxPath *path)
+{
+	char	   *keys = JSONBX_PATH_KEYS(path);
+	Datum	   *elems;
+	int			i;
+
+	elems = palloc(sizeof(Datum) * Max(path->nelems, 1));
+
+	for (i = 0; i < path->nelems; i++)
+		elems[i] = PointerGetDatum(cstring_to_text_with_len(keys + path->elems[i].keyoff,
+															path->elems[i].keylen));
+
+	return construct_array(elems, path->nelems, TEXTOID, -1, false, 'i');
+}
+
+
+/*
+ * makeJsonbPathFromJsonbx:
+ * Path for setPath, which refers to the jsonbx_path data. Nothing is parsed,
+ * only pointers to the keys are set.
+ */
+JsonbPath *
+makeJsonbPathFromJsonbx(JsonbxPath *jxpath)
+{
+	JsonbPath  *path = allocJsonbPath(jxpath->nelems);
+	char	   *keys = JSONBX_PATH_KEYS(jxpath);
+	int			i;
+
+	for (i = 0; i < jxpath->nelems; i++)
+	{
+		JsonbxPathElem *elem = &jxpath->elems[i];
+
+		path->keys[i] = keys + elem->keyoff;
+		path->keylens[i] = elem->keylen;
+		path->indexes[i] = elem->index;
+		path->isIndex[i] = (elem->flags & JSONBX_PATH_INDEX) != 0;
+	}
+
+	return path;
+}
@@ -0,0 +1,289 @@
+#include "postgres.h"
+
+#include "utils/jsonb.h"
+
+#include "jsonbx.h"
+
+static void appendElements(StringInfo buffer, int data_start, JsonbContainer *array,
+						   int from, int to, JEntry *entries);
+static JEntry appendItem(StringInfo buffer, int data_start, Jsonb *item);
+static int padToInt(StringInfo buffer, int data_start);
+static Jsonb * finishJsonbArray(StringInfo buffer, JEntry *entries, int from,
+								int nelems, uint32 prefixlen);
+
+
+/*
+ * JsonbArraySplice:
+ * Build a new jsonb from the array container, where the elements [from, to)
+ * are replaced with the items. Elements are located by their JEntries, and
+ * the data of unchanged elements is copied in bulk: the prefix doesn't move
+ * at all, and the suffix is shifted as a whole, only the JEntries after the
+ * splice point are recalculated. Items are copied as they are, a scalar item
+ * becomes an element and a container item becomes a nested container.
+ */
+Jsonb *
+JsonbArraySplice(JsonbContainer *array, int from, int to, Jsonb **items, int nitems)
+{
+	uint32			count = array->header & JB_CMASK;
+	int				nelems = count - (to - from) + nitems;
+	char		   *base = (char *) (array->children + count);
+	uint32			prefixlen = getJsonbOffset(array, from);
+	JEntry		   *entries;
+	StringInfoData	buffer;
+	int				data_start;
+	int				estimated_len;
+	int				i;
+
+	Assert(from >= 0 && from <= to && to <= count);
+
+	/*
+	 * The buffer is allocated at its maximal size, so it's never reallocated,
+	 * and JEntries can be filled in place: the only padding, which is not
+	 * copied from the original data, is at most one per item and one for the
+	 * suffix.
+	 */
+	estimated_len = VARHDRSZ + sizeof(uint32) + sizeof(JEntry) * nelems +
+		getJsonbOffset(array, count) - (getJsonbOffset(array, to) - prefixlen) +
+		sizeof(int32);
+	for (i = 0; i < nitems; i++)
+		estimated_len += VARSIZE(items[i]) + sizeof(int32);
+
+	initStringInfo(&buffer);
+	enlargeStringInfo(&buffer, estimated_len);
+
+	/* The varlena header and the container header come first */
+	buffer.len = VARHDRSZ + sizeof(uint32) + sizeof(JEntry) * nelems;
+	data_start = buffer.len;
+	entries = (JEntry *) (buffer.data + VARHDRSZ + sizeof(uint32));
+
+	/*
+	 * The prefix keeps the same offsets relative to the data start, and its
+	 * JEntries the same positions, so both are copied as they are.
+	 */
+	memcpy(entries, array->children, sizeof(JEntry) * from);
+	appendBinaryStringInfo(&buffer, base, prefixlen);
+
+	/* JEntries after the prefix contain only lengths for now */
+	for (i = 0; i < nitems; i++)
+		entries[from + i] = appendItem(&buffer, data_start, items[i]);
+
+	appendElements(&buffer, data_start, array, to, count, entries + from + nitems);
+
+	Assert(buffer.len <= estimated_len);
+
+	return finishJsonbArray(&buffer, entries, from, nelems, prefixlen);
+}
+
+
+/*
+ * JsonbArrayConcat:
+ * Build a new jsonb array from all elements of the arrays in the same way as
+ * JsonbArraySplice: the data of every array is copied in bulk, and only
+ * JEntries are recalculated.
+ */
+Jsonb *
+JsonbArrayConcat(Jsonb **arrays, int narrays)
+{
+	int				nelems = 0;
+	int				estimated_len;
+	int				data_start;
+	JEntry		   *entries;
+	StringInfoData	buffer;
+	int				i;
+
+	estimated_len = VARHDRSZ + sizeof(uint32);
+	for (i = 0; i < narrays; i++)
+	{
+		Assert(JB_ROOT_IS_ARRAY(arrays[i]) && !JB_ROOT_IS_SCALAR(arrays[i]));
+
+		nelems += JB_ROOT_COUNT(arrays[i]);
+		estimated_len += VARSIZE(arrays[i]) + sizeof(int32);
+	}
+
+	initStringInfo(&buffer);
+	enlargeStringInfo(&buffer, estimated_len);
+
+	buffer.len = VARHDRSZ + sizeof(uint32) + sizeof(JEntry) * nelems;
+	data_start = buffer.len;
+	entries = (JEntry *) (buffer.data + VARHDRSZ + sizeof(uint32));
+
+	nelems = 0;
+	for (i = 0; i < narrays; i++)
+	{
+		appendElements(&buffer, data_start, &arrays[i]->root, 0, JB_ROOT_COUNT(arrays[i]),
+					   entries + nelems);
+		nelems += JB_ROOT_COUNT(arrays[i]);
+	}
+
+	Assert(buffer.len <= estimated_len);
+
+	return finishJsonbArray(&buffer, entries, 0, nelems, 0);
+}
+
+
+/*
+ * JsonbArraySlice:
+ * Build a new jsonb array from the elements [from, to) of the array container,
+ * their data is copied in bulk as well.
+ */
+Jsonb *
+JsonbArraySlice(JsonbContainer *array, int from, int to)
+{
+	int				nelems = to - from;
+	int				estimated_len;
+	int				data_start;
+	JEntry		   *entries;
+	StringInfoData	buffer;
+
+	Assert(from >= 0 && from <= to && to <= (array->header & JB_CMASK));
+
+	estimated_len = VARHDRSZ + sizeof(uint32) + sizeof(JEntry) * nelems +
+		getJsonbOffset(array, to) - getJsonbOffset(array, from) + sizeof(int32);
+
+	initStringInfo(&buffer);
+	enlargeStringInfo(&buffer, estimated_len);
+
+	buffer.len = VARHDRSZ + sizeof(uint32) + sizeof(JEntry) * nelems;
+	data_start = buffer.len;
+	entries = (JEntry *) (buffer.data + VARHDRSZ + sizeof(uint32));
+
+	appendElements(&buffer, data_start, array, from, to, entries);
+
+	Assert(buffer.len <= estimated_len);
+
+	return finishJsonbArray(&buffer, entries, 0, nelems, 0);
+}
+
+
+/*
+ * Convert each JB_OFFSET_STRIDE'th length after the index 'from' to an offset,
+ * where prefixlen is the offset of the element 'from', and set the headers.
+ */
+static Jsonb *
+finishJsonbArray(StringInfo buffer, JEntry *entries, int from, int nelems,
+				 uint32 prefixlen)
+{
+	uint32		totallen = prefixlen;
+	uint32		header;
+	int			i;
+	Jsonb	   *res;
+
+	for (i = from; i < nelems; i++)
+	{
+		totallen += JBE_OFFLENFLD(entries[i]);
+
+		if (totallen > JENTRY_OFFLENMASK)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("total size of jsonb array elements exceeds the maximum of %u bytes",
+							JENTRY_OFFLENMASK)));
+
+		if ((i % JB_OFFSET_STRIDE) == 0)
+			entries[i] = (entries[i] & JENTRY_TYPEMASK) | totallen | JENTRY_HAS_OFF;
+	}
+
+	header = nelems | JB_FARRAY;
+	memcpy(buffer->data + VARHDRSZ, &header, sizeof(uint32));
+
+	res = (Jsonb *) buffer->data;
+	SET_VARSIZE(res, buffer->len);
+
+	return res;
+}
+
+
+/*
+ * Copy the elements [from, to) of the array to the end of the buffer, and set
+ * their JEntries to the types and lengths. If the shift of the data is not
+ * a multiple of 4, the first numeric or container of the range gets
+ * a different padding, everything after it keeps its alignment.
+ */
+static void
+appendElements(StringInfo buffer, int data_start, JsonbContainer *array,
+			   int from, int to, JEntry *entries)
+{
+	uint32		count = array->header & JB_CMASK;
+	char	   *base = (char *) (array->children + count);
+	uint32		start = getJsonbOffset(array, from);
+	uint32		offset = start;
+	uint32		end;
+	bool		aligned;
+	int			i;
+
+	aligned = ((buffer->len - data_start) - start) % sizeof(int32) == 0;
+
+	for (i = from; i < to; i++)
+	{
+		JEntry		entry = array->children[i];
+
+		end = offset;
+		JBE_ADVANCE_OFFSET(end, entry);
+
+		if (!aligned && (JBE_ISNUMERIC(entry) || JBE_ISCONTAINER(entry)))
+		{
+			uint32		datastart = INTALIGN(offset);
+			int			padlen;
+
+			appendBinaryStringInfo(buffer, base + start, offset - start);
+			padlen = padToInt(buffer, data_start);
+			start = datastart;
+
+			entries[i - from] = (entry & JENTRY_TYPEMASK) | (padlen + end - datastart);
+			aligned = true;
+		}
+		else
+			entries[i - from] = (entry & JENTRY_TYPEMASK) | (end - offset);
+
+		offset = end;
+	}
+
+	appendBinaryStringInfo(buffer, base + start, offset - start);
+}
+
+
+/*
+ * Append the item as an array element and return its JEntry with the length.
+ * A raw scalar is unwrapped, numerics and containers are int-aligned.
+ */
+static JEntry
+appendItem(StringInfo buffer, int data_start, Jsonb *item)
+{
+	JsonbContainer *root = &item->root;
+	int				padlen;
+
+	if (JB_ROOT_IS_SCALAR(item))
+	{
+		JEntry		entry = root->children[0];
+		/* the only element starts at the aligned data start, no padding */
+		uint32		len = getJsonbLength(root, 0);
+
+		padlen = JBE_ISNUMERIC(entry) ? padToInt(buffer, data_start) : 0;
+		appendBinaryStringInfo(buffer, (char *) (root->children + 1), len);
+
+		return (entry & JENTRY_TYPEMASK) | (padlen + len);
+	}
+
+	padlen = padToInt(buffer, data_start);
+	appendBinaryStringInfo(buffer, (char *) root, VARSIZE(item) - VARHDRSZ);
+
+	return JENTRY_ISCONTAINER | (padlen + VARSIZE(item) - VARHDRSZ);
+}
+
+
+/*
+ * Append padding, so that the offset from the data start is int-aligned.
+ * Returns the number of padding bytes appended.
+ */
+static int
+padToInt(StringInfo buffer, int data_start)
+{
+	int			offset = buffer->len - data_start;
+	int			padlen = INTALIGN(offset) - offset;
+
+	enlargeStringInfo(buffer, padlen);
+	memset(buffer->data + buffer->len, 0, padlen);
+	buffer->len += padlen;
+	buffer->data[buffer->len] = '\0';
+
+	return padlen;
+}
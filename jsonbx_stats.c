@@ -0,0 +1,603 @@
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/tuptoaster.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "nodes/memnodes.h"
+#include "portability/instr_time.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/jsonb.h"
+#include "utils/memutils.h"
+
+#include "jsonbx.h"
+
+PG_FUNCTION_INFO_V1(jsonbx_stats);
+Datum jsonbx_stats(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(jsonbx_stats_reset);
+Datum jsonbx_stats_reset(PG_FUNCTION_ARGS);
+
+/*
+ * Counters of one function in shared memory
+ */
+typedef struct JsonbxStatsEntry
+{
+	slock_t		mutex;
+	int64		calls;
+	int64		noop_calls;		/* the result is the same as the input */
+	int64		input_bytes;
+	int64		output_bytes;
+	double		total_time;		/* in milliseconds */
+	int64		peak_memory;	/* maximum of bytes in use during one call */
+} JsonbxStatsEntry;
+
+typedef struct JsonbxStatsShared
+{
+	JsonbxStatsEntry	entries[JSONBX_STATS_NFUNCS];
+} JsonbxStatsShared;
+
+/*
+ * Which argument is the input document, and whether the result is a varlena
+ * (it's built in the arena then) and has the same type, so it can be
+ * compared with the input
+ */
+typedef struct JsonbxStatsFunction
+{
+	const char *name;
+	int			input_arg;		/* -1 if there is no input document */
+	bool		has_output;
+	bool		same_type;
+} JsonbxStatsFunction;
+
+static const JsonbxStatsFunction statsFunctions[JSONBX_STATS_NFUNCS] = {
+	{"jsonb_pretty", 0, true, false},
+	{"jsonb_serialize", 0, true, false},
+	{"jsonb_concat", 0, true, true},
+	{"jsonb_deep_concat", 0, true, true},
+	{"jsonb_delete", 0, true, true},
+	{"jsonb_delete_idx", 0, true, true},
+	{"jsonb_delete_path", 0, true, true},
+	{"jsonb_set", 0, true, true},
+	{"jsonb_set_jsonbx_path", 0, true, true},
+	{"jsonb_delete_jsonbx_path", 0, true, true},
+	{"jsonb_array_delete_range", 0, true, true},
+	{"jsonb_array_insert", 0, true, true},
+	{"jsonb_modify", 0, true, true},
+	{"jsonb_delete_keys", 0, true, true},
+	{"jsonb_select_keys", 0, true, true},
+	{"jsonb_concat_agg_transfn", 1, false, false},
+	{"jsonb_concat_agg_finalfn", -1, true, false},
+	{"jsonbx_chain", 0, true, true},
+	{"jsonb_concat_variadic", 0, true, false},
+	{"jsonb_diff", 1, true, false},
+	{"jsonb_patch", 0, true, true},
+	{"jsonb_increment", 0, true, true},
+	{"jsonbx_array_append", 0, true, true},
+	{"jsonbx_array_delete_idx", 0, true, true},
+	{"jsonb_strip_key", 0, true, true}
+};
+
+
+/*
+ * The memory counting context, see JsonbxCountingContext
+ */
+static void *CountingAlloc(MemoryContext context, Size size);
+static void CountingFree(MemoryContext context, void *pointer);
+static void *CountingRealloc(MemoryContext context, void *pointer, Size size);
+static Size countingChunkSize(void *pointer);
+
+static MemoryContextMethods CountingMethods;
+static MemoryContextMethods *AllocSetMethods = NULL;
+
+static void jsonbx_shmem_startup(void);
+static void assignTrackStats(bool newval, void *extra);
+static void assignUseArena(bool newval, void *extra);
+static Datum jsonbxArenaCall(FunctionCallInfo fcinfo, PGFunction func, int id);
+static bool isNoopCall(Datum input, Pointer detoasted, Datum result);
+
+/* Do calls go through jsonbxCall, see JSONBX_FUNCTION */
+bool jsonbxWrapCalls = false;
+
+/* Is the stats collection enabled */
+static bool jsonbxStatsEnabled = false;
+
+JsonbxMemoryUsage jsonbxMemoryUsage;
+
+/* Detoasted input document of the current call, see PG_GETARG_JSONB_INPUT */
+Pointer jsonbxInput = NULL;
+
+/* Number of jsonbx calls running in the arena, see jsonbxArenaCall */
+static int jsonbxArenaDepth = 0;
+
+static MemoryContext jsonbxArena = NULL;
+static bool jsonbxUseArena = false;
+
+static bool jsonbxTrackStats = true;
+static JsonbxStatsShared *jsonbxStats = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+/*
+ * JsonbxStatsInit:
+ * Define the GUC and request the shared memory for counters. The counters
+ * exist only if the library is loaded by shared_preload_libraries, otherwise
+ * the stats collection is never enabled.
+ */
+void
+JsonbxStatsInit(void)
+{
+	DefineCustomBoolVariable("jsonbx.track_stats",
+							 "Collects statistics of jsonbx functions.",
+							 "Works only if jsonbx is in shared_preload_libraries.",
+							 &jsonbxTrackStats,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 assignTrackStats,
+							 NULL);
+
+	DefineCustomBoolVariable("jsonbx.use_arena",
+							 "Runs every jsonbx call in a context, which is reset after the call.",
+							 "Frees temporary values of a call at once, but costs a reset and a copy of the result per call.",
+							 &jsonbxUseArena,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 assignUseArena,
+							 NULL);
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	RequestAddinShmemSpace(sizeof(JsonbxStatsShared));
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = jsonbx_shmem_startup;
+}
+
+
+static void
+jsonbx_shmem_startup(void)
+{
+	bool		found;
+	int			i;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	jsonbxStats = ShmemInitStruct("jsonbx stats", sizeof(JsonbxStatsShared), &found);
+
+	if (!found)
+	{
+		memset(jsonbxStats, 0, sizeof(JsonbxStatsShared));
+		for (i = 0; i < JSONBX_STATS_NFUNCS; i++)
+			SpinLockInit(&jsonbxStats->entries[i].mutex);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	jsonbxStatsEnabled = jsonbxTrackStats;
+	jsonbxWrapCalls = jsonbxStatsEnabled || jsonbxUseArena;
+}
+
+
+static void
+assignTrackStats(bool newval, void *extra)
+{
+	jsonbxStatsEnabled = newval && jsonbxStats != NULL;
+	jsonbxWrapCalls = jsonbxStatsEnabled || jsonbxUseArena;
+}
+
+
+static void
+assignUseArena(bool newval, void *extra)
+{
+	jsonbxWrapCalls = jsonbxStatsEnabled || newval;
+}
+
+
+/*
+ * jsonbxCall:
+ * Call of a jsonbx function, if the stats or the arena are enabled. The
+ * outermost call runs in the arena, nested ones share it.
+ */
+Datum
+jsonbxCall(FunctionCallInfo fcinfo, PGFunction func, int id)
+{
+	if (jsonbxUseArena && jsonbxArenaDepth == 0)
+		return jsonbxArenaCall(fcinfo, func, id);
+
+	if (jsonbxStatsEnabled)
+		return jsonbxStatsCall(fcinfo, func, id);
+
+	return func(fcinfo);
+}
+
+
+/*
+ * jsonbxStatsCall:
+ * Call the function and add the call to its counters. The function runs in
+ * a counting context (see JsonbxCountingContext) to find out its peak memory
+ * usage, the usage of an outer call, if any, is restored afterwards.
+ */
+Datum
+jsonbxStatsCall(FunctionCallInfo fcinfo, PGFunction func, int id)
+{
+	const JsonbxStatsFunction *info = &statsFunctions[id];
+	volatile JsonbxStatsEntry *entry = &jsonbxStats->entries[id];
+	JsonbxMemoryUsage outer = jsonbxMemoryUsage;
+	Pointer			outerInput = jsonbxInput;
+	Pointer			detoasted;
+	MemoryContext	oldcontext;
+	instr_time		start;
+	instr_time		duration;
+	Datum			input = (Datum) 0;
+	Size			input_bytes = 0;
+	Size			output_bytes = 0;
+	bool			noop = false;
+	Datum			result;
+
+	if (info->input_arg >= 0 && info->input_arg < PG_NARGS() &&
+		!PG_ARGISNULL(info->input_arg))
+	{
+		input = PG_GETARG_DATUM(info->input_arg);
+		input_bytes = toast_raw_datum_size(input);
+	}
+
+	memset(&jsonbxMemoryUsage, 0, sizeof(JsonbxMemoryUsage));
+	jsonbxInput = NULL;
+	oldcontext = MemoryContextSwitchTo(JsonbxCountingContext(CurrentMemoryContext));
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	PG_TRY();
+	{
+		result = func(fcinfo);
+	}
+	PG_CATCH();
+	{
+		/* the outer call may catch the error and go on */
+		MemoryContextSwitchTo(oldcontext);
+		jsonbxMemoryUsage = outer;
+		jsonbxInput = outerInput;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	detoasted = jsonbxInput;
+	jsonbxInput = outerInput;
+
+	if (info->has_output && !fcinfo->isnull)
+	{
+		output_bytes = VARSIZE_ANY(DatumGetPointer(result));
+		noop = info->same_type && input_bytes > 0 &&
+			isNoopCall(input, detoasted, result);
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->calls++;
+	entry->noop_calls += noop ? 1 : 0;
+	entry->input_bytes += input_bytes;
+	entry->output_bytes += output_bytes;
+	entry->total_time += INSTR_TIME_GET_MILLISEC(duration);
+	if (jsonbxMemoryUsage.peak > entry->peak_memory)
+		entry->peak_memory = jsonbxMemoryUsage.peak;
+	SpinLockRelease(&entry->mutex);
+
+	outer.allocated += jsonbxMemoryUsage.allocated;
+	outer.peak = Max(outer.peak, outer.current + jsonbxMemoryUsage.peak);
+	outer.current += jsonbxMemoryUsage.current;
+	jsonbxMemoryUsage = outer;
+
+	return result;
+}
+
+
+/*
+ * jsonbxArenaCall:
+ * Call the outermost jsonbx function in the arena, a context, which is reset
+ * after every call. Parse states, detoasted arguments and other temporary
+ * values go away at once, instead of piling up in the caller's context until
+ * the end of the query, and only the result is copied to the caller, unless
+ * it's one of the arguments returned as is. Nested calls share the arena of
+ * the outermost one. The aggregate transition function keeps its state in
+ * the caller's context, so it's called as is. The reset and the copy cost
+ * more than they save for small values, so the arena is used only with
+ * jsonbx.use_arena = on.
+ */
+static Datum
+jsonbxArenaCall(FunctionCallInfo fcinfo, PGFunction func, int id)
+{
+	MemoryContext	caller = CurrentMemoryContext;
+	MemoryContext	arena;
+	Datum			result;
+	int				i;
+
+	if (!statsFunctions[id].has_output)
+		return jsonbxStatsEnabled ? jsonbxStatsCall(fcinfo, func, id) : func(fcinfo);
+
+	if (jsonbxArena == NULL)
+		jsonbxArena = AllocSetContextCreate(TopMemoryContext,
+											"jsonbx arena",
+											ALLOCSET_DEFAULT_MINSIZE,
+											ALLOCSET_DEFAULT_INITSIZE,
+											ALLOCSET_DEFAULT_MAXSIZE);
+
+	/* allocations are still counted, if the caller counts them */
+	if (caller->methods == &CountingMethods)
+		arena = JsonbxCountingContext(jsonbxArena);
+	else
+		arena = jsonbxArena;
+
+	jsonbxArenaDepth++;
+	MemoryContextSwitchTo(arena);
+
+	PG_TRY();
+	{
+		if (jsonbxStatsEnabled)
+			result = jsonbxStatsCall(fcinfo, func, id);
+		else
+			result = func(fcinfo);
+	}
+	PG_CATCH();
+	{
+		jsonbxArenaDepth = 0;
+		MemoryContextSwitchTo(caller);
+		MemoryContextReset(jsonbxArena);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	jsonbxArenaDepth--;
+	MemoryContextSwitchTo(caller);
+
+	if (!fcinfo->isnull)
+	{
+		for (i = 0; i < PG_NARGS(); i++)
+		{
+			if (!PG_ARGISNULL(i) && PG_GETARG_DATUM(i) == result)
+				break;
+		}
+
+		if (i == PG_NARGS())
+		{
+			Size	len = VARSIZE_ANY(DatumGetPointer(result));
+
+			result = PointerGetDatum(memcpy(palloc(len), DatumGetPointer(result), len));
+		}
+	}
+
+	MemoryContextReset(jsonbxArena);
+
+	return result;
+}
+
+
+/*
+ * Whether the result is the same as the input. Functions return the input
+ * itself, if nothing is changed, or its detoasted copy, which they fetched
+ * by PG_GETARG_JSONB_INPUT. An equal result built anew is recognized only
+ * for an inline uncompressed input, a TOASTed one is not fetched again.
+ */
+static bool
+isNoopCall(Datum input, Pointer detoasted, Datum result)
+{
+	struct varlena *in = (struct varlena *) DatumGetPointer(input);
+	struct varlena *out = (struct varlena *) DatumGetPointer(result);
+
+	if ((Pointer) in == (Pointer) out || (Pointer) out == detoasted)
+		return true;
+
+	if (VARATT_IS_EXTERNAL(in) || VARATT_IS_COMPRESSED(in))
+		return false;
+
+	return VARSIZE_ANY_EXHDR(in) == VARSIZE_ANY_EXHDR(out) &&
+		memcmp(VARDATA_ANY(in), VARDATA_ANY(out), VARSIZE_ANY_EXHDR(in)) == 0;
+}
+
+
+/*
+ * jsonbx_stats:
+ * Counters of all functions, one row per function.
+ */
+Datum
+jsonbx_stats(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	int				id;
+
+	if (jsonbxStats == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("jsonbx must be loaded via shared_preload_libraries")));
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		TupleDesc		tupdesc;
+		MemoryContext	oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	id = funcctx->call_cntr;
+
+	if (id < JSONBX_STATS_NFUNCS)
+	{
+		volatile JsonbxStatsEntry *entry = &jsonbxStats->entries[id];
+		JsonbxStatsEntry counters;
+		Datum		values[7];
+		bool		nulls[7];
+
+		SpinLockAcquire(&entry->mutex);
+		counters = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(statsFunctions[id].name);
+		values[1] = Int64GetDatum(counters.calls);
+		values[2] = Int64GetDatum(counters.noop_calls);
+		values[3] = Int64GetDatum(counters.input_bytes);
+		values[4] = Int64GetDatum(counters.output_bytes);
+		values[5] = Float8GetDatum(counters.total_time);
+		values[6] = Int64GetDatum(counters.peak_memory);
+
+		SRF_RETURN_NEXT(funcctx,
+						HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc,
+														  values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+
+/*
+ * jsonbx_stats_reset:
+ * Set all counters to zero.
+ */
+Datum
+jsonbx_stats_reset(PG_FUNCTION_ARGS)
+{
+	int			i;
+
+	if (jsonbxStats == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("jsonbx must be loaded via shared_preload_libraries")));
+
+	for (i = 0; i < JSONBX_STATS_NFUNCS; i++)
+	{
+		volatile JsonbxStatsEntry *entry = &jsonbxStats->entries[i];
+
+		SpinLockAcquire(&entry->mutex);
+		entry->calls = 0;
+		entry->noop_calls = 0;
+		entry->input_bytes = 0;
+		entry->output_bytes = 0;
+		entry->total_time = 0;
+		entry->peak_memory = 0;
+		SpinLockRelease(&entry->mutex);
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * JsonbxCountingContext:
+ * A memory context, which counts its chunks in jsonbxMemoryUsage. It's an
+ * ordinary allocation set, a child of the parent, and only alloc, free and
+ * realloc of its methods are replaced with the counting ones, which call the
+ * methods of the allocation set. So it lives as long as the parent, and it's
+ * reset, deleted and checked as any other allocation set. It's created only
+ * once for every parent.
+ */
+MemoryContext
+JsonbxCountingContext(MemoryContext parent)
+{
+	MemoryContext child;
+
+	if (parent->methods == &CountingMethods)
+		return parent;
+
+	for (child = parent->firstchild; child != NULL; child = child->nextchild)
+	{
+		if (child->methods == &CountingMethods)
+			return child;
+	}
+
+	child = AllocSetContextCreate(parent,
+								  "jsonbx counting",
+								  ALLOCSET_SMALL_MINSIZE,
+								  ALLOCSET_SMALL_INITSIZE,
+								  ALLOCSET_DEFAULT_MAXSIZE);
+
+	if (AllocSetMethods == NULL)
+	{
+		AllocSetMethods = child->methods;
+		CountingMethods = *AllocSetMethods;
+		CountingMethods.alloc = CountingAlloc;
+		CountingMethods.free_p = CountingFree;
+		CountingMethods.realloc = CountingRealloc;
+	}
+
+	child->methods = &CountingMethods;
+
+	return child;
+}
+
+
+/*
+ * Size of the chunk in the allocation set, it's what the chunk really takes
+ * and the same on alloc and free
+ */
+static Size
+countingChunkSize(void *pointer)
+{
+	StandardChunkHeader *chunk;
+
+	chunk = (StandardChunkHeader *) ((char *) pointer - STANDARDCHUNKHEADERSIZE);
+	return chunk->size;
+}
+
+
+static void *
+CountingAlloc(MemoryContext context, Size size)
+{
+	void	   *pointer = AllocSetMethods->alloc(context, size);
+
+	size = countingChunkSize(pointer);
+	jsonbxMemoryUsage.allocated += size;
+	jsonbxMemoryUsage.current += size;
+	jsonbxMemoryUsage.peak = Max(jsonbxMemoryUsage.peak, jsonbxMemoryUsage.current);
+
+	return pointer;
+}
+
+
+static void
+CountingFree(MemoryContext context, void *pointer)
+{
+	jsonbxMemoryUsage.current -= countingChunkSize(pointer);
+
+	AllocSetMethods->free_p(context, pointer);
+}
+
+
+static void *
+CountingRealloc(MemoryContext context, void *pointer, Size size)
+{
+	Size		oldsize = countingChunkSize(pointer);
+
+	pointer = AllocSetMethods->realloc(context, pointer, size);
+	size = countingChunkSize(pointer);
+
+	if (size > oldsize)
+		jsonbxMemoryUsage.allocated += size - oldsize;
+	jsonbxMemoryUsage.current += (int64) size - (int64) oldsize;
+	jsonbxMemoryUsage.peak = Max(jsonbxMemoryUsage.peak, jsonbxMemoryUsage.current);
+
+	return pointer;
+}
@@ -2,6 +2,8 @@
 
 #include <limits.h>
 
+#include "catalog/pg_type.h"
+#include "miscadmin.h"
 #include "utils/builtins.h"
 #include "utils/json.h"
 #include "utils/jsonb.h"
@@ -13,32 +15,170 @@
 
 #define is_array(flag_val, it) flag_val == WJB_BEGIN_ARRAY && !(*it)->isScalar
 
+/*
+ * Elements of the array being built by unionJsonbArrays. Scalars are found
+ * by the hash table with linear probing, and nested containers, which have
+ * no cheap hash, are kept in a separate list to compare them one by one.
+ */
+typedef struct JsonbUnionSet
+{
+	JsonbValue	   *elems;
+	int			   *hashslots;		/* element indexes, -1 for an empty slot */
+	uint32			hashsize;		/* power of 2 */
+	int			   *containers;		/* indexes of jbvBinary elements */
+	int				ncontainers;
+} JsonbUnionSet;
+
 typedef bool (*walk_condition)(JsonbParseState**, JsonbValue*, uint32 /* token */, uint32 /* level */);
-void add_indent(StringInfo out, bool indent, int level);
-void jsonb_put_escaped_value(StringInfo out, JsonbValue * scalarVal);
 bool h_atoi(char *c, int *acc);
-JsonbValue *walkJsonb(JsonbIterator **it, JsonbParseState **state, bool stop_at_level_zero);
+void walkJsonb(JsonbIterator **it, JsonbWriter *w, bool stop_at_level_zero);
 bool untilLast(JsonbParseState **state, JsonbValue *v, uint32 token, uint32 level);
-void addJsonbToParseState(JsonbParseState **jbps, Jsonb * jb);
 
-static void setPathObject(JsonbIterator **it, Datum *path_elems, bool *path_nulls,
-							  int path_len, JsonbParseState **st, int level,
-							  Jsonb *newval, uint32	nelems, bool create);
-static void setPathArray(JsonbIterator **it, Datum *path_elems, bool *path_nulls,
-							 int path_len, JsonbParseState **st, int level,
-							 Jsonb *newval, uint32 npairs, bool create);
+static void beginCopiedObject(JsonbIterator **it, JsonbValue *object,
+							  JsonbWriter *w);
+static void expectMergedKeys(JsonbContainer *c1, JsonbContainer *c2,
+							 uint32 npairs, JsonbWriter *w);
+static void setPathObject(JsonbIterator **it, JsonbPath *path, JsonbWriter *w,
+						  int level, JsonbValue *newval, uint32 nelems, bool create);
+static void setPathArray(JsonbIterator **it, JsonbPath *path, JsonbWriter *w,
+						 int level, JsonbValue *newval, uint32 npairs, bool create);
+static bool addUnionElem(JsonbUnionSet *set, int n);
+static int enterPathValue(JsonbIterator **it, JsonbWriter *w, uint32 *nvalues);
+static void leavePathContainer(JsonbIterator **it, JsonbWriter *w);
+static void copyPathValue(JsonbIterator **it, JsonbWriter *w);
+static void copyPathPair(JsonbIterator **it, JsonbWriter *w, JsonbValue *key);
+static void skipPathValue(JsonbIterator **it);
+static void pushJsonbWriterKey(JsonbWriter *w, char *key, int keylen);
+static int resolveArrayIndex(int idx, int nelems);
+static int getArrayIndex(Datum path_elem, int level);
+static int getPathArrayIndex(JsonbPath *path, int level);
+
+/*
+ * Array index of a path trie node, see modifyPathArray
+ */
+typedef struct PathTrieIndex
+{
+	int				index;
+	int				order;
+	PathTrieNode	*node;
+} PathTrieIndex;
+
+static void modifyPathObject(JsonbIterator **it, PathTrieNode *node,
+							 JsonbWriter *w, int level, uint32 npairs);
+static void modifyPathArray(JsonbIterator **it, PathTrieNode *node,
+							JsonbWriter *w, int level, uint32 nelems);
+static void addMissingPath(JsonbWriter *w, PathTrieNode *node, int level,
+						   bool isObject);
+static void addModifiedJsonb(JsonbWriter *w, PathTrieNode *node, int level);
+static int nextTrieChild(PathTrieNode *node, int c);
+static int comparePathTrieNodes(const void *a, const void *b);
+static int comparePathTrieIndexes(const void *a, const void *b);
+static bool isAppendKey(Datum key);
+
+/*
+ * Numeric on-disk format, see numeric.c. Only what is needed to print
+ * a numeric without numeric_out.
+ */
+typedef int16 NumericDigit;
+
+#define DEC_DIGITS						4
+#define NUMERIC_SIGN_MASK				0xC000
+#define NUMERIC_NEG						0x4000
+#define NUMERIC_SHORT					0x8000
+#define NUMERIC_NAN						0xC000
+#define NUMERIC_DSCALE_MASK				0x3FFF
+#define NUMERIC_SHORT_SIGN_MASK			0x2000
+#define NUMERIC_SHORT_DSCALE_MASK		0x1F80
+#define NUMERIC_SHORT_DSCALE_SHIFT		7
+#define NUMERIC_SHORT_WEIGHT_SIGN_MASK	0x0040
+#define NUMERIC_SHORT_WEIGHT_MASK		0x003F
+
+/* Longer numerics are printed by numeric_out */
+#define NUMERIC_OUT_BUFSIZE				128
+
+/*
+ * Destination of the jsonb text representation: a plain buffer of the exact
+ * size computed in advance. Only the length is computed if there is none.
+ */
+typedef struct JsonbOutput
+{
+	char	   *data;
+	int			size;			/* allocated length of data */
+	int			len;
+} JsonbOutput;
+
+static void jsonbToOutput(JsonbOutput *out, JsonbContainer *in, JsonbOutputFormat *format);
+static void put_bytes(JsonbOutput *out, const char *data, int len);
+static void put_char(JsonbOutput *out, char c);
+static void add_indent(JsonbOutput *out, int indent, int level);
+static void jsonb_put_value(JsonbOutput *out, JsonbValue *v);
+static void jsonb_put_escaped_value(JsonbOutput *out, JsonbValue *scalarVal);
+static void put_escaped_string(JsonbOutput *out, const char *str, int len);
+static void put_numeric(JsonbOutput *out, Numeric num);
+static void add_container_summary(JsonbOutput *out, JsonbContainer *container);
+
+
+
+/*
+ * JsonbToCStringLength:
+ * Exact length of the text JsonbToText produces for the same format.
+ * Nothing is written, the container is only walked through.
+ */
+int
+JsonbToCStringLength(JsonbContainer *in, JsonbOutputFormat *format)
+{
+	JsonbOutput		output;
+
+	output.data = NULL;
+	output.len = 0;
+
+	jsonbToOutput(&output, in, format);
+
+	return output.len;
+}
+
+
+/*
+ * JsonbToText:
+ * Serialize jsonb into a text datum. The first pass computes the exact length
+ * of the output, so the second one writes directly into the result without
+ * any reallocation or an extra copy of the C-string.
+ */
+text *
+JsonbToText(JsonbContainer *in, JsonbOutputFormat *format)
+{
+	int				len = JsonbToCStringLength(in, format);
+	text		   *result = (text *) palloc(VARHDRSZ + len);
+	JsonbOutput		output;
+
+	output.data = VARDATA(result);
+	output.size = len;
+	output.len = 0;
 
+	jsonbToOutput(&output, in, format);
+
+	if (output.len != len)
+		elog(ERROR, "jsonb text length %d differs from the computed length %d",
+			 output.len, len);
+
+	SET_VARSIZE(result, VARHDRSZ + len);
+
+	return result;
+}
 
 
 /*
- * JsonbToCStringExtended:
- * Convert jsonb value to a C-string taking into account "pretty_print" mode.
- * See the original function JsonbToCString in the jsonb.c
- * Only one considerable change is printCR and printIndent functions,
- * which add required line breaks and spaces accordingly to the nesting level.
+ * Walk through the container and put its text representation into the output.
+ * See the original function JsonbToCString in the jsonb.c. The layout is
+ * described by the format: number of spaces per nesting level (no line breaks
+ * at all for zero), and compact mode without spaces after commas and colons.
+ * Containers nested deeper than max_depth levels are not iterated at all,
+ * a short summary built from the container header is printed instead. Output
+ * stops once it has reached max_bytes. A negative value means no limit in
+ * both cases.
  */
-char *
-JsonbToCStringWorker(StringInfo out, JsonbContainer *in, int estimated_len, bool indent)
+static void
+jsonbToOutput(JsonbOutput *out, JsonbContainer *in, JsonbOutputFormat *format)
 {
 	bool            first = true;
 	JsonbIterator   *it;
@@ -46,39 +186,60 @@ JsonbToCStringWorker(StringInfo out, JsonbContainer *in, int estimated_len, bool
 	JsonbValue      v;
 	int             level = 0;
 	bool            redo_switch = false;
-	/* If we are indenting, don't add a space after a comma */
-	int			ispaces = indent ? 1 : 2;
+	int				max_depth = format->max_depth;
+	int				max_bytes = format->max_bytes;
+	/*
+	 * If we are indenting or compact, don't add a space after a comma,
+	 * and don't add it after a colon in the compact mode
+	 */
+	int			ispaces = (format->indent > 0 || format->compact) ? 1 : 2;
+	int			colon_len = format->compact ? 1 : 2;
 	/*
-	 * Don't indent the very first item. This gets set to the indent flag
+	 * Don't indent the very first item. This gets set to the indent
 	 * at the bottom of the loop.
 	 */
-	bool        use_indent = false;
+	int         use_indent = 0;
 	bool        raw_scalar = false;
+	bool        truncated PG_USED_FOR_ASSERTS_ONLY = false;
 
-	if (out == NULL)
-		out = makeStringInfo();
-
-	enlargeStringInfo(out, (estimated_len >= 0) ? estimated_len : 64);
+	if (max_depth == 0 && !(in->header & JB_FSCALAR))
+	{
+		add_container_summary(out, in);
+		return;
+	}
 
 	it = JsonbIteratorInit(in);
 
 	while (redo_switch ||
-		   ((type = JsonbIteratorNext(&it, &v, false)) != WJB_DONE))
+		   ((type = JsonbIteratorNext(&it, &v,
+									  max_depth >= 0 && level >= max_depth)) != WJB_DONE))
 	{
 		redo_switch = false;
+
+		if (max_bytes >= 0 && out->len >= max_bytes)
+		{
+			if (!first)
+				put_bytes(out, ", ", ispaces);
+
+			add_indent(out, use_indent, level);
+			put_bytes(out, "...", 3);
+			truncated = true;
+			break;
+		}
+
 		switch (type)
 		{
 			case WJB_BEGIN_ARRAY:
 				if (!first)
 				{
-					appendBinaryStringInfo(out, ", ", ispaces);
+					put_bytes(out, ", ", ispaces);
 				}
 				first = true;
 
 				if (!v.val.array.rawScalar)
 				{
 					add_indent(out, use_indent, level);
-					appendStringInfoCharMacro(out, '[');
+					put_char(out, '[');
 				}
 				else
 				{
@@ -88,30 +249,31 @@ JsonbToCStringWorker(StringInfo out, JsonbContainer *in, int estimated_len, bool
 				break;
 			case WJB_BEGIN_OBJECT:
 				if (!first)
-					appendBinaryStringInfo(out, ", ", ispaces);
+					put_bytes(out, ", ", ispaces);
 				first = true;
 
 				add_indent(out, use_indent, level);
-				appendStringInfoCharMacro(out, '{');
+				put_char(out, '{');
 
 				level++;
 				break;
 			case WJB_KEY:
 				if (!first)
-					appendBinaryStringInfo(out, ", ", ispaces);
+					put_bytes(out, ", ", ispaces);
 				first = true;
 
 				add_indent(out, use_indent, level);
 
 				/* json rules guarantee this is a string */
 				jsonb_put_escaped_value(out, &v);
-				appendBinaryStringInfo(out, ": ", 2);
+				put_bytes(out, ": ", colon_len);
 
-				type = JsonbIteratorNext(&it, &v, false);
+				type = JsonbIteratorNext(&it, &v,
+										 max_depth >= 0 && level >= max_depth);
 				if (type == WJB_VALUE)
 				{
 					first = false;
-					jsonb_put_escaped_value(out, &v);
+					jsonb_put_value(out, &v);
 				}
 				else
 				{
@@ -128,7 +290,7 @@ JsonbToCStringWorker(StringInfo out, JsonbContainer *in, int estimated_len, bool
 			case WJB_ELEM:
 				if (!first)
 				{
-					appendBinaryStringInfo(out, ", ", ispaces);
+					put_bytes(out, ", ", ispaces);
 				}
 
 				first = false;
@@ -138,7 +300,7 @@ JsonbToCStringWorker(StringInfo out, JsonbContainer *in, int estimated_len, bool
 					add_indent(out, use_indent, level);
 				}
 
-				jsonb_put_escaped_value(out, &v);
+				jsonb_put_value(out, &v);
 				break;
 			case WJB_END_ARRAY:
 				level--;
@@ -146,7 +308,7 @@ JsonbToCStringWorker(StringInfo out, JsonbContainer *in, int estimated_len, bool
 				if (!raw_scalar)
 				{
 					add_indent(out, use_indent, level);
-					appendStringInfoChar(out, ']');
+					put_char(out, ']');
 				}
 				first = false;
 				break;
@@ -154,32 +316,104 @@ JsonbToCStringWorker(StringInfo out, JsonbContainer *in, int estimated_len, bool
 				level--;
 
 				add_indent(out, use_indent, level);
-				appendStringInfoCharMacro(out, '}');
+				put_char(out, '}');
 				first = false;
 				break;
 			default:
 				elog(ERROR, "unknown flag of jsonb iterator");
 		}
-		use_indent = indent;
+		use_indent = format->indent;
 	}
 
-	Assert(level == 0);
+	Assert(level == 0 || truncated);
+}
+
+
+/*
+ * put_bytes, put_char:
+ * Append to the output, or only count the length if there is no buffer.
+ * A plain buffer is never written past its size, even if the computed
+ * length turns out to be wrong.
+ */
+static void
+put_bytes(JsonbOutput *out, const char *data, int len)
+{
+	if (out->data)
+	{
+		if (out->len + len > out->size)
+			elog(ERROR, "jsonb text is longer than the computed length %d",
+				 out->size);
+		memcpy(out->data + out->len, data, len);
+	}
+	out->len += len;
+}
 
-	return out->data;
+static void
+put_char(JsonbOutput *out, char c)
+{
+	if (out->data)
+	{
+		if (out->len >= out->size)
+			elog(ERROR, "jsonb text is longer than the computed length %d",
+				 out->size);
+		out->data[out->len] = c;
+	}
+	out->len++;
 }
 
 
-void
-add_indent(StringInfo out, bool indent, int level)
+/*
+ * jsonb_put_value:
+ * Print either a scalar or a summary of a skipped nested container.
+ */
+static void
+jsonb_put_value(JsonbOutput *out, JsonbValue *v)
+{
+	if (v->type == jbvBinary)
+		add_container_summary(out, v->val.binary.data);
+	else
+		jsonb_put_escaped_value(out, v);
+}
+
+
+/*
+ * add_container_summary:
+ * Print a number of elements or keys of the container instead of its content,
+ * e.g. [... 10 elements] or {... 1 key}. Only the header is used, so
+ * the container is not iterated.
+ */
+static void
+add_container_summary(JsonbOutput *out, JsonbContainer *container)
+{
+	uint32		count = container->header & JB_CMASK;
+	char		summary[64];
+	int			len;
+
+	if (container->header & JB_FOBJECT)
+		len = snprintf(summary, sizeof(summary), "{... %u key%s}",
+					   count, (count == 1) ? "" : "s");
+	else
+		len = snprintf(summary, sizeof(summary), "[... %u element%s]",
+					   count, (count == 1) ? "" : "s");
+
+	put_bytes(out, summary, len);
+}
+
+
+static void
+add_indent(JsonbOutput *out, int indent, int level)
 {
-	if (indent)
+	if (indent > 0)
 	{
-		int			i;
+		int			n = indent * level;
 
-		appendStringInfoCharMacro(out, '\n');
-		for (i = 0; i < level; i++)
+		put_char(out, '\n');
+		while (n > 0)
 		{
-			appendBinaryStringInfo(out, "    ", 4);
+			int		chunk = Min(n, 8);
+
+			put_bytes(out, "        ", chunk);
+			n -= chunk;
 		}
 	}
 }
@@ -189,27 +423,25 @@ add_indent(StringInfo out, bool indent, int level)
  * jsonb_put_escaped_value:
  * Return string representation of jsonb value.
  */
-void
-jsonb_put_escaped_value(StringInfo out, JsonbValue * scalarVal)
+static void
+jsonb_put_escaped_value(JsonbOutput *out, JsonbValue * scalarVal)
 {
 	switch (scalarVal->type)
 	{
 		case jbvNull:
-			appendBinaryStringInfo(out, "null", 4);
+			put_bytes(out, "null", 4);
 			break;
 		case jbvString:
-			escape_json(out, pnstrdup(scalarVal->val.string.val, scalarVal->val.string.len));
+			put_escaped_string(out, scalarVal->val.string.val, scalarVal->val.string.len);
 			break;
 		case jbvNumeric:
-			appendStringInfoString(out,
-								   DatumGetCString(DirectFunctionCall1(numeric_out,
-																	   PointerGetDatum(scalarVal->val.numeric))));
+			put_numeric(out, scalarVal->val.numeric);
 			break;
 		case jbvBool:
 			if (scalarVal->val.boolean)
-				appendBinaryStringInfo(out, "true", 4);
+				put_bytes(out, "true", 4);
 			else
-				appendBinaryStringInfo(out, "false", 5);
+				put_bytes(out, "false", 5);
 			break;
 		default:
 			elog(ERROR, "unknown jsonb scalar type");
@@ -218,94 +450,232 @@ jsonb_put_escaped_value(StringInfo out, JsonbValue * scalarVal)
 
 
 /*
- * Iterate over all jsonb objects and merge them into one.
- * The logic of this function copied from the same hstore function,
- * except the case, when it1 & it2 represents jbvObject.
- * In that case we just append the content of it2 to it1 without any
- * verifications.
+ * put_numeric:
+ * Print a numeric the same way as numeric_out does. Numbers, which are
+ * short enough (all integers and decimals of a reasonable scale), are
+ * formatted directly from the digits of the on-disk representation into
+ * a local buffer, without the function call and a palloc'd string.
+ * Everything else goes through numeric_out.
  */
-JsonbValue *
-IteratorConcat(JsonbIterator **it1, JsonbIterator **it2,
-		JsonbParseState **state)
+static void
+put_numeric(JsonbOutput *out, Numeric num)
 {
-	uint32          r1, r2, rk1, rk2;
-	JsonbValue      v1, v2, *res = NULL;
+	uint16		   *header;
+	NumericDigit   *digits;
+	int				ndigits;
+	int				weight;
+	int				dscale;
+	bool			neg;
+	char			buf[NUMERIC_OUT_BUFSIZE];
+	char		   *cp = buf;
+	char		   *endcp;
+	int				d, i;
+
+	if (VARATT_IS_SHORT(num))
+		goto fallback;
+
+	header = (uint16 *) VARDATA(num);
+
+	switch (*header & NUMERIC_SIGN_MASK)
+	{
+		case NUMERIC_NAN:
+			put_bytes(out, "NaN", 3);
+			return;
+		case NUMERIC_SHORT:
+			neg = (*header & NUMERIC_SHORT_SIGN_MASK) != 0;
+			dscale = (*header & NUMERIC_SHORT_DSCALE_MASK) >> NUMERIC_SHORT_DSCALE_SHIFT;
+			weight = *header & NUMERIC_SHORT_WEIGHT_MASK;
+			if (*header & NUMERIC_SHORT_WEIGHT_SIGN_MASK)
+				weight |= ~NUMERIC_SHORT_WEIGHT_MASK;
+			digits = (NumericDigit *) (header + 1);
+			break;
+		default:
+			neg = (*header & NUMERIC_SIGN_MASK) == NUMERIC_NEG;
+			dscale = *header & NUMERIC_DSCALE_MASK;
+			weight = *((int16 *) (header + 1));
+			digits = (NumericDigit *) (header + 2);
+			break;
+	}
 
-	r1 = rk1 = JsonbIteratorNext(it1, &v1, false);
-	r2 = rk2 = JsonbIteratorNext(it2, &v2, false);
+	ndigits = (VARSIZE(num) - ((char *) digits - (char *) num)) / sizeof(NumericDigit);
 
 	/*
-	 * Both elements are objects.
+	 * Sign, integral part, point, and the fractional part rounded up to
+	 * a whole number of NBASE digits must fit into the buffer.
 	 */
-	if (rk1 == WJB_BEGIN_OBJECT && rk2 == WJB_BEGIN_OBJECT)
-	{
-		int         level = 1;
+	if (Max(weight + 1, 1) * DEC_DIGITS + dscale + DEC_DIGITS + 2 > NUMERIC_OUT_BUFSIZE)
+		goto fallback;
 
-		/*
-		 * Append the all tokens from v1 to res, exept
-		 * last WJB_END_OBJECT (because res will not be finished yet).
-		 */
-		(void) pushJsonbValue(state, r1, NULL);
-		while((r1 = JsonbIteratorNext(it1, &v1, false)) != 0)
-		{
-			if (r1 == WJB_BEGIN_OBJECT) {
-				++level;
-			}
-			else if (r1 == WJB_END_OBJECT) {
-				--level;
-			}
+	/* The rest is the same as get_str_from_var in numeric.c */
+	if (neg)
+		*cp++ = '-';
 
-			if (level != 0) {
-				res = pushJsonbValue(state, r1, r1 < WJB_BEGIN_ARRAY ? &v1 : NULL);
-			}
+	if (weight < 0)
+	{
+		d = weight + 1;
+		*cp++ = '0';
+	}
+	else
+	{
+		for (d = 0; d <= weight; d++)
+		{
+			NumericDigit	dig = (d < ndigits) ? digits[d] : 0;
+			NumericDigit	d1;
+			/* In the first digit, suppress extra leading decimal zeroes */
+			bool			putit = (d > 0);
+
+			d1 = dig / 1000;
+			dig -= d1 * 1000;
+			putit |= (d1 > 0);
+			if (putit)
+				*cp++ = d1 + '0';
+			d1 = dig / 100;
+			dig -= d1 * 100;
+			putit |= (d1 > 0);
+			if (putit)
+				*cp++ = d1 + '0';
+			d1 = dig / 10;
+			dig -= d1 * 10;
+			putit |= (d1 > 0);
+			if (putit)
+				*cp++ = d1 + '0';
+			*cp++ = dig + '0';
 		}
+	}
 
-		/*
-		 * Append the all tokens from v2 to res, include
-		 * last WJB_END_OBJECT (the concatenation will be completed). 
-		 */
-		while((r2 = JsonbIteratorNext(it2, &v2, false)) != 0)
+	if (dscale > 0)
+	{
+		*cp++ = '.';
+		endcp = cp + dscale;
+		for (i = 0; i < dscale; d++, i += DEC_DIGITS)
 		{
-			res = pushJsonbValue(state, r2, r2 < WJB_BEGIN_ARRAY ? &v2 : NULL);
+			NumericDigit	dig = (d >= 0 && d < ndigits) ? digits[d] : 0;
+			NumericDigit	d1;
+
+			d1 = dig / 1000;
+			dig -= d1 * 1000;
+			*cp++ = d1 + '0';
+			d1 = dig / 100;
+			dig -= d1 * 100;
+			*cp++ = d1 + '0';
+			d1 = dig / 10;
+			dig -= d1 * 10;
+			*cp++ = d1 + '0';
+			*cp++ = dig + '0';
 		}
+		cp = endcp;
 	}
-	/*
-	 * Both elements are arrays (either can be scalar).
-	 */
-	else if (rk1 == WJB_BEGIN_ARRAY && rk2 == WJB_BEGIN_ARRAY)
+
+	put_bytes(out, buf, cp - buf);
+	return;
+
+fallback:
+	{
+		char   *str = DatumGetCString(DirectFunctionCall1(numeric_out,
+														  NumericGetDatum(num)));
+
+		put_bytes(out, str, strlen(str));
+		pfree(str);
+	}
+}
+
+
+/*
+ * put_escaped_string:
+ * Quote and escape a string the same way as escape_json does, but without
+ * a NUL-terminated copy of it. Runs of characters, which don't need
+ * escaping, are found by findJsonEscape and appended at once.
+ */
+static void
+put_escaped_string(JsonbOutput *out, const char *str, int len)
+{
+	const char *end = str + len;
+	const char *p = str;
+
+	put_char(out, '"');
+
+	while (p < end)
 	{
-		res = pushJsonbValue(state, r1, NULL);
-		for(;;)
+		int				run = findJsonEscape(p, end - p);
+		unsigned char	c;
+		char			esc[8];
+		int				esclen = 2;
+
+		if (run > 0)
+			put_bytes(out, p, run);
+
+		p += run;
+		if (p == end)
+			break;
+
+		c = (unsigned char) *p++;
+
+		esc[0] = '\\';
+		switch (c)
 		{
-			r1 = JsonbIteratorNext(it1, &v1, true);
-			if (r1 == WJB_END_OBJECT || r1 == WJB_END_ARRAY)
+			case '\b':
+				esc[1] = 'b';
+				break;
+			case '\f':
+				esc[1] = 'f';
+				break;
+			case '\n':
+				esc[1] = 'n';
+				break;
+			case '\r':
+				esc[1] = 'r';
+				break;
+			case '\t':
+				esc[1] = 't';
+				break;
+			case '"':
+				esc[1] = '"';
+				break;
+			case '\\':
+				esc[1] = '\\';
+				break;
+			default:
+				esclen = snprintf(esc, sizeof(esc), "\\u%04x", (int) c);
 				break;
-			Assert(r1 == WJB_KEY || r1 == WJB_VALUE || r1 == WJB_ELEM);
-			pushJsonbValue(state, r1, &v1);
 		}
 
-		while((r2 = JsonbIteratorNext(it2, &v2, true)) != 0)
-		{
-			if (!(r2 == WJB_END_OBJECT || r2 == WJB_END_ARRAY))
-			{
-				if (rk1 == WJB_BEGIN_OBJECT)
-				{
-					pushJsonbValue(state, WJB_KEY, NULL);
-					r2 = JsonbIteratorNext(it2, &v2, true);
-					Assert(r2 == WJB_ELEM);
-					pushJsonbValue(state, WJB_VALUE, &v2);
-				}
-				else
-				{
-					pushJsonbValue(state, WJB_ELEM, &v2);
-				}
-			}
-		}
+		put_bytes(out, esc, esclen);
+	}
+
+	put_char(out, '"');
+}
+
 
+/*
+ * Iterate over all jsonb objects and merge them into one.
+ * The logic of this function copied from the same hstore function,
+ * except the cases, when it1 & it2 are both objects or both arrays.
+ * In that case the result is written by concatJsonbObjects or
+ * concatJsonbArrays.
+ */
+void
+IteratorConcat(JsonbIterator **it1, JsonbIterator **it2, JsonbWriter *w)
+{
+	uint32          rk1, rk2;
+	JsonbValue      v1, v2;
 
-		res = pushJsonbValue(state,
-							(rk1 == WJB_BEGIN_OBJECT) ? WJB_END_OBJECT : WJB_END_ARRAY,
-							 NULL /* signal to sort */ );
+	rk1 = JsonbIteratorNext(it1, &v1, false);
+	rk2 = JsonbIteratorNext(it2, &v2, false);
+
+	/*
+	 * Both elements are objects.
+	 */
+	if (rk1 == WJB_BEGIN_OBJECT && rk2 == WJB_BEGIN_OBJECT)
+	{
+		concatJsonbObjects(it1, it2, v1.val.object.nPairs + v2.val.object.nPairs,
+						   JSONB_CONCAT_SHALLOW, w);
+	}
+	/*
+	 * Both elements are arrays (either can be scalar).
+	 */
+	else if (rk1 == WJB_BEGIN_ARRAY && rk2 == WJB_BEGIN_ARRAY)
+	{
+		concatJsonbArrays(it1, it2, v1.val.array.nElems + v2.val.array.nElems, w);
 	}
 	/*
 	 *  One of the elements is object, another is array.
@@ -321,301 +691,569 @@ IteratorConcat(JsonbIterator **it1, JsonbIterator **it2,
 	{
 		JsonbIterator** it_array = choice_array(rk1, it1, it2);
 		JsonbIterator** it_object = choice_object(rk1, it1, it2);
+		JsonbValue	   *object = choice_object(rk1, &v1, &v2);
+		JsonbValue		array = *(choice_array(rk1, &v1, &v2));
 
 		bool prepend = (rk1 == WJB_BEGIN_OBJECT) ? true : false;
 
-		pushJsonbValue(state, WJB_BEGIN_ARRAY, NULL);
+		array.val.array.nElems++;
+		pushJsonbWriter(w, WJB_BEGIN_ARRAY, &array);
 		if (prepend)
 		{
-			pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
-			walkJsonb(it_object, state, false);
+			beginCopiedObject(it_object, object, w);
+			walkJsonb(it_object, w, false);
 
-			res = walkJsonb(it_array, state, false);
+			walkJsonb(it_array, w, false);
 		}
 		else
 		{
-			walkJsonb(it_array, state, true);
+			walkJsonb(it_array, w, true);
 
-			pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
-			walkJsonb(it_object, state, false);
+			beginCopiedObject(it_object, object, w);
+			walkJsonb(it_object, w, false);
 
-			res = pushJsonbValue(state, WJB_END_ARRAY, NULL);
+			pushJsonbWriter(w, WJB_END_ARRAY, NULL);
 		}
 	}
 	else
 	{
 		elog(ERROR, "invalid concatnation of jsonb objects");
 	}
-
-	return res;
 }
 
 /*
- * One of possible conditions for walkJsonb.
- * This condition implies, that entire Jsonb should be converted.
+ * Begin the object, which is copied from the iterator as a whole, all its
+ * keys are kept, so the room for them is reserved in advance.
  */
-bool
-untilLast(JsonbParseState **state, JsonbValue *v, uint32 token, uint32 level)
+static void
+beginCopiedObject(JsonbIterator **it, JsonbValue *object, JsonbWriter *w)
 {
-	return level == 0;
+	pushJsonbWriter(w, WJB_BEGIN_OBJECT, object);
+	expectJsonbWriterKeys(w, getJsonbOffset((*it)->container,
+											object->val.object.nPairs));
 }
 
-
 /*
- * walkJsonb:
- * Copy elements from the iterator to the parse state
- * stopping at level zero if required.
+ * concatJsonbObjects:
+ * Merge two objects in one pass. The iterators must be positioned right after
+ * WJB_BEGIN_OBJECT. Keys of both objects are already sorted, so it's just
+ * a merge of two sorted lists, where the value from the second object wins
+ * for equal keys. The result pairs are sorted and unique, so they're written
+ * as they come, nested values are copied as is.
+ * If mode is not JSONB_CONCAT_SHALLOW, two containers under the same key
+ * are merged recursively by deepConcatContainers.
  */
-JsonbValue*
-walkJsonb(JsonbIterator **it, JsonbParseState **state, bool stop_at_level_zero)
+void
+concatJsonbObjects(JsonbIterator **it1, JsonbIterator **it2, uint32 npairs,
+				   int mode, JsonbWriter *w)
 {
-	uint32          r, level = 1;
-	JsonbValue      v, *res = NULL;
+	JsonbValue	k1, k2, v;
+	uint32		r1, r2;
 
-	while((r = JsonbIteratorNext(it, &v, false)) != WJB_DONE)
+	v.type = jbvObject;
+	v.val.object.nPairs = npairs;
+	pushJsonbWriter(w, WJB_BEGIN_OBJECT, &v);
+	expectMergedKeys((*it1)->container, (*it2)->container, npairs, w);
+
+	r1 = JsonbIteratorNext(it1, &k1, true);
+	r2 = JsonbIteratorNext(it2, &k2, true);
+
+	while (r1 == WJB_KEY || r2 == WJB_KEY)
 	{
-		if (r == WJB_BEGIN_OBJECT || r == WJB_BEGIN_ARRAY) {
-			++level;
-		}
-		else if (r == WJB_END_OBJECT || r == WJB_END_ARRAY) {
-			--level;
+		int		cmp;
+
+		if (r1 != WJB_KEY)
+			cmp = 1;
+		else if (r2 != WJB_KEY)
+			cmp = -1;
+		else
+			cmp = compareJsonbKeys(k1.val.string.val, k1.val.string.len,
+								   k2.val.string.val, k2.val.string.len);
+
+		if (cmp < 0)
+		{
+			pushJsonbWriter(w, WJB_KEY, &k1);
+			(void) JsonbIteratorNext(it1, &v, true);
+			pushJsonbWriter(w, WJB_VALUE, &v);
+			r1 = JsonbIteratorNext(it1, &k1, true);
 		}
+		else
+		{
+			JsonbValue	v1;
 
-		if(stop_at_level_zero && level == 0)
-			break;
+			if (cmp == 0)
+			{
+				/* the value will be overridden */
+				(void) JsonbIteratorNext(it1, &v1, true);
+				r1 = JsonbIteratorNext(it1, &k1, true);
+			}
 
-		res = pushJsonbValue(state, r, r < WJB_BEGIN_ARRAY ? &v : NULL);
+			pushJsonbWriter(w, WJB_KEY, &k2);
+			(void) JsonbIteratorNext(it2, &v, true);
+
+			if (!(cmp == 0 && mode != JSONB_CONCAT_SHALLOW &&
+				  v1.type == jbvBinary && v.type == jbvBinary &&
+				  deepConcatContainers(v1.val.binary.data, v.val.binary.data,
+									   mode, w)))
+				pushJsonbWriter(w, WJB_VALUE, &v);
+
+			r2 = JsonbIteratorNext(it2, &k2, true);
+		}
 	}
 
-	return res;
+	Assert(r1 == WJB_END_OBJECT && r2 == WJB_END_OBJECT);
+
+	pushJsonbWriter(w, WJB_END_OBJECT, NULL);
 }
 
 /*
- * setPath:
- * Recursive replacement/creation function for jsonb_set.
- * Replace/create value of jsonb key or jsonb element, which can be found by the specified path on the specific level.
- * For jbvArray level is the current element, for jbvObject is the current nesting level.
- * For each recursion step, level value will be incremented, and an array element or object key will be replaces or created,
- * if current level is path_len - 1 (it does mean, that we've reached the last element in the path).
- * If indexes will be used, the same rules implied as for jsonb_delete_idx (negative indexing and edge cases)
+ * Reserve the room for the keys of two merged objects, equal keys are
+ * counted once. Only keys of the containers are compared, values are not
+ * touched.
  */
-JsonbValue*
-setPath(JsonbIterator **it, Datum *path_elems,
-			  bool *path_nulls, int path_len,
-			  JsonbParseState  **st, int level, Jsonb *newval, bool create)
+static void
+expectMergedKeys(JsonbContainer *c1, JsonbContainer *c2, uint32 npairs,
+				 JsonbWriter *w)
 {
-	JsonbValue  v, *res = NULL;
-	int         r;
-
-	r = JsonbIteratorNext(it, &v, false);
-	if (path_nulls[level])
-		elog(ERROR, "path element at the position %d is NULL", level + 1);
-
-	switch (r)
+	uint32		n1 = c1->header & JB_CMASK;
+	uint32		n2 = c2->header & JB_CMASK;
+	char	   *base1 = (char *) (c1->children + n1 * 2);
+	char	   *base2 = (char *) (c2->children + n2 * 2);
+	uint32		off1 = 0,
+				off2 = 0,
+				i1 = 0,
+				i2 = 0;
+	uint32		nresult = 0;
+	int			keyslen = 0;
+
+	while (i1 < n1 && i2 < n2)
 	{
-		case WJB_BEGIN_ARRAY:
-			(void) pushJsonbValue(st, r, NULL);
-			setPathArray(it, path_elems, path_nulls, path_len, st, level,
-							 newval, v.val.array.nElems, create);
-			r = JsonbIteratorNext(it, &v, false);
-			Assert(r == WJB_END_ARRAY);
-			res = pushJsonbValue(st, r, NULL);
+		uint32		len1 = getJsonbLength(c1, i1);
+		uint32		len2 = getJsonbLength(c2, i2);
+		int			cmp = compareJsonbKeys(base1 + off1, len1, base2 + off2, len2);
 
-			break;
-		case WJB_BEGIN_OBJECT:
-			(void) pushJsonbValue(st, r, NULL);
-			setPathObject(it, path_elems, path_nulls, path_len, st, level,
-							  newval, v.val.object.nPairs, create);
-			r = JsonbIteratorNext(it, &v, true);
-			Assert(r == WJB_END_OBJECT);
-			res = pushJsonbValue(st, r, NULL);
+		if (cmp <= 0)
+		{
+			off1 += len1;
+			i1++;
+		}
+		if (cmp >= 0)
+		{
+			off2 += len2;
+			i2++;
+		}
 
-			break;
-		case WJB_ELEM:
-		case WJB_VALUE:
-			res = pushJsonbValue(st, r, &v);
-			break;
-		default:
-			elog(PANIC, "impossible state");
+		keyslen += (cmp <= 0) ? len1 : len2;
+		nresult++;
 	}
 
-	return res;
+	/* the rest of keys of either object */
+	keyslen += getJsonbOffset(c1, n1) - off1 + getJsonbOffset(c2, n2) - off2;
+	nresult += (n1 - i1) + (n2 - i2);
+
+	if (nresult != npairs)
+		expectJsonbWriterValues(w, nresult);
+	expectJsonbWriterKeys(w, keyslen);
 }
 
 /*
- * Object walker for setPath
+ * concatJsonbArrays:
+ * Append elements of the second array to the first one. The iterators must be
+ * positioned right after WJB_BEGIN_ARRAY. Nested elements come as jbvBinary,
+ * so their containers are copied as is into the result.
  */
-static void
-setPathObject(JsonbIterator **it, Datum *path_elems, bool *path_nulls,
-				  int path_len, JsonbParseState **st, int level,
-				  Jsonb *newval, uint32	npairs, bool create)
+void
+concatJsonbArrays(JsonbIterator **it1, JsonbIterator **it2, uint32 nelems,
+				  JsonbWriter *w)
 {
 	JsonbValue	v;
-	int			i;
-	JsonbValue	k;
-	bool		done = false;
 
-	if (level >= path_len || path_nulls[level])
-		done = true;
+	v.type = jbvArray;
+	v.val.array.nElems = nelems;
+	v.val.array.rawScalar = false;
+	pushJsonbWriter(w, WJB_BEGIN_ARRAY, &v);
 
-	/* empty object is a special case for create */
-	if ((npairs == 0) && create && (level == path_len - 1))
-	{
-		JsonbValue	newkey;
+	while (JsonbIteratorNext(it1, &v, true) == WJB_ELEM)
+		pushJsonbWriter(w, WJB_ELEM, &v);
+
+	while (JsonbIteratorNext(it2, &v, true) == WJB_ELEM)
+		pushJsonbWriter(w, WJB_ELEM, &v);
 
-		newkey.type = jbvString;
-		newkey.val.string.len = VARSIZE_ANY_EXHDR(path_elems[level]);
-		newkey.val.string.val = VARDATA_ANY(path_elems[level]);
+	pushJsonbWriter(w, WJB_END_ARRAY, NULL);
+}
 
-		(void) pushJsonbValue(st, WJB_KEY, &newkey);
-		addJsonbToParseState(st, newval);
+/*
+ * unionJsonbArrays:
+ * The same as concatJsonbArrays, but elements of the second array, which are
+ * already present in the result, are skipped.
+ */
+void
+unionJsonbArrays(JsonbIterator **it1, JsonbIterator **it2, uint32 nelems,
+				 JsonbWriter *w)
+{
+	JsonbUnionSet set;
+	JsonbValue	v;
+	int			n = 0;
+
+	set.elems = palloc(sizeof(JsonbValue) * Max(nelems, 1));
+	set.containers = palloc(sizeof(int) * Max(nelems, 1));
+	set.ncontainers = 0;
+	set.hashsize = 16;
+	while (set.hashsize < nelems * 2)
+		set.hashsize *= 2;
+	set.hashslots = palloc(sizeof(int) * set.hashsize);
+	memset(set.hashslots, -1, sizeof(int) * set.hashsize);
+
+	v.type = jbvArray;
+	v.val.array.nElems = nelems;
+	v.val.array.rawScalar = false;
+	pushJsonbWriter(w, WJB_BEGIN_ARRAY, &v);
+
+	/* duplicates of the first array are kept */
+	while (JsonbIteratorNext(it1, &set.elems[n], true) == WJB_ELEM)
+	{
+		pushJsonbWriter(w, WJB_ELEM, &set.elems[n]);
+		(void) addUnionElem(&set, n++);
 	}
 
-	/* iterate over object keys */
-	for (i = 0; i < npairs; i++)
+	while (JsonbIteratorNext(it2, &set.elems[n], true) == WJB_ELEM)
 	{
-		int		r = JsonbIteratorNext(it, &k, true);
-		Assert(r == WJB_KEY);
+		if (addUnionElem(&set, n))
+			pushJsonbWriter(w, WJB_ELEM, &set.elems[n++]);
+	}
+
+	pushJsonbWriter(w, WJB_END_ARRAY, NULL);
+	pfree(set.elems);
+	pfree(set.containers);
+	pfree(set.hashslots);
+}
+
+/*
+ * Remember the n-th element in the set, unless there is an equal one already.
+ * Returns false in the latter case.
+ */
+static bool
+addUnionElem(JsonbUnionSet *set, int n)
+{
+	JsonbValue *v = &set->elems[n];
+	uint32		mask = set->hashsize - 1;
+	uint32		slot = 0;
+	int			i;
 
-		if (!done &&
-			k.val.string.len == VARSIZE_ANY_EXHDR(path_elems[level]) &&
-			memcmp(k.val.string.val, VARDATA_ANY(path_elems[level]),
-				   k.val.string.len) == 0)
+	if (v->type == jbvBinary)
+	{
+		for (i = 0; i < set->ncontainers; i++)
 		{
-			/*
-			 * The current path item was found.
-			 * If we reached the end of path, current element will be replaced
-			 * Otherwise level value will be incremented, and the next step of
-			 * recursion will be started.
+			if (equalJsonbValues(&set->elems[set->containers[i]], v))
+				return false;
+		}
+
+		set->containers[set->ncontainers++] = n;
+		return true;
+	}
+
+	JsonbHashScalarValue(v, &slot);
+	slot &= mask;
+
+	while (set->hashslots[slot] >= 0)
+	{
+		if (equalJsonbValues(&set->elems[set->hashslots[slot]], v))
+			return false;
+
+		slot = (slot + 1) & mask;
+	}
+
+	set->hashslots[slot] = n;
+	return true;
+}
+
+/*
+ * deepConcatContainers:
+ * Recursive merge of two containers for jsonb_deep_concat.
+ * Objects are merged by concatJsonbObjects, which calls this function again
+ * for the values under the same key. Arrays are concatenated according to
+ * the mode, and the second container simply wins in all other cases.
+ * Returns false without writing anything, if the result is the second
+ * container as is.
+ */
+bool
+deepConcatContainers(JsonbContainer *c1, JsonbContainer *c2, int mode,
+					 JsonbWriter *w)
+{
+	JsonbIterator	*it1 = JsonbIteratorInit(c1);
+	JsonbIterator	*it2 = JsonbIteratorInit(c2);
+	JsonbValue		v1, v2;
+	uint32			r1, r2;
+
+	check_stack_depth();
+
+	r1 = JsonbIteratorNext(&it1, &v1, false);
+	r2 = JsonbIteratorNext(&it2, &v2, false);
+
+	if (r1 == WJB_BEGIN_OBJECT && r2 == WJB_BEGIN_OBJECT)
+	{
+		concatJsonbObjects(&it1, &it2,
+						   v1.val.object.nPairs + v2.val.object.nPairs,
+						   mode, w);
+		return true;
+	}
+
+	if (r1 == WJB_BEGIN_ARRAY && r2 == WJB_BEGIN_ARRAY &&
+		!v1.val.array.rawScalar && !v2.val.array.rawScalar)
+	{
+		uint32		nelems = v1.val.array.nElems + v2.val.array.nElems;
+
+		if (mode == JSONB_CONCAT_APPEND)
+		{
+			concatJsonbArrays(&it1, &it2, nelems, w);
+			return true;
+		}
+		else if (mode == JSONB_CONCAT_UNION)
+		{
+			unionJsonbArrays(&it1, &it2, nelems, w);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * equalJsonbValues:
+ * Check equality of two values, which come from iterators with skipNested,
+ * i.e. scalars or jbvBinary.
+ */
+bool
+equalJsonbValues(JsonbValue *a, JsonbValue *b)
+{
+	if (a->type != b->type)
+		return false;
+
+	switch (a->type)
+	{
+		case jbvNull:
+			return true;
+		case jbvString:
+			return a->val.string.len == b->val.string.len &&
+				memcmp(a->val.string.val, b->val.string.val,
+					   a->val.string.len) == 0;
+		case jbvNumeric:
+			return DatumGetBool(DirectFunctionCall2(numeric_eq,
+								PointerGetDatum(a->val.numeric),
+								PointerGetDatum(b->val.numeric)));
+		case jbvBool:
+			return a->val.boolean == b->val.boolean;
+		case jbvBinary:
+			return compareJsonbContainers(a->val.binary.data,
+										  b->val.binary.data) == 0;
+		default:
+			elog(ERROR, "unknown jsonb value type");
+	}
+
+	return false;
+}
+
+/*
+ * One of possible conditions for walkJsonb.
+ * This condition implies, that entire Jsonb should be converted.
+ */
+bool
+untilLast(JsonbParseState **state, JsonbValue *v, uint32 token, uint32 level)
+{
+	return level == 0;
+}
+
+
+/*
+ * walkJsonb:
+ * Copy the rest of the current container from the iterator to the writer,
+ * stopping before its end if required. Nested containers are copied as is.
+ */
+void
+walkJsonb(JsonbIterator **it, JsonbWriter *w, bool stop_at_level_zero)
+{
+	uint32          r;
+	JsonbValue      v;
+
+	while((r = JsonbIteratorNext(it, &v, true)) != WJB_DONE)
+	{
+		if (stop_at_level_zero && (r == WJB_END_OBJECT || r == WJB_END_ARRAY))
+			break;
+
+		pushJsonbWriter(w, r, &v);
+	}
+}
+
+/*
+ * setPath:
+ * Recursive replacement/creation function for jsonb_set.
+ * Replace/create value of jsonb key or jsonb element, which can be found by the specified path on the specific level.
+ * For jbvArray level is the current element, for jbvObject is the current nesting level.
+ * For each recursion step, level value will be incremented, and an array element or object key will be replaces or created,
+ * if current level is path_len - 1 (it does mean, that we've reached the last element in the path).
+ * If indexes will be used, the same rules implied as for jsonb_delete_idx (negative indexing and edge cases)
+ * The result is written by the writer in the same pass.
+ */
+void
+setPath(JsonbIterator **it, JsonbPath *path, JsonbWriter *w, int level,
+		JsonbValue *newval, bool create)
+{
+	uint32		nvalues;
+
+	if (path->nulls[level])
+		elog(ERROR, "path element at the position %d is NULL", level + 1);
+
+	switch (enterPathValue(it, w, &nvalues))
+	{
+		case WJB_BEGIN_ARRAY:
+			setPathArray(it, path, w, level, newval, nvalues, create);
+			leavePathContainer(it, w);
+			break;
+		case WJB_BEGIN_OBJECT:
+			setPathObject(it, path, w, level, newval, nvalues, create);
+			leavePathContainer(it, w);
+			break;
+	}
+}
+
+/*
+ * Object walker for setPath
+ *
+ * The key of the current path element is located by findJsonbKey, so there
+ * is no need to compare it with every key of the object. If the key is
+ * missing and should be created, it's placed at the position returned by the
+ * same lookup to keep the keys sorted.
+ */
+static void
+setPathObject(JsonbIterator **it, JsonbPath *path, JsonbWriter *w,
+			  int level, JsonbValue *newval, uint32 npairs, bool create)
+{
+	int			i;
+	JsonbValue	k;
+	int			found = -1;
+	int			insert_at = npairs;
+	bool		add = false;
+	int			keyslen;
+
+	if (level < path->len && !path->nulls[level])
+	{
+		found = findJsonbKey((*it)->container,
+							 path->keys[level], path->keylens[level],
+							 &insert_at);
+		add = (found < 0 && create && level == path->len - 1);
+	}
+
+	/* the key is either added or deleted */
+	keyslen = getJsonbOffset((*it)->container, npairs);
+	if (add)
+	{
+		expectJsonbWriterValues(w, npairs + 1);
+		keyslen += path->keylens[level];
+	}
+	else if (found >= 0 && newval == NULL && level == path->len - 1)
+	{
+		expectJsonbWriterValues(w, npairs - 1);
+		keyslen -= getJsonbLength((*it)->container, found);
+	}
+	expectJsonbWriterKeys(w, keyslen);
+
+	/* iterate over object keys */
+	for (i = 0; i < npairs; i++)
+	{
+		int		r;
+
+		if (add && i == insert_at)
+		{
+			pushJsonbWriterKey(w, path->keys[level], path->keylens[level]);
+			pushJsonbWriter(w, WJB_VALUE, newval);
+		}
+
+		r = JsonbIteratorNext(it, &k, true);
+		Assert(r == WJB_KEY);
+
+		if (i == found)
+		{
+			/*
+			 * The current path item was found.
+			 * If we reached the end of path, current element will be replaced
+			 * Otherwise level value will be incremented, and the next step of
+			 * recursion will be started.
 			 */
-			if (level == path_len - 1)
+			if (level == path->len - 1)
 			{
-				r = JsonbIteratorNext(it, &v, true);		/* skip */
+				skipPathValue(it);
 				if (newval != NULL)
 				{
-					(void) pushJsonbValue(st, WJB_KEY, &k);
-					addJsonbToParseState(st, newval);
+					pushJsonbWriter(w, WJB_KEY, &k);
+					pushJsonbWriter(w, WJB_VALUE, newval);
 				}
-				done = true;
 			}
 			else
 			{
-				(void) pushJsonbValue(st, r, &k);
-				setPath(it, path_elems, path_nulls, path_len,
-							st, level + 1, newval, create);
+				pushJsonbWriter(w, r, &k);
+				setPath(it, path, w, level + 1, newval, create);
 			}
 		}
 		else
 		{
-			if (create && !done && level == path_len - 1 && i == npairs - 1)
-			{
-				JsonbValue new = k;
-				new.val.string.len = VARSIZE_ANY_EXHDR(path_elems[level]);
-				new.val.string.val = VARDATA_ANY(path_elems[level]);
-
-				(void) pushJsonbValue(st, WJB_KEY, &new);
-				addJsonbToParseState(st, newval);
-			}
-
-			/* We are out of the specified path, skip the rest of elements */
-			(void) pushJsonbValue(st, r, &k);
-			r = JsonbIteratorNext(it, &v, false);
-
-			(void) pushJsonbValue(st, r, r < WJB_BEGIN_ARRAY ? &v : NULL);
-			if (r == WJB_BEGIN_ARRAY || r == WJB_BEGIN_OBJECT)
-			{
-				int		walking_level = 1;
-
-				while (walking_level != 0)
-				{
-					r = JsonbIteratorNext(it, &v, false);
-
-					if (r == WJB_BEGIN_ARRAY || r == WJB_BEGIN_OBJECT)
-					{
-						++walking_level;
-					}
-					if (r == WJB_END_ARRAY || r == WJB_END_OBJECT)
-					{
-						--walking_level;
-					}
-
-					(void) pushJsonbValue(st, r, r < WJB_BEGIN_ARRAY ? &v : NULL);
-				}
-			}
+			/* We are out of the specified path, keep the value as is */
+			copyPathPair(it, w, &k);
 		}
 	}
+
+	/* new key is greater than all existing ones, or the object is empty */
+	if (add && insert_at == npairs)
+	{
+		pushJsonbWriterKey(w, path->keys[level], path->keylens[level]);
+		pushJsonbWriter(w, WJB_VALUE, newval);
+	}
 }
 
 /*
  * Array walker for setPath
  */
 static void
-setPathArray(JsonbIterator **it, Datum *path_elems, bool *path_nulls,
-				 int path_len, JsonbParseState **st, int level,
-				 Jsonb *newval, uint32 nelems, bool create)
+setPathArray(JsonbIterator **it, JsonbPath *path, JsonbWriter *w,
+			 int level, JsonbValue *newval, uint32 nelems, bool create)
 {
-	JsonbValue	v;
 	int			idx,
 				i;
-	char	   *badp;
 	bool		done = false;
 
 	/* If we can't convert path element to integer index,
 	 * the last element will be used.
 	 */
-	if (level < path_len && !path_nulls[level])
-	{
-		char	   *c = TextDatumGetCString(path_elems[level]);
-		long		lindex;
-
-		errno = 0;
-		lindex = strtol(c, &badp, 10);
-		if (errno != 0 || badp == c || *badp != '\0' || lindex > INT_MAX ||
-			lindex < INT_MIN)
-			elog(ERROR, "path element at the position %d is not an integer",
-						level + 1);
-		else
-			idx = lindex;
-	}
-	/* Otherwise we should take care about negative indexes,
-	 * it implies the countdown from the last element.
-	 * If -idx is more, than number of elements - the last element will be used
-	 */
+	if (level < path->len && !path->nulls[level])
+		idx = resolveArrayIndex(getPathArrayIndex(path, level), nelems);
 	else
-	{
 		idx = nelems;
-	}
 
-	if (idx < 0)
+	/* the element is either deleted or added at the end of the path */
+	if (level == path->len - 1)
 	{
-		if (-idx > nelems)
-			idx = -1;
-		else
-			idx = nelems + idx;
+		if (idx >= 0 && idx < nelems && newval == NULL)
+			expectJsonbWriterValues(w, nelems - 1);
+		else if ((idx < 0 || idx >= nelems) && create)
+			expectJsonbWriterValues(w, nelems + 1);
 	}
 
-	if (idx > 0 && idx > nelems)
-		idx = nelems;
-
 	/*
 	 * if we're creating, and idx == -1, we prepend the new value to the array
 	 * also if the array is empty - in which case we don't really care what the
 	 * idx value is
 	 */
 
-	if ((idx == -1 || nelems == 0) && create && (level == path_len - 1))
+	if ((idx == -1 || nelems == 0) && create && (level == path->len - 1))
 	{
 		Assert(newval != NULL);
-		addJsonbToParseState(st, newval);
+		pushJsonbWriter(w, WJB_ELEM, newval);
 		done = true;
 	}
 
 	/* iterate over the array elements */
 	for (i = 0; i < nelems; i++)
 	{
-		int		r;
-
-		if (i == idx && level < path_len)
+		if (i == idx && level < path->len)
 		{
 			/*
 			 * The current path item was found.
@@ -623,50 +1261,26 @@ setPathArray(JsonbIterator **it, Datum *path_elems, bool *path_nulls,
 			 * Otherwise level value will be incremented, and the next step of
 			 * recursion will be started.
 			 */
-			if (level == path_len - 1)
+			if (level == path->len - 1)
 			{
-				r = JsonbIteratorNext(it, &v, true);		/* skip */
+				skipPathValue(it);
 				if (newval != NULL)
 				{
-					addJsonbToParseState(st, newval);
+					pushJsonbWriter(w, WJB_ELEM, newval);
 				}
 				done = true;
 			}
 			else
-				(void) setPath(it, path_elems, path_nulls, path_len,
-								   st, level + 1, newval, create);
+				setPath(it, path, w, level + 1, newval, create);
 		}
 		else
 		{
-			/* We are out of the specified path, skip the rest of elements */
-			r = JsonbIteratorNext(it, &v, false);
-
-			(void) pushJsonbValue(st, r, r < WJB_BEGIN_ARRAY ? &v : NULL);
-
-			if (r == WJB_BEGIN_ARRAY || r == WJB_BEGIN_OBJECT)
-			{
-				int		walking_level = 1;
+			/* We are out of the specified path, keep the element as is */
+			copyPathValue(it, w);
 
-				while (walking_level != 0)
-				{
-					r = JsonbIteratorNext(it, &v, false);
-
-					if (r == WJB_BEGIN_ARRAY || r == WJB_BEGIN_OBJECT)
-					{
-						++walking_level;
-					}
-					if (r == WJB_END_ARRAY || r == WJB_END_OBJECT)
-					{
-						--walking_level;
-					}
-
-					(void) pushJsonbValue(st, r, r < WJB_BEGIN_ARRAY ? &v : NULL);
-				}
-			}
-
-			if (create && !done && level == path_len - 1 && i == nelems - 1)
+			if (create && !done && level == path->len - 1 && i == nelems - 1)
 			{
-				addJsonbToParseState(st, newval);
+				pushJsonbWriter(w, WJB_ELEM, newval);
 			}
 
 		}
@@ -675,52 +1289,958 @@ setPathArray(JsonbIterator **it, Datum *path_elems, bool *path_nulls,
 
 
 /*
- * Add values from the jsonb to the parse state.
- *
- * If the parse state container is an object, the jsonb is pushed as
- * a value, not a key.
- *
- * This needs to be done using an iterator because pushJsonbValue doesn't
- * like getting jbvBinary values, so we can't just push jb as a whole.
+ * enterPathValue:
+ * Write the beginning of the next value of the iterator, as setPath and
+ * modifyPath follow the path into it. A scalar is written as a whole. For
+ * a container the number of its values is returned in nvalues, the values
+ * are written by the caller, and the container is closed by
+ * leavePathContainer.
  */
-void
-addJsonbToParseState(JsonbParseState **jbps, Jsonb * jb)
+static int
+enterPathValue(JsonbIterator **it, JsonbWriter *w, uint32 *nvalues)
+{
+	JsonbValue	v;
+	int			r;
+
+	r = JsonbIteratorNext(it, &v, false);
+
+	switch (r)
+	{
+		case WJB_BEGIN_ARRAY:
+			*nvalues = v.val.array.nElems;
+			break;
+		case WJB_BEGIN_OBJECT:
+			*nvalues = v.val.object.nPairs;
+			break;
+		case WJB_ELEM:
+		case WJB_VALUE:
+			*nvalues = 0;
+			break;
+		default:
+			elog(PANIC, "impossible state");
+	}
+
+	pushJsonbWriter(w, r, &v);
+
+	return r;
+}
+
+
+/*
+ * Close the container opened by enterPathValue, all its values must be
+ * already passed.
+ */
+static void
+leavePathContainer(JsonbIterator **it, JsonbWriter *w)
 {
+	JsonbValue	v;
+	int			r;
+
+	r = JsonbIteratorNext(it, &v, true);
+	Assert(r == WJB_END_ARRAY || r == WJB_END_OBJECT);
+	pushJsonbWriter(w, r, NULL);
+}
+
+
+/*
+ * Keep the next element or value as is, a nested container comes as
+ * jbvBinary and is copied without decoding.
+ */
+static void
+copyPathValue(JsonbIterator **it, JsonbWriter *w)
+{
+	JsonbValue	v;
+	int			r;
+
+	r = JsonbIteratorNext(it, &v, true);
+	pushJsonbWriter(w, r, &v);
+}
+
+
+/*
+ * The same as copyPathValue for the key, which is already read, and its value.
+ */
+static void
+copyPathPair(JsonbIterator **it, JsonbWriter *w, JsonbValue *key)
+{
+	pushJsonbWriter(w, WJB_KEY, key);
+	copyPathValue(it, w);
+}
+
 
-	JsonbIterator	*it;
-	JsonbValue		*o = &(*jbps)->contVal;
-	int				type;
-	JsonbValue		v;
+/*
+ * Skip the next element or value, e.g. a replaced or deleted one.
+ */
+static void
+skipPathValue(JsonbIterator **it)
+{
+	JsonbValue	v;
 
-	it = JsonbIteratorInit(&jb->root);
+	(void) JsonbIteratorNext(it, &v, true);
+}
 
-	Assert(o->type == jbvArray || o->type == jbvObject);
 
+/*
+ * JsonbToJsonbValue:
+ * A scalar is unwrapped from its raw scalar array, any other jsonb is
+ * represented as a whole in the form of jbvBinary. The value refers to
+ * the jsonb data, so it's valid as long as the jsonb is.
+ */
+void
+JsonbToJsonbValue(Jsonb *jb, JsonbValue *v)
+{
 	if (JB_ROOT_IS_SCALAR(jb))
 	{
-		(void) JsonbIteratorNext(&it, &v, false); /* skip array header */
-		(void) JsonbIteratorNext(&it, &v, false); /* fetch scalar value */
+		JsonbIterator	*it = JsonbIteratorInit(&jb->root);
 
-		switch (o->type)
-		{
-			case jbvArray:
-				(void) pushJsonbValue(jbps, WJB_ELEM, &v);
-				break;
-			case jbvObject:
-				(void) pushJsonbValue(jbps, WJB_VALUE, &v);
-				break;
-			default:
-				elog(ERROR, "unexpected parent of nested structure");
-		}
+		(void) JsonbIteratorNext(&it, v, false); /* skip array header */
+		(void) JsonbIteratorNext(&it, v, false); /* fetch scalar value */
 	}
 	else
 	{
-		while ((type = JsonbIteratorNext(&it, &v, false)) != WJB_DONE)
-		{
-			if (type == WJB_KEY || type == WJB_VALUE || type == WJB_ELEM)
-				(void) pushJsonbValue(jbps, type, &v);
-			else
-				(void) pushJsonbValue(jbps, type, NULL);
-		}
+		v->type = jbvBinary;
+		v->val.binary.data = &jb->root;
+		v->val.binary.len = VARSIZE(jb) - VARHDRSZ;
+	}
+}
+
+
+/*
+ * Write a new key, e.g. a path element.
+ */
+static void
+pushJsonbWriterKey(JsonbWriter *w, char *key, int keylen)
+{
+	JsonbValue	newkey;
+
+	newkey.type = jbvString;
+	newkey.val.string.len = keylen;
+	newkey.val.string.val = key;
+
+	pushJsonbWriter(w, WJB_KEY, &newkey);
+}
+
+
+/*
+ * parseArrayIndex:
+ * Convert a path element to an array index. Returns false if the path
+ * element is not an integer.
+ */
+bool
+parseArrayIndex(const char *key, int keylen, int *index)
+{
+	char		buf[32];
+	char	   *c = buf;
+	char	   *badp;
+	long		lindex;
+	bool		valid;
+
+	/* strtol needs a terminated string, a short one is copied on the stack */
+	if (keylen < sizeof(buf))
+	{
+		memcpy(buf, key, keylen);
+		buf[keylen] = '\0';
 	}
+	else
+		c = pnstrdup(key, keylen);
+
+	errno = 0;
+	lindex = strtol(c, &badp, 10);
+	valid = !(errno != 0 || badp == c || *badp != '\0' || lindex > INT_MAX ||
+			  lindex < INT_MIN);
+
+	if (c != buf)
+		pfree(c);
+
+	if (valid)
+		*index = lindex;
+	return valid;
+}
+
+
+/*
+ * getArrayIndex:
+ * Convert a path element to an array index. Throws an error if the path
+ * element is not an integer.
+ */
+static int
+getArrayIndex(Datum path_elem, int level)
+{
+	int			index;
+
+	if (!parseArrayIndex(VARDATA_ANY(path_elem), VARSIZE_ANY_EXHDR(path_elem), &index))
+		elog(ERROR, "path element at the position %d is not an integer",
+					level + 1);
+
+	return index;
+}
+
+
+/*
+ * getPathArrayIndex:
+ * The same as getArrayIndex for an element of the prepared path.
+ */
+static int
+getPathArrayIndex(JsonbPath *path, int level)
+{
+	if (!path->isIndex[level])
+		elog(ERROR, "path element at the position %d is not an integer",
+					level + 1);
+
+	return path->indexes[level];
+}
+
+
+/*
+ * resolveArrayIndex:
+ * Position of the path element index in the array of nelems elements. A
+ * negative index counts from the end, and if it's before the first element,
+ * the position is -1. An index after the last element becomes nelems.
+ */
+static int
+resolveArrayIndex(int idx, int nelems)
+{
+	if (idx < 0)
+	{
+		if (-idx > nelems)
+			idx = -1;
+		else
+			idx = nelems + idx;
+	}
+
+	if (idx > nelems)
+		idx = nelems;
+
+	return idx;
+}
+
+
+/*
+ * makeJsonbPath:
+ * Prepare the text array path for setPath. Every element is converted
+ * to an array index in advance, if it's an integer, so the path can be
+ * applied to many documents without parsing it again. The path refers to
+ * the array elements.
+ */
+JsonbPath *
+makeJsonbPath(ArrayType *array)
+{
+	JsonbPath  *path;
+	Datum	   *elems;
+	bool	   *nulls;
+	int			len;
+	int			i;
+
+	deconstruct_array(array, TEXTOID, -1, false, 'i',
+					  &elems, &nulls, &len);
+
+	path = allocJsonbPath(len);
+
+	for (i = 0; i < len; i++)
+	{
+		path->nulls[i] = nulls[i];
+		if (nulls[i])
+			continue;
+
+		path->keys[i] = VARDATA_ANY(elems[i]);
+		path->keylens[i] = VARSIZE_ANY_EXHDR(elems[i]);
+		path->isIndex[i] = parseArrayIndex(path->keys[i], path->keylens[i],
+										   &path->indexes[i]);
+	}
+
+	return path;
+}
+
+
+/*
+ * allocJsonbPath:
+ * Allocate a path of the given length with all elements unset.
+ */
+JsonbPath *
+allocJsonbPath(int len)
+{
+	JsonbPath  *path = palloc(sizeof(JsonbPath));
+	int			size = Max(len, 1);
+
+	path->len = len;
+	path->keys = palloc0(sizeof(char *) * size);
+	path->keylens = palloc0(sizeof(int) * size);
+	path->nulls = palloc0(sizeof(bool) * size);
+	path->indexes = palloc0(sizeof(int) * size);
+	path->isIndex = palloc0(sizeof(bool) * size);
+
+	return path;
+}
+
+
+/*
+ * compareJsonbKeys:
+ * Compare two keys in the same order, as they are stored in jsonb objects:
+ * shorter keys go first, keys of the same length are compared bytewise
+ * (see lengthCompareJsonbStringValue in jsonb_util.c).
+ */
+int
+compareJsonbKeys(const char *a, int alen, const char *b, int blen)
+{
+	if (alen == blen)
+		return memcmp(a, b, alen);
+
+	return (alen > blen) ? 1 : -1;
+}
+
+
+/*
+ * findJsonbKey:
+ * Binary search of the key in the object container.
+ * Keys of an object are stored sorted (see compareJsonbKeys), so only
+ * O(log n) of them must be compared.
+ * Returns the index of the key, or -1 if there is no such key. In the latter
+ * case insert_at (if it isn't NULL) is set to the position of the first key,
+ * which is greater than the specified one.
+ */
+int
+findJsonbKey(JsonbContainer *container, const char *key, int keylen,
+			 int *insert_at)
+{
+	uint32		count = container->header & JB_CMASK;
+	char	   *base_addr = (char *) (container->children + count * 2);
+	uint32		stopLow = 0,
+				stopHigh = count;
+
+	Assert(container->header & JB_FOBJECT);
+
+	while (stopLow < stopHigh)
+	{
+		uint32		stopMiddle = stopLow + (stopHigh - stopLow) / 2;
+		int			difference;
+
+		difference = compareJsonbKeys(base_addr + getJsonbOffset(container, stopMiddle),
+									  getJsonbLength(container, stopMiddle),
+									  key, keylen);
+
+		if (difference == 0)
+			return stopMiddle;
+		else if (difference < 0)
+			stopLow = stopMiddle + 1;
+		else
+			stopHigh = stopMiddle;
+	}
+
+	if (insert_at)
+		*insert_at = stopLow;
+
+	return -1;
+}
+
+
+/*
+ * getJsonbContainerValue:
+ * Fill the value by its JEntry index in the container without an iterator.
+ * For an object keys have indexes from 0 to count - 1, and values follow
+ * them. A nested container becomes a binary value.
+ */
+void
+getJsonbContainerValue(JsonbContainer *container, int index, JsonbValue *v)
+{
+	uint32		count = container->header & JB_CMASK;
+	uint32		nentries = (container->header & JB_FOBJECT) ? count * 2 : count;
+	char	   *base_addr = (char *) (container->children + nentries);
+	JEntry		entry = container->children[index];
+	uint32		offset = getJsonbOffset(container, index);
+
+	if (JBE_ISNULL(entry))
+		v->type = jbvNull;
+	else if (JBE_ISSTRING(entry))
+	{
+		v->type = jbvString;
+		v->val.string.val = base_addr + offset;
+		v->val.string.len = getJsonbLength(container, index);
+	}
+	else if (JBE_ISNUMERIC(entry))
+	{
+		v->type = jbvNumeric;
+		v->val.numeric = (Numeric) (base_addr + INTALIGN(offset));
+	}
+	else if (JBE_ISBOOL_TRUE(entry))
+	{
+		v->type = jbvBool;
+		v->val.boolean = true;
+	}
+	else if (JBE_ISBOOL_FALSE(entry))
+	{
+		v->type = jbvBool;
+		v->val.boolean = false;
+	}
+	else
+	{
+		Assert(JBE_ISCONTAINER(entry));
+		v->type = jbvBinary;
+		v->val.binary.data = (JsonbContainer *) (base_addr + INTALIGN(offset));
+		v->val.binary.len = getJsonbLength(container, index) -
+			(INTALIGN(offset) - offset);
+	}
+}
+
+
+/*
+ * setPathChanges:
+ * Check whether setPath with the same arguments will change anything.
+ * The path is followed with findJsonbKey for objects and by index for arrays
+ * without iterating over the whole containers, so a missing path costs only
+ * O(path_len * log n). Malformed path elements are reported with the same
+ * errors as in setPath.
+ */
+bool
+setPathChanges(JsonbContainer *container, JsonbPath *path, bool create)
+{
+	int			level;
+
+	for (level = 0; level < path->len; level++)
+	{
+		uint32		count = container->header & JB_CMASK;
+		int			idx;
+		uint32		nchildren;
+		JEntry		entry;
+
+		if (path->nulls[level])
+			elog(ERROR, "path element at the position %d is NULL", level + 1);
+
+		if (container->header & JB_FOBJECT)
+		{
+			idx = findJsonbKey(container, path->keys[level],
+							   path->keylens[level], NULL);
+			if (idx < 0)
+				return create && level == path->len - 1;
+
+			/* values are placed after all keys */
+			nchildren = count * 2;
+			idx += count;
+		}
+		else
+		{
+			idx = getPathArrayIndex(path, level);
+			if (idx < 0)
+				idx += count;
+
+			if (idx < 0 || idx >= count)
+				return create && level == path->len - 1;
+
+			nchildren = count;
+		}
+
+		if (level == path->len - 1)
+			return true;
+
+		entry = container->children[idx];
+		if (!JBE_ISCONTAINER(entry))
+		{
+			/* setPath stops at a scalar, checking only the next path element */
+			if (path->nulls[level + 1])
+				elog(ERROR, "path element at the position %d is NULL", level + 2);
+
+			return false;
+		}
+
+		container = (JsonbContainer *)
+			((char *) (container->children + nchildren) +
+			 INTALIGN(getJsonbOffset(container, idx)));
+	}
+
+	return false;
+}
+
+
+/*
+ * findJsonbPathValue:
+ * Follow the path the same way as setPathChanges. Returns false if there is
+ * no value at the path, otherwise the value is stored into *result, a nested
+ * container becomes a binary value. The path must not be empty.
+ */
+bool
+findJsonbPathValue(JsonbContainer *container, JsonbPath *path,
+				   JsonbValue *result)
+{
+	int			level;
+
+	Assert(path->len > 0);
+
+	for (level = 0; level < path->len; level++)
+	{
+		uint32		count = container->header & JB_CMASK;
+		int			idx;
+		uint32		nchildren;
+		JEntry		entry;
+
+		if (path->nulls[level])
+			elog(ERROR, "path element at the position %d is NULL", level + 1);
+
+		if (container->header & JB_FOBJECT)
+		{
+			idx = findJsonbKey(container, path->keys[level],
+							   path->keylens[level], NULL);
+			if (idx < 0)
+				return false;
+
+			nchildren = count * 2;
+			idx += count;
+		}
+		else
+		{
+			idx = getPathArrayIndex(path, level);
+			if (idx < 0)
+				idx += count;
+
+			if (idx < 0 || idx >= count)
+				return false;
+
+			nchildren = count;
+		}
+
+		if (level == path->len - 1)
+		{
+			getJsonbContainerValue(container, idx, result);
+			return true;
+		}
+
+		entry = container->children[idx];
+		if (!JBE_ISCONTAINER(entry))
+			return false;
+
+		container = (JsonbContainer *)
+			((char *) (container->children + nchildren) +
+			 INTALIGN(getJsonbOffset(container, idx)));
+	}
+
+	return false;
+}
+
+
+/*
+ * findJsonbPathContainer:
+ * The same as findJsonbPathValue, but the value is a container, or NULL if
+ * the value is a scalar. The empty path is the container itself.
+ */
+bool
+findJsonbPathContainer(JsonbContainer *container, JsonbPath *path,
+					   JsonbContainer **result)
+{
+	JsonbValue	v;
+
+	if (path->len == 0)
+	{
+		*result = container;
+		return true;
+	}
+
+	if (!findJsonbPathValue(container, path, &v))
+		return false;
+
+	*result = (v.type == jbvBinary) ? v.val.binary.data : NULL;
+	return true;
+}
+
+
+/*
+ * makePathTrieNode:
+ * Allocate a new node of the path trie for the path element.
+ */
+PathTrieNode *
+makePathTrieNode(Datum key)
+{
+	PathTrieNode *node = palloc0(sizeof(PathTrieNode));
+
+	node->key = key;
+	node->op = JSONB_MODIFY_NONE;
+
+	return node;
+}
+
+
+/*
+ * addPathToTrie:
+ * Add the path with the corresponding operation to the trie.
+ * Paths with a common prefix share nodes, so at the end the trie describes
+ * all modifications of every container, and jsonb can be modified in one pass.
+ * The latest operation for the same path wins. An operation replaces
+ * all previous operations below its path, since they are applied to
+ * the value, which doesn't exist anymore. The only exception is "add" of
+ * a new array element by the "-" key: every such path is a separate node,
+ * so all elements are appended in the order of operations.
+ */
+void
+addPathToTrie(PathTrieNode *root, Datum *path_elems, int path_len,
+			  int op, Jsonb *value)
+{
+	PathTrieNode	*node = root;
+	int				level;
+
+	for (level = 0; level < path_len; level++)
+	{
+		PathTrieNode	*child = NULL;
+		Datum			key = path_elems[level];
+		int				i;
+
+		if (op == JSONB_MODIFY_ADD && level == path_len - 1 && isAppendKey(key))
+			i = node->nchildren;
+		else
+			i = 0;
+
+		for (; i < node->nchildren; i++)
+		{
+			Datum		childkey = node->children[i]->key;
+
+			if (compareJsonbKeys(VARDATA_ANY(childkey), VARSIZE_ANY_EXHDR(childkey),
+								 VARDATA_ANY(key), VARSIZE_ANY_EXHDR(key)) == 0)
+			{
+				child = node->children[i];
+				break;
+			}
+		}
+
+		if (child == NULL)
+		{
+			if (node->size == 0)
+			{
+				node->size = 4;
+				node->children = palloc(sizeof(PathTrieNode *) * node->size);
+			}
+			else if (node->nchildren >= node->size)
+			{
+				node->size *= 2;
+				node->children = repalloc(node->children,
+										  sizeof(PathTrieNode *) * node->size);
+			}
+
+			child = makePathTrieNode(key);
+			child->order = node->nchildren;
+			node->children[node->nchildren++] = child;
+		}
+
+		node = child;
+	}
+
+	node->op = op;
+	node->value = value;
+	node->nchildren = 0;
+}
+
+
+/*
+ * modifyPath:
+ * Recursive modification function for jsonb_modify.
+ * It's the same as setPath, but instead of one path it follows all paths
+ * from the trie, whose node corresponds to the current container.
+ * The level is the position of children of the node in their paths.
+ */
+void
+modifyPath(JsonbIterator **it, PathTrieNode *node, JsonbWriter *w, int level)
+{
+	uint32		nvalues;
+
+	switch (enterPathValue(it, w, &nvalues))
+	{
+		case WJB_BEGIN_ARRAY:
+			modifyPathArray(it, node, w, level, nvalues);
+			leavePathContainer(it, w);
+			break;
+		case WJB_BEGIN_OBJECT:
+			modifyPathObject(it, node, w, level, nvalues);
+			leavePathContainer(it, w);
+			break;
+	}
+}
+
+/*
+ * Object walker for modifyPath
+ *
+ * Children of the node are sorted in the same order as object keys,
+ * so both of them are merged in one pass.
+ */
+static void
+modifyPathObject(JsonbIterator **it, PathTrieNode *node,
+				 JsonbWriter *w, int level, uint32 npairs)
+{
+	JsonbValue	k;
+	int			i,
+				c = 0;
+	uint32		nresult = npairs;
+	int			keyslen;
+
+	if (node->nchildren > 1)
+		qsort(node->children, node->nchildren, sizeof(PathTrieNode *),
+			  comparePathTrieNodes);
+
+	/* keys are added or deleted as in setPathObject, but for every child */
+	keyslen = getJsonbOffset((*it)->container, npairs);
+	for (c = 0; (c = nextTrieChild(node, c)) < node->nchildren; c++)
+	{
+		PathTrieNode	*child = node->children[c];
+		int				found;
+
+		found = findJsonbKey((*it)->container, VARDATA_ANY(child->key),
+							 VARSIZE_ANY_EXHDR(child->key), NULL);
+
+		if (found >= 0 && child->op == JSONB_MODIFY_DELETE)
+		{
+			nresult--;
+			keyslen -= getJsonbLength((*it)->container, found);
+		}
+		else if (found < 0 && (child->op == JSONB_MODIFY_SET ||
+							   child->op == JSONB_MODIFY_INSERT ||
+							   child->op == JSONB_MODIFY_ADD))
+		{
+			nresult++;
+			keyslen += VARSIZE_ANY_EXHDR(child->key);
+		}
+	}
+
+	if (nresult != npairs)
+		expectJsonbWriterValues(w, nresult);
+	expectJsonbWriterKeys(w, keyslen);
+
+	c = 0;
+	for (i = 0; i < npairs; i++)
+	{
+		int				r = JsonbIteratorNext(it, &k, true);
+		int				cmp = 1;
+		PathTrieNode	*child;
+
+		Assert(r == WJB_KEY);
+
+		/* all paths before the current key are missing in the object */
+		while ((c = nextTrieChild(node, c)) < node->nchildren &&
+			   (cmp = compareJsonbKeys(VARDATA_ANY(node->children[c]->key),
+									   VARSIZE_ANY_EXHDR(node->children[c]->key),
+									   k.val.string.val, k.val.string.len)) < 0)
+			addMissingPath(w, node->children[c++], level, true);
+
+		if (c >= node->nchildren || cmp != 0)
+		{
+			/* We are out of the specified paths, keep the value as is */
+			copyPathPair(it, w, &k);
+			continue;
+		}
+
+		child = node->children[c++];
+
+		switch (child->op)
+		{
+			case JSONB_MODIFY_DELETE:
+				skipPathValue(it);
+				break;
+			case JSONB_MODIFY_SET:
+			case JSONB_MODIFY_REPLACE:
+			case JSONB_MODIFY_ADD:
+				skipPathValue(it);
+				pushJsonbWriter(w, r, &k);
+				addModifiedJsonb(w, child, level + 1);
+				break;
+			case JSONB_MODIFY_INSERT:
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("cannot replace existing key"),
+						 errhint("Try using the operation \"set\" to replace key value.")));
+				break;
+			default:
+				pushJsonbWriter(w, r, &k);
+				modifyPath(it, child, w, level + 1);
+		}
+	}
+
+	/* the rest of paths are greater than all existing keys */
+	while ((c = nextTrieChild(node, c)) < node->nchildren)
+		addMissingPath(w, node->children[c++], level, true);
+}
+
+/*
+ * Array walker for modifyPath
+ *
+ * Path elements are converted to indexes with the same rules as in
+ * setPathArray, and refer to positions in the original array, so
+ * the order of operations doesn't shift them. The "-" key is the position
+ * after the last element.
+ */
+static void
+modifyPathArray(JsonbIterator **it, PathTrieNode *node,
+				JsonbWriter *w, int level, uint32 nelems)
+{
+	PathTrieIndex	*targets;
+	int				i,
+					c;
+
+	targets = palloc(sizeof(PathTrieIndex) * node->nchildren);
+
+	for (c = 0; c < node->nchildren; c++)
+	{
+		if (isAppendKey(node->children[c]->key))
+			targets[c].index = nelems;
+		else
+			targets[c].index = resolveArrayIndex(getArrayIndex(node->children[c]->key,
+															   level),
+												 nelems);
+		targets[c].order = c;
+		targets[c].node = node->children[c];
+	}
+
+	qsort(targets, node->nchildren, sizeof(PathTrieIndex), comparePathTrieIndexes);
+
+	for (c = 1; c < node->nchildren; c++)
+	{
+		if (targets[c].index == targets[c - 1].index &&
+			targets[c].index >= 0 && targets[c].index < nelems)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("path elements at the position %d refer to the same array element",
+							level + 1)));
+	}
+
+	/* prepend new elements */
+	c = 0;
+	while (c < node->nchildren && targets[c].index < 0)
+		addMissingPath(w, targets[c++].node, level, false);
+
+	/* iterate over the array elements */
+	for (i = 0; i < nelems; i++)
+	{
+		PathTrieNode	*child;
+
+		if (c >= node->nchildren || targets[c].index != i)
+		{
+			/* We are out of the specified paths, keep the element as is */
+			copyPathValue(it, w);
+			continue;
+		}
+
+		child = targets[c++].node;
+
+		switch (child->op)
+		{
+			case JSONB_MODIFY_DELETE:
+				skipPathValue(it);
+				break;
+			case JSONB_MODIFY_SET:
+			case JSONB_MODIFY_REPLACE:
+				skipPathValue(it);
+				addModifiedJsonb(w, child, level + 1);
+				break;
+			case JSONB_MODIFY_INSERT:
+			case JSONB_MODIFY_ADD:
+				/* new element goes before the existing one */
+				addModifiedJsonb(w, child, level + 1);
+				copyPathValue(it, w);
+				break;
+			default:
+				modifyPath(it, child, w, level + 1);
+		}
+	}
+
+	/* append new elements */
+	while (c < node->nchildren)
+		addMissingPath(w, targets[c++].node, level, false);
+
+	pfree(targets);
+}
+
+
+/*
+ * Add the new value of the path, which doesn't exist in the jsonb.
+ * Like in setPath, only the last path element can be created, so
+ * it makes sense only for set, insert and add (replace doesn't create keys).
+ */
+static void
+addMissingPath(JsonbWriter *w, PathTrieNode *node, int level, bool isObject)
+{
+	if (node->op != JSONB_MODIFY_SET && node->op != JSONB_MODIFY_INSERT &&
+		node->op != JSONB_MODIFY_ADD)
+		return;
+
+	if (isObject)
+		pushJsonbWriterKey(w, VARDATA_ANY(node->key), VARSIZE_ANY_EXHDR(node->key));
+
+	addModifiedJsonb(w, node, level + 1);
+}
+
+
+/*
+ * Add the new value of the node, applying on the fly all operations for
+ * paths below it.
+ */
+static void
+addModifiedJsonb(JsonbWriter *w, PathTrieNode *node, int level)
+{
+	if (node->nchildren > 0 && !JB_ROOT_IS_SCALAR(node->value))
+	{
+		JsonbIterator	*it = JsonbIteratorInit(&node->value->root);
+
+		modifyPath(&it, node, w, level);
+	}
+	else
+	{
+		JsonbValue	v;
+
+		JsonbToJsonbValue(node->value, &v);
+		pushJsonbWriter(w, WJB_VALUE, &v);
+	}
+}
+
+
+/*
+ * Position of the child of the object node to apply, starting from c.
+ * Every "add" of the "-" key is a separate child, they are sorted in the
+ * order of operations, and only the latest one is applied, since an object
+ * can't have the same key twice.
+ */
+static int
+nextTrieChild(PathTrieNode *node, int c)
+{
+	while (c + 1 < node->nchildren &&
+		   compareJsonbKeys(VARDATA_ANY(node->children[c]->key),
+							VARSIZE_ANY_EXHDR(node->children[c]->key),
+							VARDATA_ANY(node->children[c + 1]->key),
+							VARSIZE_ANY_EXHDR(node->children[c + 1]->key)) == 0)
+		c++;
+
+	return c;
+}
+
+
+static int
+comparePathTrieNodes(const void *a, const void *b)
+{
+	PathTrieNode *na = *(PathTrieNode * const *) a;
+	PathTrieNode *nb = *(PathTrieNode * const *) b;
+	int			cmp;
+
+	cmp = compareJsonbKeys(VARDATA_ANY(na->key), VARSIZE_ANY_EXHDR(na->key),
+						   VARDATA_ANY(nb->key), VARSIZE_ANY_EXHDR(nb->key));
+
+	/* the same key is possible only for "-", the latest value must win */
+	if (cmp == 0)
+		cmp = (na->order > nb->order) ? 1 : -1;
+
+	return cmp;
+}
+
+static int
+comparePathTrieIndexes(const void *a, const void *b)
+{
+	const PathTrieIndex *pa = (const PathTrieIndex *) a;
+	const PathTrieIndex *pb = (const PathTrieIndex *) b;
+
+	if (pa->index != pb->index)
+		return (pa->index > pb->index) ? 1 : -1;
+
+	/* keep the order of operations for new elements */
+	return (pa->order > pb->order) ? 1 : ((pa->order < pb->order) ? -1 : 0);
+}
+
+
+/*
+ * Is the path element "-", which means a new element after the last one
+ * in JSON Pointer (RFC 6901)
+ */
+static bool
+isAppendKey(Datum key)
+{
+	return VARSIZE_ANY_EXHDR(key) == 1 && *VARDATA_ANY(key) == '-';
 }
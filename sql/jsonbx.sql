@@ -2,6 +2,28 @@ CREATE EXTENSION jsonbx;
 
 select jsonb_pretty('{"a": "test", "b": [1, 2, 3], "c": "test3", "d":{"dd": "test4", "dd2":{"ddd": "test5"}}}'::jsonb);
 
+-- limited depth and size
+select jsonb_pretty('{"a": "test", "b": [1, 2, 3], "c": "test3", "d":{"dd": "test4", "dd2":{"ddd": "test5"}}}'::jsonb, 1, -1);
+select jsonb_pretty('{"a": "test", "b": [1, 2, 3], "c": "test3", "d":{"dd": "test4", "dd2":{"ddd": "test5"}}}'::jsonb, 2, -1);
+select jsonb_pretty('{"a": "test", "b": [1, 2, 3], "c": "test3", "d":{"dd": "test4", "dd2":{"ddd": "test5"}}}'::jsonb, 0, -1);
+select jsonb_pretty('[1, 2, 3, 4, 5]'::jsonb, -1, 10);
+select jsonb_pretty('[[1, 2], [3]]'::jsonb, 1, 100);
+select jsonb_pretty('"abc"'::jsonb, 0, -1);
+
+-- serialization with the given indent and compact mode
+select jsonb_serialize('{"a": [1, 2], "b": {"c": "x\ty"}}', 0, true);
+select jsonb_serialize('{"a": [1, 2], "b": {"c": "x\ty"}}', 0, false);
+select jsonb_serialize('{"a": [1, 2], "b": {"c": "x\ty"}}', 2, false);
+select jsonb_serialize('{"a": [1, 2], "b": {"c": "x\ty"}}', 2, true);
+select jsonb_serialize('{"a": [1, 2], "b": {"c": "x\ty"}}', 0, true, 1, -1);
+select jsonb_serialize('{"a": [1, 2], "b": {"c": "x\ty"}}', 0, true, -1, 10);
+select jsonb_serialize(j, 0, false) = j::text from (select '{"a": [1, "\u0001\"", null, true, 1.50], "bb": {}}'::jsonb as j) t;
+select jsonb_serialize('[1]', -1, true);
+select jsonb_serialize('[0, -1, 1.50, 0.001, 12345678901234567890, -0.5e-3, 100000, 1e40, 1.5e-40]', 0, false);
+select jsonb_serialize(j, 0, false) = j::text from (select '[1e130, -1.5e-130, 123.456e5, 0.00, -0]'::jsonb as j) t;
+select jsonb_serialize(j, 0, false) = j::text from (select jsonb_set('{}', '{a}', to_json(repeat('long "text"\ with ' || chr(9) || ' escapes', 10))::text::jsonb) as j) t;
+select jsonb_pretty('["0123456789abcdef0123456789abcdef\"0123456789abcdef\\", "\u001f\u0020\n"]');
+
 select jsonb_concat('{"d": "test", "a": [1, 2]}'::jsonb, '{"g": "test2", "c": {"c1":1, "c2":2}}'::jsonb);
 
 select '{"aa":1 , "b":2, "cq":3}'::jsonb || '{"cq":"l", "b":"g", "fg":false}';
@@ -29,6 +51,24 @@ select pg_column_size('{"aa":1}'::jsonb || '{"b":2}'::jsonb) = pg_column_size('{
 select pg_column_size('{"aa":1, "b":2}'::jsonb || '{}'::jsonb) = pg_column_size('{"aa":1, "b":2}'::jsonb);
 select pg_column_size('{}'::jsonb || '{"aa":1, "b":2}'::jsonb) = pg_column_size('{"aa":1, "b":2}'::jsonb);
 
+select '{"a": {"b": 1}, "c": [1, 2], "dd": 3}'::jsonb || '{"c": {"e": 4}, "b": null, "eee": [5]}';
+select '[1, [2, {"a": 3}]]'::jsonb || '[{"b": [4]}, 5.5]';
+select '"a"'::jsonb || '"b"';
+select pg_column_size('{"a": {"b": 1.5}, "c": 2}'::jsonb || '{"c": [3], "d": 4}'::jsonb)
+         = pg_column_size('{"a": {"b": 1.5}, "c": [3], "d": 4}'::jsonb);
+
+-- deep concatenation
+select jsonb_deep_concat('{"a": {"b": 1, "c": [1, 2]}, "d": 1}', '{"a": {"c": [2, 3], "e": 2}, "f": 3}');
+select jsonb_deep_concat('{"a": {"b": 1, "c": [1, 2]}, "d": 1}', '{"a": {"c": [2, 3], "e": 2}, "f": 3}', 'append');
+select jsonb_deep_concat('{"a": {"b": 1, "c": [1, 2]}, "d": 1}', '{"a": {"c": [2, 3], "e": 2}, "f": 3}', 'union');
+select '{"a": {"b": {"c": 1}}}'::jsonb #|| '{"a": {"b": {"d": 2}}}';
+select '{"a": {"b": 1}}'::jsonb #|| '{"a": 2}';
+select '{"a": 1}'::jsonb #|| '{"a": {"b": 2}}';
+select jsonb_deep_concat('[1, {"a": 1}]', '[{"a": 1}, 2, 2]', 'union');
+select '[1]'::jsonb #|| '[2]';
+select '{}'::jsonb #|| '{"a": 1}';
+select jsonb_deep_concat('{"a": 1}', '{"a": 2}', 'merge');
+
 select jsonb_delete('{"a":1 , "b":2, "c":3}'::jsonb, 'a');
 select jsonb_delete('{"a":1}'::jsonb, 'a');
 select jsonb_delete('"a"'::jsonb, 'a');
@@ -94,6 +134,36 @@ select jsonb_set('{"n":null, "a":1, "b":[1,2], "c":{"1":2}, "d":{"1":[2,3]}}'::j
 select jsonb_set('{"n":null, "a":1, "b":[1,2], "c":{"1":2}, "d":{"1":[2,3]}}'::jsonb, '{b,-1}', '"test"');
 select jsonb_set('{"n":null, "a":1, "b":[1,2], "c":{"1":2}, "d":{"1":[2,3]}}'::jsonb, '{b,-1}', '{"f": "test"}');
 
+-- untouched nested values are copied as is
+select jsonb_set('{"a": {"b": 1.5, "c": [1, "x", null]}, "d": {"e": true}}', '{d,e}', 'false');
+select jsonb_set('[{"a": [1, 2]}, 2.5, [[3], {"b": "c"}]]', '{1}', '{"d": [4]}');
+select pg_column_size(jsonb_set('{"a": {"b": 1.5, "c": [1, "x", null]}, "d": 1}', '{d}', '2'))
+         = pg_column_size('{"a": {"b": 1.5, "c": [1, "x", null]}, "d": 2}'::jsonb);
+select '[1, [2, 3], {"a": [4]}]'::jsonb - 0;
+select '{"a": [1, {"b": 2}], "c": 3}'::jsonb - '{c}'::text[];
+
+-- keys are looked up only on the top level
+select '{"a": {"b": 1}, "b": 2}'::jsonb - 'b';
+select '[["a"], "a", "a"]'::jsonb - 'a';
+
+-- new keys are placed in order
+select jsonb_set('{"a": 1, "ccc": 3, "bb": 2}', '{b}', '0');
+select jsonb_set('{"a": 1, "ccc": 3, "bb": 2}', '{dddd}', '4');
+select jsonb_set('{"b": 1, "ccc": 3, "bb": 2}', '{a}', '0');
+
+-- wide objects
+create table test_wide as
+    select ('{' || string_agg(format('"k%s": %s', i, i), ', ') || '}')::jsonb as doc
+    from generate_series(1, 100) i;
+select (doc - 'k50') ? 'k50' from test_wide;
+select (doc - 'k50') ? 'k51' from test_wide;
+select (doc - 'k500') = doc from test_wide;
+select jsonb_set(doc, '{k77}', '"x"') -> 'k77' from test_wide;
+select jsonb_set(doc, '{k777}', '"x"') -> 'k777' from test_wide;
+select jsonb_set(doc, '{k777}', '"x"', false) = doc from test_wide;
+select (doc - '{k5}'::text[]) ? 'k5' from test_wide;
+drop table test_wide;
+
 -- empty structure and error conditions for delete and replace
 
 select '"a"'::jsonb - 'a'; -- error
@@ -109,6 +179,12 @@ select jsonb_set('"a"','{a}','"b"'); --error
 select jsonb_set('{}','{a}','"b"', false);
 select jsonb_set('[]','{1}','"b"', false);
 
+-- the same path and value for many rows, and different ones
+
+select jsonb_set(j, '{a,1}', '"x"') from (values ('{"a": [1, 2]}'::jsonb), ('{"a": [3]}'), ('{"b": 1}')) t(j);
+select jsonb_set('{"a": [1, 2], "b": {"c": 1}}', p, v) from (values ('{a,0}'::text[], '3'::jsonb), ('{b,c}', '[4]'), ('{b,d}', '{"e": 5}')) t(p, v);
+select j - '{a,-1}'::text[] from (values ('{"a": [1, 2]}'::jsonb), ('{"a": [3]}'), ('{"a": {"-1": 1}}')) t(j);
+
 -- jsonb_set adding instead of replacing
 
 -- prepend to array
@@ -133,3 +209,215 @@ select jsonb_set('[]','{-99}','{"foo":123}');
 select jsonb_set('{"a": [1, 2, 3]}', '{a, non_integer}', '"new_value"');
 select jsonb_set('{"a": {"b": [1, 2, 3]}}', '{a, b, non_integer}', '"new_value"');
 select jsonb_set('{"a": {"b": [1, 2, 3]}}', '{a, b, NULL}', '"new_value"');
+
+-- multiple operations in one pass
+
+select jsonb_modify('{"a": 1, "b": {"c": 2, "d": [1, 2, 3]}}',
+                    '{{a, NULL, NULL}, {b, c, NULL}, {b, d, 0}, {b, d, 5}, {e, NULL, NULL}}',
+                    ARRAY['10', NULL, '"x"', '4', '{"f": 1}']::jsonb[],
+                    '{set, delete, set, set, insert}');
+select jsonb_modify('{"a": {"b": 1}}', '{a, b}', ARRAY['2']::jsonb[], '{set}');
+select jsonb_modify('[1, 2, 3]', '{{1}, {-1}}', ARRAY['"a"', '"b"']::jsonb[], '{insert, insert}');
+select jsonb_modify('[1, 2, 3]', '{{0}, {2}, {-5}, {7}}', ARRAY[NULL, '"a"', '"b"', '"c"']::jsonb[], '{delete, set, set, insert}');
+select jsonb_modify('{"a": 1}', '{{a, NULL}, {a, b}}', ARRAY['{"c": 1}', '2']::jsonb[], '{set, set}');
+select jsonb_modify('{"a": {"b": 1}}', '{{a, b}, {a, NULL}}', ARRAY['2', '{"c": 1}']::jsonb[], '{set, set}');
+select jsonb_modify('{"a": 1, "b": 2}', '{{a}, {a}}', ARRAY['3', NULL]::jsonb[], '{set, delete}');
+select jsonb_modify('{"a": 1}', '{{x, y}, {z, NULL}}', ARRAY['1', NULL]::jsonb[], '{set, delete}');
+select jsonb_modify('{"a": 1}', '{}', '{}', '{}');
+select jsonb_modify('{"a": 1}', '{{a}}', ARRAY['2']::jsonb[], '{insert}');
+select jsonb_modify('{"a": 1}', '{{a}}', ARRAY['2']::jsonb[], '{replace}');
+select jsonb_modify('{"a": 1}', '{{a}}', ARRAY[NULL]::jsonb[], '{set}');
+select jsonb_modify('{"a": 1}', '{{a}, {b}}', ARRAY['2']::jsonb[], '{set, set}');
+select jsonb_modify('{"a": [1, 2]}', '{{a, 0}, {a, -2}}', ARRAY['3', '4']::jsonb[], '{set, set}');
+select jsonb_modify('{"a": 1}', '{{NULL, a}}', ARRAY['2']::jsonb[], '{set}');
+select jsonb_modify('"a"', '{{a}}', ARRAY['2']::jsonb[], '{set}');
+
+-- filtering of keys
+
+select jsonb_delete_keys('{"a": 1, "b": {"c": 2}, "cc": 3, "d": 4}', '{d, b, x, NULL}');
+select jsonb_select_keys('{"a": 1, "b": {"c": 2}, "cc": 3, "d": 4}', '{d, b, x, NULL}');
+select jsonb_delete_keys('{"a": 1}', '{x}');
+select jsonb_delete_keys('{"a": 1}', '{a, a}');
+select jsonb_select_keys('{"a": 1}', '{x}');
+select jsonb_select_keys('{"a": 1, "b": 2}', '{b, a, a}');
+select jsonb_delete_keys('{"a": 1, "b": 2}', '{}');
+select jsonb_delete_keys('["a", "b", 1, "c", "a"]', '{a, c}');
+select jsonb_select_keys('["a", "b", 1, "c", "a"]', '{a, c}');
+select jsonb_delete_keys('"a"', '{a}');
+select jsonb_select_keys('"a"', '{a}');
+
+-- concatenation aggregate
+
+select jsonb_concat_agg(j) from (values ('{"a": 1, "b": 2}'::jsonb), ('{"b": 3, "c": [1]}'), ('{"a": {"d": 4}}')) t(j);
+select jsonb_concat_agg(j) from (values ('[1, 2]'::jsonb), ('[3]'), ('"x"'), ('[[4]]')) t(j);
+select jsonb_concat_agg(j) from (values ('{"a": 1}'::jsonb), ('{"b": 2, "a": 3}'), ('[3]'), ('{"c": 4}')) t(j);
+select jsonb_concat_agg(j) from (values ('"x"'::jsonb), ('{"a": 1}')) t(j);
+select jsonb_concat_agg(j) from (values ('{"a": 1}'::jsonb), ('{"b": 2}'), ('"x"')) t(j);
+select jsonb_concat_agg(j) from (values ('{"a": 1}'::jsonb), ('[1]'), ('"x"')) t(j);
+select jsonb_concat_agg(j) from (values ('"x"'::jsonb)) t(j);
+select jsonb_concat_agg(j) from (values (NULL::jsonb), ('{"a": 1}'), (NULL)) t(j);
+select jsonb_concat_agg(j) from (values ('{"a": 1}'::jsonb)) t(j) where false;
+select jsonb_concat_agg(('{"k' || (i % 10) || '": ' || i || '}')::jsonb order by i) from generate_series(1, 100) i;
+select count(*) from jsonb_each((select jsonb_concat_agg(('{"k' || i || '": ' || i || '}')::jsonb) from generate_series(1, 1000) i));
+select k, jsonb_concat_agg(j order by j) from (values (1, '{"a": 1}'::jsonb), (2, '[1]'), (1, '{"b": 2}'), (2, '[2]')) t(k, j) group by k order by k;
+-- empty values are skipped as by ||
+select jsonb_concat_agg(j) from (values ('{}'::jsonb), ('[1]')) t(j);
+select jsonb_concat_agg(j) from (values ('[1]'::jsonb), ('{}')) t(j);
+select jsonb_concat_agg(j) from (values ('{}'::jsonb), ('[]')) t(j);
+select jsonb_concat_agg(j) from (values ('{"a": 1}'::jsonb), ('[]'), ('{"b": 2}')) t(j);
+select jsonb_concat_agg(j) from (values ('[]'::jsonb), ('"x"')) t(j);
+select jsonb_concat_agg(j) from (values ('[1]'::jsonb), ('{"a": [2]}'), ('{}'), ('[]'), ('"x"')) t(j);
+
+-- preparsed paths
+
+select '{a, b, -1, "c d"}'::jsonbx_path;
+select '{}'::jsonbx_path;
+select ARRAY['a', '1']::jsonbx_path;
+select jsonbx_set('{"a": [1, {"b": 2}]}', '{a, -1, b}', '3');
+select jsonbx_set('{"a": [1, 2]}', '{a, x}', '3');
+select '{"a": [1, 2], "b": 3}'::jsonb - '{a, 0}'::jsonbx_path;
+select jsonb_delete('{"a": {"b": 1, "c": 2}}', '{a, c}'::jsonbx_path);
+select '{a, NULL}'::jsonbx_path;
+select '{{a}, {b}}'::jsonbx_path;
+-- binary format is the one of text[]
+select jsonbx_path_send('{a, -1, "c d"}') = array_send('{a, -1, "c d"}'::text[]);
+
+-- array splices
+
+select jsonb_array_delete_range('[1, "a", 2, {"b": 3}, [4], null, 5.5]', '{}', 1, 3);
+select jsonb_array_delete_range('[1, 2, 3, 4]', '{}', -3, -2);
+select jsonb_array_delete_range('[1, 2, 3, 4]', '{}', 2, 100);
+select jsonb_array_delete_range('[1, 2, 3, 4]', '{}', -100, 0);
+select jsonb_array_delete_range('[1, 2, 3, 4]', '{}', 3, 1);
+select jsonb_array_delete_range('{"a": {"b": ["x", 1, [2], "yy", 3]}, "c": 4}', '{a, b}', 0, 1);
+select jsonb_array_delete_range('{"a": [1, 2]}', '{x}', 0, 1);
+select jsonb_array_delete_range('{"a": {"b": 1}}', '{a}', 0, 1);
+select jsonb_array_delete_range('1', '{}', 0, 1);
+select jsonb_array_delete_range(('[' || string_agg('"e' || i || '"', ', ') || ', 1.5, {"z": 1}]')::jsonb, '{}', 0, 97) from generate_series(1, 100) i;
+select jsonb_array_insert('[1, "a", 2]', '{}', 1, ARRAY['"bb"', '2.5', '{"c": [3]}', 'null']::jsonb[]);
+select jsonb_array_insert('[1, 2]', '{}', -1, ARRAY['3']::jsonb[]);
+select jsonb_array_insert('[1, 2]', '{}', 100, ARRAY['3']::jsonb[]);
+select jsonb_array_insert('[1, 2]', '{}', -100, ARRAY['3']::jsonb[]);
+select jsonb_array_insert('{"a": ["x", 1], "b": 2}', '{a}', 1, ARRAY['"y"', '[true]']::jsonb[]);
+select jsonb_array_insert('[[1], [2]]', '{-1}', 0, ARRAY['0']::jsonb[]);
+select jsonb_array_insert('[]', '{}', 0, ARRAY['1', '2']::jsonb[]);
+select jsonb_array_insert('[1]', '{}', 0, '{}');
+select jsonb_array_insert('[1]', '{}', 0, ARRAY['2', NULL]::jsonb[]);
+select jsonb_array_insert('"a"', '{}', 0, ARRAY['2']::jsonb[]);
+select '["a", 1, {"b": [2]}, "c"]'::jsonb - 1;
+
+-- generated documents
+
+select jsonbx_generate(2, 3, 2, 4, 42);
+select jsonbx_generate(2, 4, 0, 3, 7, 'array');
+select jsonbx_generate(3, 2, 1, 2, 1, 'mixed');
+select jsonbx_generate(1, 3, 1, 1, -5);
+select jsonbx_generate(0, 5, 1, 5, 3);
+select count(*) from jsonb_object_keys(jsonbx_generate(1, 1000, 0, 8, 1));
+select jsonbx_generate(100, 10, 1, 1, 1);
+select jsonbx_generate(1, 1, 1, 1, 1, 'tree');
+select jsonbx_generate(1, -1, 1, 1, 1);
+select calls, p50_us <= p99_us as ordered, bytes_per_call > 0 as allocates from jsonbx_bench_call('jsonb_pretty(jsonb)', 10, '{"a": [1, 2]}'::jsonb);
+select calls from jsonbx_bench_call('jsonb_pretty(jsonb)', 10, 1);
+select calls from jsonbx_bench_call('jsonb_set(jsonb,text[],jsonb,boolean)', 10, '{}'::jsonb);
+select * from jsonbx_stats;
+select jsonbx_stats_reset();
+set jsonbx.track_stats = off;
+select jsonb_concat('{"a": 1}', '{"b": 2}');
+reset jsonbx.track_stats;
+-- chains of calls are folded into jsonbx_chain
+select jsonb_set(jsonb_set('{"a": 1, "b": {"c": 2}}', '{b,c}', '3'), '{d}', '4');
+select (('{"a": 1, "b": 2}'::jsonb || '{"c": 3}') - 'a') || '{"d": {"e": 5}}';
+select jsonb_set(jsonb_set('{"a": [1, 2]}', '{a,-1}', '3'), '{b}', '[]');
+select jsonb_set(jsonb_set('{"a": {"b": 1}}', '{a,c}', '2', false), '{d}', '3', false);
+select jsonb_set(jsonb_set('{"a": 1}', '{a}', '2'), '{a}', '3');
+select jsonb_set(jsonb_set('{"a": {}}', '{a}', '{"x": 1}'), '{a,y}', '2');
+select jsonb_set('{"a": 1, "b": 2}'::jsonb - 'a', '{a,x}', '1');
+select ('{"a": 1, "b": {"c": 1}}'::jsonb - '{b,c}'::text[]) || '{"b": 2}';
+select ('{"a": [1, 2, 3]}'::jsonb - '{a,0}'::text[]) - '{a,0}'::text[];
+select (('["x", 1]'::jsonb || '["y"]') - 'x') || '{"z": 1}';
+select ('{"a": 1}'::jsonb - 'b') || '[2]';
+select jsonb_set('{"a": 1}'::jsonb || '"b"', '{c}', '1');
+-- variadic concatenation
+select jsonb_concat('{"a": 1, "b": 2}', '{"b": 3, "cc": 4}', '{"a": 5, "d": 6}');
+select jsonb_concat('{}', '{"a": 1}', '{}');
+select jsonb_concat('[1, 2]', '[]', '[3, {"a": 4}]');
+select jsonb_concat('{"a": 1}', '[2]', '{"b": 3}');
+select jsonb_concat('{"a": 1}', NULL, '{"b": 2}');
+select jsonb_concat('{"a": 1}');
+select (('{"a": [1]}'::jsonb - '{a,0}'::text[]) || '{"b": 1}') || '{"a": 2}';
+-- the transform is installed and fires
+explain (verbose, costs off) select ('{"a": 1}'::jsonb || '{"b": 2}') - 'a';
+-- long array indexes
+select jsonb_set('[1, 2]', '{000000000000000000000000000000001}', '5');
+select jsonb_set('[1, 2]', '{000000000000000000000000000000001}'::text[], '5');
+-- containers with more than 32 elements
+select jsonb_set(o, '{k7}', '[7]') = o || '{"k7": [7]}' from (select ('{' || string_agg('"k' || i || '": ' || i, ', ') || '}')::jsonb from generate_series(1, 40) i) o(o);
+select pg_column_size(o - 'k7') = pg_column_size(jsonb_delete_keys(o, '{k7}')) from (select ('{' || string_agg('"k' || i || '": ' || i, ', ') || '}')::jsonb from generate_series(1, 40) i) o(o);
+select jsonb_array_length(jsonb_set(a, '{-41}', '0', true) - 0) from (select ('[' || string_agg(i::text, ', ') || ']')::jsonb from generate_series(1, 40) i) a(a);
+-- diff and patch
+select jsonb_diff('{"a": 1, "b": {"c": [1, 2, 3]}, "d": "x"}', '{"a": 1, "b": {"c": [1, 5, 3, 4]}, "e": true}');
+select jsonb_diff('[1, 2, 3, 4, 5]', '[1, 4, 5]');
+select jsonb_diff('{"a/b": 1, "~": 2}', '{"a/b": 2}');
+select jsonb_diff('{"a": [1, {"b": 2}]}', '{"a": [1, {"b": 2}]}');
+select jsonb_diff('{"a": 1}', '[1]');
+select jsonb_diff('1', '"x"');
+select jsonb_patch(d1, jsonb_diff(d1, d2)) = d2 from (values ('{"a": 1, "b": {"c": [1, 2, 3]}, "d": "x"}'::jsonb, '{"a": 1, "b": {"c": [1, 5, 3, 4]}, "e": true}'::jsonb)) v(d1, d2);
+select jsonb_patch('{"a": [1, 2]}', '[{"op": "add", "path": "/a/-", "value": 3}, {"op": "add", "path": "/a/0", "value": 0}, {"op": "remove", "path": "/b"}, {"op": "add", "path": "/c", "value": {"d": 1}}]');
+select jsonb_patch('{"a": 1}', '[{"op": "replace", "path": "/b", "value": 2}, {"op": "replace", "path": "/a", "value": 3}]');
+select jsonb_patch('{"a": 1}', '[{"op": "replace", "path": "", "value": [1]}, {"op": "add", "path": "/-", "value": 2}]');
+select jsonb_patch('{"a": 1}', '[]');
+select jsonb_patch('{"a": 1}', '[{"op": "move", "path": "/a"}]');
+select jsonb_patch('{"a": 1}', '[{"op": "add", "path": "a", "value": 1}]');
+select jsonb_patch('{"a": 1}', '[{"op": "add", "path": "/a"}]');
+select jsonb_patch('{"a": 1}', '{"op": "remove", "path": "/a"}');
+-- increment
+select jsonb_increment('{"stats": {"hits": 41}, "a": [1]}', '{stats,hits}');
+select jsonb_increment('{"a": 1.5}', '{a}', 2.25);
+select jsonb_increment('{"a": 9999, "b": true}', '{a}');
+select jsonb_increment('{"a": [1, 2]}', '{a,-1}', -2);
+select jsonb_increment('{"a": {}}', '{a,b}', 5);
+select jsonb_increment('{"a": 1}', '{b,c}');
+select jsonb_increment('{"a": "x"}', '{a}');
+select jsonb_increment('1', '{a}');
+select jsonb_increment('{"a": 1}', '{a}', 'NaN');
+select jsonb_increment('{"a": 1}', '{b}', 'NaN');
+-- the stored value with a short header or TOASTed out of line stays intact
+create table test_increment (id int, doc jsonb);
+alter table test_increment alter column doc set storage external;
+insert into test_increment
+    values (1, '{"n": 41, "s": "x"}'),
+           (2, ('{"n": 41, "s": "' || repeat('x', 10000) || '"}')::jsonb);
+select id, jsonb_increment(doc, '{n}') = jsonb_set(doc, '{n}', '42') as same
+from test_increment order by id;
+select id, doc -> 'n' as n from test_increment order by id;
+drop table test_increment;
+-- chunked arrays
+select '[1, "a", {"b": 2}]'::jsonbx_array;
+select '[1]'::jsonbx_array || '[2, 3]';
+select '[1]'::jsonbx_array || '{"a": 1}';
+select '[1]'::jsonbx_array || '"x"';
+select '[1, 2, 3]'::jsonbx_array - 1;
+select '[1, 2, 3]'::jsonbx_array - -1;
+select '[1, 2, 3]'::jsonbx_array - 3;
+select jsonbx_array('{"a": 1}'::jsonb);
+select jsonbx_array_send('[1, "a", {"b": 2}]') = jsonb_send('[1, "a", {"b": 2}]');
+select (jsonbx_array(j) || '[300, 301]')::jsonb = j || '[300, 301]' from (select ('[' || string_agg(i::text, ', ') || ']')::jsonb from generate_series(0, 299) i) t(j);
+select (jsonbx_array(j) - 200 - 0 - -1)::jsonb = j - 200 - 0 - -1 from (select ('[' || string_agg(i::text, ', ') || ']')::jsonb from generate_series(0, 299) i) t(j);
+select (jsonbx_array(j) || '"x"') -> 300 from (select ('[' || string_agg(i::text, ', ') || ']')::jsonb from generate_series(0, 299) i) t(j);
+select jsonb_pretty('[1, {"a": 2}]'::jsonbx_array);
+-- recursive key removal
+select jsonb_strip_key('{"a": 1, "b": {"a": 2, "c": [{"a": 3, "d": 4}, "a"]}}', '{a}');
+select jsonb_strip_key('{"a": {"b": 1}, "c": {"d": {"b": 2, "e": 3}}}', '{b, e, NULL, b}');
+select jsonb_strip_key('[{"a": 1}, [{"b": {"a": 2}}]]', '{a}');
+select jsonb_strip_key('{"a": 1}', '{x}');
+select jsonb_strip_key('"a"', '{a}');
+select jsonb_strip_key('{"a": 1}', '{{a}}');
+select jsonb_strip_key(o, '{k7, k33}') = o - 'k7' - 'k33' from (select ('{' || string_agg('"k' || i || '": ' || i, ', ') || '}')::jsonb from generate_series(1, 40) i) o(o);
+-- per-call arena
+set jsonbx.use_arena = on;
+select jsonb_set('{"a": {"b": 1}}', '{a,b}', '[2]') || '{"c": 3}';
+select ('{"a": 1}'::jsonb || '{"b": 2}') - 'a';
+select '{"a": 1}'::jsonb || '{}';
+select jsonb_concat_agg(j) from (values ('{"a": 1}'::jsonb), ('{"a": 2, "b": 3}')) v(j);
+reset jsonbx.use_arena;